@@ -48,6 +48,8 @@ static const char *methodToString(KDirWatch::Method method)
         return "Stat";
     case KDirWatch::QFSWatch:
         return "QFSWatch";
+    case KDirWatch::FANotify:
+        return "FANotify";
     }
     return "ERROR!";
 }
@@ -93,6 +95,13 @@ public:
 private Q_SLOTS: // test methods
     void initTestCase()
     {
+        // Without the privileges for fanotify KDirWatch falls back to
+        // inotify, which is tested on its own already.
+        if (qstrcmp(KDIRWATCH_TEST_METHOD, "FANotify") == 0 &&
+                s_staticObject()->m_dirWatch.internalMethod() != KDirWatch::FANotify) {
+            QSKIP("fanotify is not usable here, it needs CAP_SYS_ADMIN");
+        }
+
         QFileInfo pathInfo(m_path);
         QVERIFY(pathInfo.isDir() && pathInfo.isWritable());
 
@@ -118,6 +127,8 @@ private Q_SLOTS: // test methods
     void testHardlinkChange();
     void stopAndRestart();
     void shouldIgnoreQrcPaths();
+    void addDirRecursive();
+    void batchedChanges();
     void benchCreateTree();
     void benchCreateWatcher();
     void benchNotifyWatcher();
@@ -808,6 +819,85 @@ void KDirWatch_UnitTest::shouldIgnoreQrcPaths()
     QVERIFY(QDir::setCurrent(oldCwd));
 }
 
+void KDirWatch_UnitTest::addDirRecursive()
+{
+    QTemporaryDir dir;
+    createDirectoryTree(dir.path(), 2);
+    const QString nestedDir = dir.path() + QLatin1String("/subdir4/subdir4");
+
+    KDirWatch watch;
+    watch.addDirRecursive(dir.path());
+    QVERIFY(watch.contains(dir.path()));
+    QTRY_VERIFY(watch.contains(nestedDir));
+    QVERIFY(watch.contains(dir.path() + QLatin1String("/subdir0")));
+
+    waitUntilMTimeChange(nestedDir);
+    createFile(nestedDir + QLatin1String("/newFile"));
+    QVERIFY(waitForOneSignal(watch, SIGNAL(dirty(QString)), nestedDir));
+
+    // Removing the tree while it is still being walked must not leave anything behind.
+    // The walk stops early once cancelled, so by the time another complete walk
+    // of the same tree is done the cancelled one is as well.
+    KDirWatch watch2;
+    watch2.addDirRecursive(dir.path());
+    watch2.removeDir(dir.path());
+    KDirWatch watch3;
+    watch3.addDirRecursive(dir.path());
+    QTRY_VERIFY(watch3.contains(nestedDir));
+    QVERIFY(!watch2.contains(nestedDir));
+    QVERIFY(!watch2.contains(dir.path()));
+}
+
+void KDirWatch_UnitTest::batchedChanges()
+{
+    QTemporaryDir dir;
+    const QString file = dir.path() + QLatin1String("/file");
+    const QString shortLivedFile = dir.path() + QLatin1String("/shortLived");
+    createFile(file);
+
+    KDirWatch watch;
+    QCOMPARE(watch.batchDelay(), -1);
+    watch.setBatchDelay(1000);
+    QCOMPARE(watch.batchDelay(), 1000);
+    watch.addDir(dir.path());
+    watch.addFile(shortLivedFile);
+    QSignalSpy spyBatched(&watch, &KDirWatch::changesBatched);
+    QSignalSpy spyDirty(&watch, &KDirWatch::dirty);
+
+    waitUntilMTimeChange(dir.path());
+    // created, changed and deleted again within the batch, so it's dropped.
+    // Nothing here may run the event loop, which would let the batch be
+    // delivered early or rescan the short lived file in between.
+    createFile(shortLivedFile);
+    QFile shortLived(shortLivedFile);
+    QVERIFY(shortLived.open(QIODevice::Append | QIODevice::WriteOnly));
+    shortLived.write(QByteArray("foobar"));
+    shortLived.close();
+    QVERIFY(QFile::remove(shortLivedFile));
+    QVERIFY(QFile::remove(file));
+
+    QVERIFY(spyBatched.wait(3000));
+    QSet<QPair<QString, int>> changes;
+    for (const QVariantList &arguments : qAsConst(spyBatched)) {
+        const auto batch = arguments.at(0).value<QVector<KDirWatch::Change>>();
+        for (const KDirWatch::Change &change : batch) {
+            changes.insert(qMakePair(change.path, int(change.type)));
+        }
+    }
+    const QSet<QPair<QString, int>> expected = {qMakePair(dir.path(), int(KDirWatch::Dirty))};
+    QCOMPARE(changes, expected);
+    QCOMPARE(spyDirty.count(), 0);
+
+    // Disabling batching restores the single signals
+    const int batches = spyBatched.count();
+    watch.setBatchDelay(-1);
+    QCOMPARE(watch.batchDelay(), -1);
+    waitUntilMTimeChange(dir.path());
+    createFile(file);
+    QVERIFY(spyDirty.wait(3000));
+    QCOMPARE(spyBatched.count(), batches);
+}
+
 void KDirWatch_UnitTest::benchCreateTree()
 {
 #if !ENABLE_BENCHMARKS
@@ -24,9 +24,17 @@
 
 #include <QObject>
 #include <QString>
+#include <QTemporaryDir>
+#include <QThread>
 #include <qstandardpaths.h>
 #include <string.h> // strcpy
 
+#ifdef Q_OS_LINUX
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 class KSharedDataCacheTest : public QObject
 {
     Q_OBJECT
@@ -34,6 +42,26 @@ class KSharedDataCacheTest : public QObject
 private Q_SLOTS:
     void initTestCase();
     void simpleInsert();
+    void findView();
+    void insertManyFindMany();
+    void defragmentationBudget();
+    void evictionPolicy_data();
+    void evictionPolicy();
+    void scanResistance();
+    void indexStatistics();
+    void statistics();
+    void compression();
+    void insertAsync();
+    void insertAsyncWhileResizing();
+    void memoryHints();
+    void resize();
+    void entryTimeToLive();
+    void removeByPrefix();
+    void preparedKeys();
+    void snapshot();
+    void checksums();
+    void crashedProcess();
+    void streaming();
 };
 
 void KSharedDataCacheTest::initTestCase()
@@ -71,6 +99,898 @@ void KSharedDataCacheTest::simpleInsert()
     QCOMPARE(result, data);
 }
 
+void KSharedDataCacheTest::findView()
+{
+    const QLatin1String cacheName("myViewTestCache");
+    const QLatin1String key("mypic");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 5 * 1024 * 1024);
+
+    QByteArray data;
+    data.resize(9228);
+    strcpy(data.data(), "Hello world");
+    QVERIFY(cache.insert(key, data));
+
+    QByteArray view;
+    unsigned generation = 0;
+    QVERIFY(cache.findView(key, &view, &generation));
+    QCOMPARE(view, data);
+    QCOMPARE(generation, cache.generation());
+
+    // Adding unrelated data to free space leaves existing views intact
+    QVERIFY(cache.insert(QLatin1String("otherpic"), data));
+    QCOMPARE(generation, cache.generation());
+    QCOMPARE(view, data);
+
+    QVERIFY(!cache.findView(QLatin1String("missing"), &view, &generation));
+
+#ifndef Q_OS_WIN // the windows implementation has no shared data to view
+    cache.clear();
+    QVERIFY(generation != cache.generation());
+#endif
+}
+
+void KSharedDataCacheTest::insertManyFindMany()
+{
+    const QLatin1String cacheName("myBatchTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 5 * 1024 * 1024);
+
+    QHash<QString, QByteArray> entries;
+    for (int i = 0; i < 100; ++i) {
+        entries.insert(QStringLiteral("key%1").arg(i), QByteArray(i * 10, 'a' + i % 26));
+    }
+    QVERIFY(cache.insertMany(entries));
+
+    QStringList keys = entries.keys();
+    keys << QStringLiteral("missing");
+
+    const QHash<QString, QByteArray> results = cache.findMany(keys);
+    QCOMPARE(results, entries);
+
+    QByteArray data;
+    QVERIFY(cache.find(QStringLiteral("key42"), &data));
+    QCOMPARE(data, entries.value(QStringLiteral("key42")));
+}
+
+void KSharedDataCacheTest::defragmentationBudget()
+{
+    const QLatin1String cacheName("myDefragmentTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 1024 * 1024, 1024);
+
+    QCOMPARE(cache.defragmentationBudget(), 0u);
+    cache.setDefragmentationBudget(16 * 1024);
+    QCOMPARE(cache.defragmentationBudget(), 16u * 1024);
+
+    // Churn through entries of varying size to fragment the cache, the most
+    // recent insert must always be retrievable.
+    for (int i = 0; i < 2000; ++i) {
+        const QString key = QStringLiteral("key%1").arg(i);
+        const QByteArray data((i * 7919) % 20000 + 1, 'a' + i % 26);
+        QVERIFY(cache.insert(key, data));
+
+        QByteArray result;
+        QVERIFY(cache.find(key, &result));
+        QCOMPARE(result, data);
+    }
+}
+
+void KSharedDataCacheTest::evictionPolicy_data()
+{
+    QTest::addColumn<int>("policy");
+
+    QTest::newRow("default") << int(KSharedDataCache::NoEvictionPreference);
+    QTest::newRow("lru") << int(KSharedDataCache::EvictLeastRecentlyUsed);
+    QTest::newRow("lfu") << int(KSharedDataCache::EvictLeastOftenUsed);
+    QTest::newRow("oldest") << int(KSharedDataCache::EvictOldest);
+    QTest::newRow("scanResistant") << int(KSharedDataCache::EvictScanResistant);
+}
+
+void KSharedDataCacheTest::evictionPolicy()
+{
+    QFETCH(int, policy);
+
+    const QLatin1String cacheName("myEvictionTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 256 * 1024, 1024);
+    cache.setEvictionPolicy(static_cast<KSharedDataCache::EvictionPolicy>(policy));
+
+    // Insert several times the capacity of the cache, forcing entries to be
+    // evicted, the most recent insert must always be retrievable.
+    for (int i = 0; i < 2000; ++i) {
+        const QString key = QStringLiteral("key%1").arg(i);
+        const QByteArray data((i * 7919) % 3000 + 1, 'a' + i % 26);
+        QVERIFY(cache.insert(key, data));
+
+        QByteArray result;
+        QVERIFY(cache.find(key, &result));
+        QCOMPARE(result, data);
+    }
+
+    QVERIFY(cache.freeSize() < cache.totalSize());
+}
+
+void KSharedDataCacheTest::scanResistance()
+{
+    const QLatin1String cacheName("myScanResistanceTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 1024 * 1024, 1024);
+    cache.setEvictionPolicy(KSharedDataCache::EvictScanResistant);
+    QCOMPARE(cache.evictionPolicy(), KSharedDataCache::EvictScanResistant);
+
+    // Entries in regular use...
+    QByteArray result;
+    for (int i = 0; i < 20; ++i) {
+        const QString key = QStringLiteral("hot%1").arg(i);
+        QVERIFY(cache.insert(key, QByteArray(900, 'h')));
+        QVERIFY(cache.find(key, &result));
+        QVERIFY(cache.find(key, &result));
+    }
+
+    // ...must survive loading lots of data used only once.
+    for (int i = 0; i < 3000; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("scan%1").arg(i), QByteArray(900, 's')));
+    }
+
+#ifndef Q_OS_WIN // the windows implementation ignores the eviction policy
+    for (int i = 0; i < 20; ++i) {
+        QVERIFY(cache.contains(QStringLiteral("hot%1").arg(i)));
+    }
+#endif
+    QVERIFY(cache.contains(QStringLiteral("scan2999")));
+}
+
+void KSharedDataCacheTest::indexStatistics()
+{
+    const QLatin1String cacheName("myIndexTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+
+    // Much smaller entries than expected, so the index fills up long before
+    // the cache runs out of space.
+    KSharedDataCache cache(cacheName, 1024 * 1024, 4096);
+
+    const QString hotKey = QStringLiteral("hot");
+    const QByteArray hotData(100, 'h');
+    QVERIFY(cache.insert(hotKey, hotData));
+
+    for (int i = 0; i < 5000; ++i) {
+        const QString key = QStringLiteral("key%1").arg(i);
+        const QByteArray data(100, 'a' + i % 26);
+        QVERIFY(cache.insert(key, data));
+
+        QByteArray result;
+        QVERIFY(cache.find(key, &result));
+        QCOMPARE(result, data);
+
+        // A frequently used entry must never be pushed out by collisions.
+        QVERIFY(cache.find(hotKey, &result));
+        QCOMPARE(result, hotData);
+    }
+
+    KSharedDataCache::IndexStatistics stats = cache.indexStatistics();
+#ifndef Q_OS_WIN // the windows implementation has no index
+    QVERIFY(stats.capacity > 0);
+    QVERIFY(stats.entryCount >= stats.capacity * 9 / 10);
+    QVERIFY(stats.entryCount <= stats.capacity);
+    QVERIFY(stats.collisions > 0);
+    QVERIFY(stats.averageProbe <= stats.longestProbe);
+#endif
+
+    cache.clear();
+    stats = cache.indexStatistics();
+    QCOMPARE(stats.entryCount, 0u);
+}
+
+void KSharedDataCacheTest::statistics()
+{
+    const QLatin1String cacheName("myStatisticsTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 256 * 1024, 1024);
+
+    QByteArray result;
+    QVERIFY(cache.insert(QStringLiteral("key"), QByteArray(100, 'a')));
+    QVERIFY(cache.find(QStringLiteral("key"), &result));
+    QVERIFY(!cache.find(QStringLiteral("missing"), &result));
+
+    KSharedDataCache::Statistics stats = cache.statistics();
+#ifndef Q_OS_WIN // the windows implementation keeps no statistics
+    QCOMPARE(stats.hits, 1ull);
+    QCOMPARE(stats.misses, 1ull);
+    QCOMPARE(stats.inserts, 1ull);
+    QCOMPARE(stats.evictions, 0ull);
+    QVERIFY(stats.lockCount >= 1);
+
+    // Overfill the cache to force evictions.
+    for (int i = 0; i < 1000; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("key%1").arg(i), QByteArray(1000, 'b')));
+    }
+
+    stats = cache.statistics();
+    QCOMPARE(stats.inserts, 1001ull);
+    QVERIFY(stats.evictions > 0);
+
+    // The lookups were added to the shared statistics while inserting.
+    KSharedDataCache otherCache(cacheName, 256 * 1024, 1024);
+    QCOMPARE(otherCache.statistics().hits, 1ull);
+    QCOMPARE(otherCache.statistics().misses, 1ull);
+#endif
+
+    cache.resetStatistics();
+    stats = cache.statistics();
+    QCOMPARE(stats.hits, 0ull);
+    QCOMPARE(stats.inserts, 0ull);
+    QCOMPARE(stats.evictions, 0ull);
+}
+
+void KSharedDataCacheTest::compression()
+{
+    const QLatin1String cacheName("myCompressionTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+
+    QCOMPARE(cache.compressionThreshold(), 0u);
+    cache.setCompressionThreshold(256);
+    QCOMPARE(cache.compressionThreshold(), 256u);
+
+    const QByteArray compressible = QByteArray("compressible ").repeated(1000);
+    const QByteArray tiny("tiny");
+    const unsigned freeBefore = cache.freeSize();
+
+    QVERIFY(cache.insert(QStringLiteral("compressible"), compressible));
+    QVERIFY(cache.insert(QStringLiteral("tiny"), tiny));
+
+    QByteArray result;
+    QVERIFY(cache.find(QStringLiteral("compressible"), &result));
+    QCOMPARE(result, compressible);
+    QVERIFY(cache.find(QStringLiteral("tiny"), &result));
+    QCOMPARE(result, tiny);
+
+    QVERIFY(cache.findView(QStringLiteral("compressible"), &result));
+    QCOMPARE(result, compressible);
+
+    const QHash<QString, QByteArray> results = cache.findMany({QStringLiteral("compressible"), QStringLiteral("tiny")});
+    QCOMPARE(results.value(QStringLiteral("compressible")), compressible);
+    QCOMPARE(results.value(QStringLiteral("tiny")), tiny);
+
+#ifndef Q_OS_WIN // the windows implementation does not compress
+    QVERIFY(freeBefore - cache.freeSize() < unsigned(compressible.size()));
+
+    const KSharedDataCache::Statistics stats = cache.statistics();
+    QCOMPARE(stats.compressionInput, quint64(compressible.size()));
+    QVERIFY(stats.compressionOutput < stats.compressionInput);
+#else
+    Q_UNUSED(freeBefore);
+#endif
+}
+
+void KSharedDataCacheTest::insertAsync()
+{
+    const QLatin1String cacheName("myAsyncTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+
+    {
+        KSharedDataCache cache(cacheName, 1024 * 1024);
+
+        for (int i = 0; i < 100; ++i) {
+            const QString key = QStringLiteral("key%1").arg(i);
+            const QByteArray data(1000, 'a' + i % 26);
+            QVERIFY(cache.insertAsync(key, data));
+
+            // Queued entries must be visible right away.
+            QByteArray result;
+            QVERIFY(cache.find(key, &result));
+            QCOMPARE(result, data);
+        }
+
+        // A synchronous insert takes precedence over a queued one.
+        QVERIFY(cache.insertAsync(QStringLiteral("key0"), QByteArray("queued")));
+        QVERIFY(cache.insert(QStringLiteral("key0"), QByteArray("inserted")));
+        cache.flush();
+
+        QByteArray result;
+        QVERIFY(cache.find(QStringLiteral("key0"), &result));
+        QCOMPARE(result, QByteArray("inserted"));
+
+#ifndef Q_OS_WIN // the windows implementation inserts right away
+        // Back-pressure
+        QVERIFY(!cache.insertAsync(QStringLiteral("huge"), QByteArray(cache.totalSize() / 2, 'h')));
+#endif
+
+        QVERIFY(cache.insertAsync(QStringLiteral("last"), QByteArray("last")));
+    }
+
+    // Destroying the cache must commit all queued entries.
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+    QByteArray result;
+    QVERIFY(cache.find(QStringLiteral("last"), &result));
+    QCOMPARE(result, QByteArray("last"));
+    QVERIFY(cache.find(QStringLiteral("key99"), &result));
+}
+
+void KSharedDataCacheTest::insertAsyncWhileResizing()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("This test needs fork()");
+#else
+    const QLatin1String cacheName("myAsyncResizeTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+
+    auto valueOf = [](int key) {
+        return QByteArray(100 + key * 10, char('a' + key % 26));
+    };
+
+    // Another process keeps resizing the cache, so the worker thread and
+    // the lookups below have to switch over to new mappings all the time.
+    const pid_t child = ::fork();
+    QVERIFY(child >= 0);
+    if (child == 0) {
+        KSharedDataCache childCache(cacheName, 1024 * 1024);
+        for (int i = 0; i < 200; ++i) {
+            childCache.resize((1 + i % 2) * 1024 * 1024);
+        }
+        ::_exit(0);
+    }
+
+    QByteArray result;
+    int status = 0;
+    for (int i = 0; ::waitpid(child, &status, WNOHANG) == 0; ++i) {
+        if (!cache.insertAsync(QStringLiteral("key%1").arg(i % 100), valueOf(i % 100))) {
+            cache.flush();
+        }
+
+        for (int j = 0; j < 10; ++j) {
+            const int key = (i + j * 7) % 100;
+            if (cache.find(QStringLiteral("key%1").arg(key), &result)) {
+                QCOMPARE(result, valueOf(key));
+            }
+        }
+    }
+    QVERIFY(WIFEXITED(status));
+    QCOMPARE(WEXITSTATUS(status), 0);
+
+    cache.flush();
+    for (int key = 0; key < 100; ++key) {
+        if (cache.find(QStringLiteral("key%1").arg(key), &result)) {
+            QCOMPARE(result, valueOf(key));
+        }
+    }
+    QVERIFY(cache.insert(QStringLiteral("after"), QByteArray("data")));
+    QVERIFY(cache.find(QStringLiteral("after"), &result));
+#endif
+}
+
+void KSharedDataCacheTest::memoryHints()
+{
+    const QLatin1String cacheName("myMemoryHintsTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+
+    QCOMPARE(cache.memoryHints(), KSharedDataCache::MemoryHints(KSharedDataCache::NoMemoryHints));
+
+    const KSharedDataCache::MemoryHints hints = KSharedDataCache::PrefaultMemory | KSharedDataCache::TransparentHugePages;
+    cache.setMemoryHints(hints);
+    QCOMPARE(cache.memoryHints(), hints);
+
+    // Hints are advisory, the cache must work the same either way.
+    QVERIFY(cache.insert(QStringLiteral("key"), QByteArray("data")));
+    QByteArray result;
+    QVERIFY(cache.find(QStringLiteral("key"), &result));
+    QCOMPARE(result, QByteArray("data"));
+}
+
+void KSharedDataCacheTest::resize()
+{
+    const QLatin1String cacheName("myResizeTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+    KSharedDataCache otherCache(cacheName, 1024 * 1024);
+
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("key%1").arg(i), QByteArray(1000, 'a' + i % 26)));
+    }
+
+    // Make one entry worth keeping.
+    QByteArray result;
+    for (int i = 0; i < 10; ++i) {
+        QVERIFY(cache.find(QStringLiteral("key7"), &result));
+    }
+
+    // Growing keeps everything.
+    const unsigned originalSize = cache.totalSize();
+    QVERIFY(cache.resize(8 * 1024 * 1024));
+    QVERIFY(cache.totalSize() > originalSize);
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(cache.find(QStringLiteral("key%1").arg(i), &result));
+        QCOMPARE(result, QByteArray(1000, 'a' + i % 26));
+    }
+
+#ifndef Q_OS_WIN // each object has its own cache on windows
+    // Other users of the cache switch over to the resized one.
+    QVERIFY(otherCache.contains(QStringLiteral("key3")));
+    QCOMPARE(otherCache.totalSize(), cache.totalSize());
+    QVERIFY(otherCache.insert(QStringLiteral("fromOther"), QByteArray("other")));
+    QVERIFY(cache.find(QStringLiteral("fromOther"), &result));
+    QCOMPARE(result, QByteArray("other"));
+
+    // As does anyone opening the cache later on, whatever size they ask for.
+    KSharedDataCache newCache(cacheName, 1024 * 1024);
+    QCOMPARE(newCache.totalSize(), cache.totalSize());
+    QVERIFY(newCache.contains(QStringLiteral("key5")));
+
+    for (int i = 100; i < 1500; ++i) {
+        cache.insert(QStringLiteral("key%1").arg(i), QByteArray(1000, 'a' + i % 26));
+    }
+
+    // Shrinking drops entries, but keeps the most useful ones.
+    QVERIFY(cache.resize(1024 * 1024));
+    QCOMPARE(cache.totalSize(), originalSize);
+    QVERIFY(cache.find(QStringLiteral("key7"), &result));
+    QCOMPARE(result, QByteArray(1000, 'a' + 7));
+    int kept = 0;
+    for (int i = 0; i < 1500; ++i) {
+        kept += cache.contains(QStringLiteral("key%1").arg(i));
+    }
+    QVERIFY(kept > 0 && kept < 1500);
+    QCOMPARE(otherCache.totalSize(), cache.totalSize());
+#endif
+}
+
+void KSharedDataCacheTest::entryTimeToLive()
+{
+    const QLatin1String cacheName("myTimeToLiveTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+
+    QCOMPARE(cache.entryTimeToLive(), 0u);
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("old%1").arg(i), QByteArray(100, 'o')));
+    }
+
+    // Long enough for nothing to expire while the test runs.
+    cache.setEntryTimeToLive(3600);
+    QCOMPARE(cache.entryTimeToLive(), 3600u);
+
+#ifndef Q_OS_WIN // entries do not expire on windows
+    QByteArray result;
+    QVERIFY(cache.find(QStringLiteral("old0"), &result));
+
+    // The time to live applies to entries already in the cache as well.
+    cache.setEntryTimeToLive(1);
+    QTRY_VERIFY_WITH_TIMEOUT(!cache.contains(QStringLiteral("old1")), 5000);
+    QVERIFY(!cache.find(QStringLiteral("old0"), &result));
+
+    // Inserting more entries reclaims the expired ones. With a long time to
+    // live again, entries which were only hidden would show up again.
+    for (int i = 0; i < 20; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("new%1").arg(i), QByteArray("new")));
+    }
+    QVERIFY(cache.statistics().expirations >= 100);
+
+    cache.setEntryTimeToLive(3600);
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(!cache.contains(QStringLiteral("old%1").arg(i)));
+    }
+    QVERIFY(cache.find(QStringLiteral("new19"), &result));
+    QCOMPARE(result, QByteArray("new"));
+
+    cache.setEntryTimeToLive(0);
+    QVERIFY(cache.contains(QStringLiteral("new19")));
+#endif
+}
+
+void KSharedDataCacheTest::removeByPrefix()
+{
+    const QLatin1String cacheName("myRemoveByPrefixTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 4 * 1024 * 1024);
+
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("first/%1").arg(i), QByteArray(50, 'f')));
+        QVERIFY(cache.insert(QStringLiteral("second/%1").arg(i), QByteArray(50, 's')));
+    }
+    QVERIFY(cache.insertAsync(QStringLiteral("first/queued"), QByteArray("queued")));
+
+    // The queued entry is either dropped from the queue or removed from the
+    // cache, depending on whether it was committed already.
+    const int removed = cache.removeByPrefix(QStringLiteral("first/"));
+    QVERIFY(removed == 100 || removed == 101);
+    QVERIFY(!cache.contains(QStringLiteral("first/queued")));
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(!cache.contains(QStringLiteral("first/%1").arg(i)));
+        QVERIFY(cache.contains(QStringLiteral("second/%1").arg(i)));
+    }
+
+    QCOMPARE(cache.removeByPrefix(QStringLiteral("third/")), 0);
+    QCOMPARE(cache.removeByPrefix(QStringLiteral("second/")), 100);
+}
+
+void KSharedDataCacheTest::preparedKeys()
+{
+    const QLatin1String cacheName("myPreparedKeyTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+
+    const KSharedDataCache::Key key(QStringLiteral("prepared é"));
+    QCOMPARE(key.toString(), QStringLiteral("prepared é"));
+    QVERIFY(!cache.contains(key));
+
+    // Prepared keys and plain strings name the same entries.
+    QVERIFY(cache.insert(key, QByteArray("data")));
+    QVERIFY(cache.contains(key));
+    QVERIFY(cache.contains(QStringLiteral("prepared é")));
+
+    QByteArray result;
+    QVERIFY(cache.find(key, &result));
+    QCOMPARE(result, QByteArray("data"));
+
+    QVERIFY(cache.insert(QStringLiteral("prepared é"), QByteArray("other data")));
+    QVERIFY(cache.find(key, &result));
+    QCOMPARE(result, QByteArray("other data"));
+
+    // A key that is a prefix of another one must not match it.
+    QVERIFY(!cache.contains(KSharedDataCache::Key(QStringLiteral("prepared"))));
+    QVERIFY(!cache.find(KSharedDataCache::Key(QStringLiteral("prepared é ")), &result));
+
+    // Copies share the prepared data.
+    KSharedDataCache::Key copy;
+    copy = key;
+    QCOMPARE(copy.toString(), key.toString());
+    QVERIFY(cache.findView(copy, &result));
+    QCOMPARE(result, QByteArray("other data"));
+
+    const KSharedDataCache::Key asyncKey(QStringLiteral("async"));
+    QVERIFY(cache.insertAsync(asyncKey, QByteArray("async data")));
+    cache.flush();
+
+    const QHash<QString, QByteArray> found = cache.findMany(QList<KSharedDataCache::Key>() << key << asyncKey
+                                                            << KSharedDataCache::Key(QStringLiteral("missing")));
+    QCOMPARE(found.size(), 2);
+    QCOMPARE(found.value(key.toString()), QByteArray("other data"));
+    QCOMPARE(found.value(QStringLiteral("async")), QByteArray("async data"));
+}
+
+void KSharedDataCacheTest::snapshot()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString fileName = dir.filePath(QStringLiteral("snapshot"));
+
+    const QLatin1String cacheName("mySnapshotTestCache");
+    const QLatin1String otherCacheName("mySnapshotTestCache2");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache::deleteCache(otherCacheName);
+
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+    cache.setCompressionThreshold(64);
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("key%1").arg(i), QByteArray(500, 'a' + i % 26)));
+    }
+
+    QByteArray result;
+    for (int i = 0; i < 5; ++i) {
+        QVERIFY(cache.find(QStringLiteral("key42"), &result));
+    }
+
+#ifdef Q_OS_WIN
+    QSKIP("Snapshots are not supported on windows");
+#endif
+
+    QVERIFY(cache.saveSnapshot(fileName));
+
+    {
+        KSharedDataCache otherCache(otherCacheName, 1024 * 1024);
+        QVERIFY(otherCache.insert(QStringLiteral("key1"), QByteArray("newer")));
+        QVERIFY(otherCache.loadSnapshot(fileName));
+
+        for (int i = 2; i < 100; ++i) {
+            QVERIFY(otherCache.find(QStringLiteral("key%1").arg(i), &result));
+            QCOMPARE(result, QByteArray(500, 'a' + i % 26));
+        }
+
+        // Entries already in the cache are not replaced.
+        QVERIFY(otherCache.find(QStringLiteral("key1"), &result));
+        QCOMPARE(result, QByteArray("newer"));
+    }
+
+    // With a size limit, the most useful entries are kept.
+    cache.setCompressionThreshold(0);
+    cache.clear();
+    for (int i = 0; i < 100; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("key%1").arg(i), QByteArray(500, 'a' + i % 26)));
+    }
+    for (int i = 0; i < 5; ++i) {
+        QVERIFY(cache.find(QStringLiteral("key42"), &result));
+    }
+
+    QVERIFY(cache.saveSnapshot(fileName, 2000));
+    KSharedDataCache::deleteCache(otherCacheName);
+    {
+        KSharedDataCache otherCache(otherCacheName, 1024 * 1024);
+        QVERIFY(otherCache.loadSnapshot(fileName));
+        QVERIFY(otherCache.contains(QStringLiteral("key42")));
+
+        int loaded = 0;
+        for (int i = 0; i < 100; ++i) {
+            loaded += otherCache.contains(QStringLiteral("key%1").arg(i)) ? 1 : 0;
+        }
+        QCOMPARE(loaded, 3);
+    }
+
+    // Damaged entries are left out, the others are still loaded.
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.seek(file.size() - 10));
+    QVERIFY(file.putChar('X'));
+    file.close();
+
+    KSharedDataCache::deleteCache(otherCacheName);
+    {
+        KSharedDataCache otherCache(otherCacheName, 1024 * 1024);
+        QVERIFY(otherCache.loadSnapshot(fileName));
+        QVERIFY(otherCache.find(QStringLiteral("key42"), &result));
+        QCOMPARE(result, QByteArray(500, 'a' + 42 % 26));
+
+        int loaded = 0;
+        for (int i = 0; i < 100; ++i) {
+            loaded += otherCache.contains(QStringLiteral("key%1").arg(i)) ? 1 : 0;
+        }
+        QCOMPARE(loaded, 2);
+    }
+
+    // Snapshots with a damaged header are not loaded at all.
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.putChar('X'));
+    file.close();
+
+    KSharedDataCache::deleteCache(otherCacheName);
+    KSharedDataCache otherCache(otherCacheName, 1024 * 1024);
+    QVERIFY(!otherCache.loadSnapshot(fileName));
+    QVERIFY(!otherCache.contains(QStringLiteral("key42")));
+    QVERIFY(!otherCache.loadSnapshot(dir.filePath(QStringLiteral("missing"))));
+}
+
+void KSharedDataCacheTest::checksums()
+{
+#ifdef Q_OS_WIN
+    QSKIP("Checksums are not supported on windows");
+#endif
+
+    const QLatin1String cacheName("myChecksumTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 1024 * 1024);
+
+    for (int i = 0; i < 20; ++i) {
+        QVERIFY(cache.insert(QStringLiteral("key%1").arg(i), "checksummed data " + QByteArray::number(i)));
+    }
+    QCOMPARE(cache.checkIntegrity(), 0);
+
+    // Damage the data of two entries behind the back of the cache, which
+    // maps the file shared and thus sees the change.
+    const QString cacheFile = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+                              + QLatin1String("/") + cacheName + QLatin1String(".kcache");
+    QFile file(cacheFile);
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    const QByteArray contents = file.readAll();
+    for (const QByteArray &data : {QByteArray("checksummed data 3"), QByteArray("checksummed data 7")}) {
+        const int offset = contents.indexOf(data);
+        QVERIFY(offset > 0);
+        QVERIFY(file.seek(offset));
+        QVERIFY(file.putChar('C'));
+    }
+    file.close();
+
+    // Lookups only verify the data if asked to...
+    QByteArray result;
+    QVERIFY(!cache.verifyChecksumsOnFind());
+    QVERIFY(cache.find(QStringLiteral("key3"), &result));
+    cache.setVerifyChecksumsOnFind(true);
+    QVERIFY(cache.verifyChecksumsOnFind());
+    QVERIFY(cache.contains(QStringLiteral("key3")));
+    QVERIFY(cache.find(QStringLiteral("key3"), nullptr));
+
+    // ...and then drop the damaged entry when found...
+    QVERIFY(!cache.find(QStringLiteral("key3"), &result));
+    QVERIFY(!cache.contains(QStringLiteral("key3")));
+    cache.setVerifyChecksumsOnFind(false);
+
+    // ...or when checking the cache, but the rest of the cache is kept.
+    QCOMPARE(cache.checkIntegrity(), 1);
+    QVERIFY(!cache.contains(QStringLiteral("key7")));
+    QCOMPARE(cache.checkIntegrity(), 0);
+    QCOMPARE(cache.statistics().corruptions, quint64(2));
+
+    for (int i = 0; i < 20; ++i) {
+        if (i != 3 && i != 7) {
+            QVERIFY(cache.find(QStringLiteral("key%1").arg(i), &result));
+            QCOMPARE(result, "checksummed data " + QByteArray::number(i));
+        }
+    }
+
+    // Checking a few entries at a time covers all of them eventually.
+    QVERIFY(cache.insert(QStringLiteral("key3"), "rechecked data 3"));
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    const int offset = file.readAll().indexOf("rechecked data 3");
+    QVERIFY(offset > 0);
+    QVERIFY(file.seek(offset));
+    QVERIFY(file.putChar('C'));
+    file.close();
+
+    int removed = 0;
+    for (int i = 0; i < 1024; ++i) {
+        removed += cache.checkIntegrity(8);
+    }
+    QCOMPARE(removed, 1);
+    QVERIFY(!cache.contains(QStringLiteral("key3")));
+}
+
+void KSharedDataCacheTest::crashedProcess()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("Recovering from crashed processes is only supported on Linux");
+#else
+    const QLatin1String cacheName("myCrashedProcessTestCache");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 4 * 1024 * 1024);
+
+    // Kill processes inserting entries until one died holding the lock, which
+    // is where most of their time goes. The child reports through a pipe once
+    // it is inserting, so it is not killed before even opening the cache.
+    const quint64 ownerDeathsBefore = cache.statistics().ownerDeaths;
+    for (int round = 0; round < 100 && cache.statistics().ownerDeaths == ownerDeathsBefore; ++round) {
+        int fds[2];
+        QCOMPARE(::pipe(fds), 0);
+        const pid_t child = ::fork();
+        QVERIFY(child >= 0);
+        if (child == 0) {
+            ::close(fds[0]);
+            KSharedDataCache childCache(cacheName, 4 * 1024 * 1024);
+            for (int i = 0;; ++i) {
+                childCache.insert(QStringLiteral("key%1").arg(i % 5000), QByteArray(3000 + i % 7000, 'x'));
+                if (i == 0) {
+                    const char ready = 'r';
+                    (void)::write(fds[1], &ready, 1);
+                    ::close(fds[1]);
+                }
+            }
+        }
+
+        ::close(fds[1]);
+        char ready = 0;
+        const ssize_t readSize = ::read(fds[0], &ready, 1);
+        ::close(fds[0]);
+        QTest::qSleep(round % 10);
+        QCOMPARE(::kill(child, SIGKILL), 0);
+        QCOMPARE(::waitpid(child, nullptr, 0), child);
+        QCOMPARE(readSize, ssize_t(1));
+
+        // The lock is available right away, instead of after timing out.
+        QElapsedTimer timer;
+        timer.start();
+        QVERIFY(cache.insert(QStringLiteral("after"), QByteArray("data")));
+        QVERIFY(timer.elapsed() < 5000);
+
+        QVERIFY(cache.checkIntegrity() >= 0);
+        QVERIFY(cache.contains(QStringLiteral("after")));
+    }
+
+    // The cache was repaired after an owner of the lock died.
+    QVERIFY(cache.statistics().ownerDeaths > ownerDeathsBefore);
+#endif
+}
+
+void KSharedDataCacheTest::streaming()
+{
+    const QLatin1String cacheName("myStreamingTestCache");
+    const QLatin1String key("mybigpic");
+    KSharedDataCache::deleteCache(cacheName);
+    KSharedDataCache cache(cacheName, 5 * 1024 * 1024);
+
+    QByteArray data(1024 * 1024, Qt::Uninitialized);
+    for (int i = 0; i < data.size(); ++i) {
+        data[i] = char(i % 251);
+    }
+
+    // The entry can only be found once all of its data was written
+    QScopedPointer<QIODevice> writer(cache.insertStreamed(key, data.size()));
+    QVERIFY(writer);
+    const int chunkSize = 100000;
+    for (int offset = 0; offset < data.size(); offset += chunkSize) {
+        QVERIFY(!cache.contains(key));
+        const QByteArray chunk = data.mid(offset, chunkSize);
+        QCOMPARE(writer->write(chunk), qint64(chunk.size()));
+    }
+    QVERIFY(cache.contains(key));
+    QCOMPARE(writer->write("x", 1), qint64(-1));
+    writer.reset();
+
+    QByteArray result;
+    QVERIFY(cache.find(key, &result));
+    QCOMPARE(result, data);
+
+    QScopedPointer<QIODevice> reader(cache.findStreamed(key));
+    QVERIFY(reader);
+    QCOMPARE(reader->size(), qint64(data.size()));
+    result.clear();
+    while (!reader->atEnd()) {
+        const QByteArray chunk = reader->read(chunkSize);
+        QVERIFY(!chunk.isEmpty());
+        result += chunk;
+    }
+    QCOMPARE(result, data);
+    QVERIFY(!cache.findStreamed(QLatin1String("missing")));
+
+    // Incomplete entries are discarded
+    writer.reset(cache.insertStreamed(QLatin1String("incomplete"), 1000));
+    QVERIFY(writer);
+    QCOMPARE(writer->write(data.left(500)), qint64(500));
+    writer->close();
+    QVERIFY(!cache.contains(QLatin1String("incomplete")));
+    writer.reset();
+
+    QVERIFY(!cache.insertStreamed(QLatin1String("huge"), 10 * 1024 * 1024));
+
+    // Discarding a reservation may move other entries in the index, which
+    // must never make them look missing or different to concurrent readers.
+    // A mostly full index makes such moves likely.
+    const QLatin1String discardCacheName("myStreamingDiscardTestCache");
+    KSharedDataCache::deleteCache(discardCacheName);
+    KSharedDataCache discardCache(discardCacheName, 1024 * 1024, 1024);
+    for (int i = 0; i < 400; ++i) {
+        QVERIFY(discardCache.insert(QStringLiteral("neighbour%1").arg(i), QByteArray::number(i)));
+    }
+
+#ifndef Q_OS_WIN // the windows implementation has nothing to share with other readers
+    QAtomicInt stopReading;
+    QAtomicInt wrongReads;
+    QScopedPointer<QThread> readerThread(QThread::create([&]() {
+        KSharedDataCache otherCache(discardCacheName, 1024 * 1024, 1024);
+        QByteArray value;
+        while (!stopReading.load()) {
+            for (int i = 0; i < 400; ++i) {
+                if (!otherCache.find(QStringLiteral("neighbour%1").arg(i), &value) || value != QByteArray::number(i)) {
+                    wrongReads.ref();
+                }
+            }
+        }
+    }));
+    readerThread->start();
+#endif
+
+    // Failures are only counted here, to stop the reader before returning.
+    int failedWrites = 0;
+    for (int i = 0; i < 2000; ++i) {
+        writer.reset(discardCache.insertStreamed(QStringLiteral("discarded%1").arg(i % 50), 100));
+        if (!writer || writer->write("abc", 3) != 3) {
+            ++failedWrites;
+        }
+        writer.reset();
+    }
+
+#ifndef Q_OS_WIN
+    stopReading.store(1);
+    readerThread->wait();
+    QCOMPARE(wrongReads.load(), 0);
+#endif
+    QCOMPARE(failedWrites, 0);
+
+    for (int i = 0; i < 400; ++i) {
+        QVERIFY(discardCache.find(QStringLiteral("neighbour%1").arg(i), &result));
+        QCOMPARE(result, QByteArray::number(i));
+        QVERIFY(!discardCache.contains(QStringLiteral("discarded%1").arg(i % 50)));
+    }
+
+#ifndef Q_OS_WIN // the windows implementation has no shared data to read from
+    // Reading stops once the entry is replaced
+    reader.reset(cache.findStreamed(key));
+    QVERIFY(reader);
+    QCOMPARE(reader->read(10), data.left(10));
+    QVERIFY(cache.insert(key, QByteArray("replaced")));
+    QVERIFY(reader->read(10).isEmpty());
+#endif
+}
+
 QTEST_MAIN(KSharedDataCacheTest)
 
 #include "kshareddatacachetest.moc"
@@ -1,2 +1,3 @@
 #cmakedefine01 HAVE_SYS_MMAN_H
+#cmakedefine01 HAVE_PTHREAD_MUTEX_CONSISTENT
 
@@ -28,7 +28,6 @@
 #include "qstandardpaths.h"
 #include <qplatformdefs.h>
 
-#include <krandom.h>
 
 #include <QDebug>
 #include <QSharedPointer>
@@ -37,14 +36,58 @@
 #include <QAtomicInt>
 #include <QMutex>
 #include <QDir>
+#include <QPair>
+#include <QVector>
+#include <QHash>
+#include <QList>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QtAlgorithms>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QWaitCondition>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QBuffer>
+#include <QIODevice>
 
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
 
-/// The maximum number of probes to make while searching for a bucket in
-/// the presence of collisions in the cache index table.
-static const uint MAX_PROBE_COUNT = 6;
+#include <algorithm>
+#include <atomic> // std::atomic_thread_fence
+
+/// The fraction of the cache index table (as 1/n) which is always kept free.
+/// Entries are evicted once the index table would be fuller than that, which
+/// keeps probe sequences short.
+static const uint INDEX_TABLE_RESERVE = 16;
+
+/// The number of times to attempt a lookup without taking the lock before
+/// giving up and falling back to locking the cache.
+static const int MAX_OPTIMISTIC_READS = 3;
+
+/// The number of lookups whose usage data is kept in process-local memory
+/// before it is written back to the shared index table.
+static const int MAX_PENDING_USES = 64;
+
+/// The number of used index table entries to compare against each other when
+/// looking for an entry to evict.
+static const uint EVICTION_SAMPLE_SIZE = 16;
+
+/// The number of index table entries to check for expired entries on each
+/// insert, if entries expire at all.
+static const uint EXPIRY_SWEEP_SIZE = 32;
+
+/// The percentage of used index table entries which may be protected from
+/// eviction by the EvictScanResistant policy at most.
+static const uint MAX_PROTECTED_PERCENT = 75;
+
+/// Identifies files written by KSharedDataCache::saveSnapshot(), and the
+/// version of their format.
+static const quint32 SNAPSHOT_MAGIC = 0x4b534443; // "KSDC"
+static const quint32 SNAPSHOT_VERSION = 1;
 
 /**
  * A very simple class whose only purpose is to be thrown as an exception from
@@ -64,102 +107,69 @@ public:
 };
 
 //-----------------------------------------------------------------------------
-// MurmurHashAligned, by Austin Appleby
+// MurmurHash3_x86_32, by Austin Appleby
 // (Released to the public domain, or licensed under the MIT license where
 // software may not be released to the public domain. See
-// http://sites.google.com/site/murmurhash/)
+// https://github.com/aappleby/smhasher)
 
-// Same algorithm as MurmurHash, but only does aligned reads - should be safer
-// on certain platforms.
-static unsigned int MurmurHashAligned(const void *key, int len, unsigned int seed)
+static inline quint32 rotl32(quint32 x, int r)
 {
-    const unsigned int m = 0xc6a4a793;
-    const int r = 16;
-
-    const unsigned char *data = reinterpret_cast<const unsigned char *>(key);
-
-    unsigned int h = seed ^ (len * m);
-
-    int align = reinterpret_cast<quintptr>(data) & 3;
-
-    if (align && len >= 4) {
-        // Pre-load the temp registers
-
-        unsigned int t = 0, d = 0;
-
-        switch (align) {
-        case 1: t |= data[2] << 16;
-        case 2: t |= data[1] << 8;
-        case 3: t |= data[0];
-        }
-
-        t <<= (8 * align);
-
-        data += 4 - align;
-        len -= 4 - align;
-
-        int sl = 8 * (4 - align);
-        int sr = 8 * align;
-
-        // Mix
-
-        while (len >= 4) {
-            d = *reinterpret_cast<const unsigned int *>(data);
-            t = (t >> sr) | (d << sl);
-            h += t;
-            h *= m;
-            h ^= h >> r;
-            t = d;
-
-            data += 4;
-            len -= 4;
-        }
+    return (x << r) | (x >> (32 - r));
+}
 
-        // Handle leftover data in temp registers
+// Reads are done through memcpy(), which compilers turn into a single load
+// where unaligned access is allowed, so keys need not be aligned. Note that
+// like the original the result depends on the byte order of the host, which
+// is fine as the cache is never shared between different machines.
+static quint32 MurmurHash3(const void *key, int len, quint32 seed)
+{
+    const uchar *data = reinterpret_cast<const uchar *>(key);
+    const int nblocks = len / 4;
 
-        int pack = len < align ? len : align;
+    const quint32 c1 = 0xcc9e2d51;
+    const quint32 c2 = 0x1b873593;
 
-        d = 0;
+    quint32 h1 = seed;
 
-        switch (pack) {
-        case 3: d |= data[2] << 16;
-        case 2: d |= data[1] << 8;
-        case 1: d |= data[0];
-        case 0: h += (t >> sr) | (d << sl);
-            h *= m;
-            h ^= h >> r;
-        }
+    // Body
+    for (int i = 0; i < nblocks; ++i) {
+        quint32 k1;
+        ::memcpy(&k1, data + i * 4, sizeof(k1));
 
-        data += pack;
-        len -= pack;
-    } else {
-        while (len >= 4) {
-            h += *reinterpret_cast<const unsigned int *>(data);
-            h *= m;
-            h ^= h >> r;
+        k1 *= c1;
+        k1 = rotl32(k1, 15);
+        k1 *= c2;
 
-            data += 4;
-            len -= 4;
-        }
+        h1 ^= k1;
+        h1 = rotl32(h1, 13);
+        h1 = h1 * 5 + 0xe6546b64;
     }
 
-    //----------
-    // Handle tail bytes
-
-    switch (len) {
-    case 3: h += data[2] << 16;
-    case 2: h += data[1] << 8;
-    case 1: h += data[0];
-        h *= m;
-        h ^= h >> r;
-    };
+    // Tail
+    const uchar *tail = data + nblocks * 4;
+    quint32 k1 = 0;
+
+    switch (len & 3) {
+    case 3: k1 ^= tail[2] << 16;
+    Q_FALLTHROUGH();
+    case 2: k1 ^= tail[1] << 8;
+    Q_FALLTHROUGH();
+    case 1: k1 ^= tail[0];
+        k1 *= c1;
+        k1 = rotl32(k1, 15);
+        k1 *= c2;
+        h1 ^= k1;
+    }
 
-    h *= m;
-    h ^= h >> 10;
-    h *= m;
-    h ^= h >> 17;
+    // Finalization
+    h1 ^= len;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
 
-    return h;
+    return h1;
 }
 
 /**
@@ -170,7 +180,41 @@ static quint32 generateHash(const QByteArray &buffer)
 {
     // The final constant is the "seed" for MurmurHash. Do *not* change it
     // without incrementing the cache version.
-    return MurmurHashAligned(buffer.data(), buffer.size(), 0xF0F00F0F);
+    return MurmurHash3(buffer.constData(), buffer.size(), 0xF0F00F0F);
+}
+
+/**
+ * Computes the Adler-32 checksum of @p length bytes at @p data. Pass the
+ * result of a previous call as @p checksum to continue that checksum.
+ */
+static quint32 adler32(const char *data, uint length, quint32 checksum = 1)
+{
+    const quint32 modulus = 65521;
+
+    quint32 a = checksum & 0xffff;
+    quint32 b = checksum >> 16;
+
+    while (length > 0) {
+        // The sums can not overflow for blocks of up to 5552 bytes, so only
+        // reduce them once per block.
+        const uint blockLength = qMin(length, 5552u);
+        for (uint i = 0; i < blockLength; ++i) {
+            a += static_cast<uchar>(data[i]);
+            b += a;
+        }
+
+        a %= modulus;
+        b %= modulus;
+        data += blockLength;
+        length -= blockLength;
+    }
+
+    return (b << 16) | a;
+}
+
+static quint32 adler32(const QByteArray &buffer, quint32 checksum = 1)
+{
+    return adler32(buffer.constData(), buffer.size(), checksum);
 }
 
 // Alignment concerns become a big deal when we're dealing with shared memory,
@@ -293,10 +337,14 @@ typedef qint32 pageID;
 // and it contains the index of the one entry in the index table actually
 // holding the page (or <0 if the page is free).
 //
+// The page table is followed by the free page map, a bitmap with one bit for
+// every page which is set if the page is free. It duplicates information from
+// the page table, but allows to look for free pages a word at a time.
+//
 // The entire segment looks like so:
-// ?════════?═════════════?════════════?═══════?═══════?═══════?═══════?═══?
-// ? Header │ Index Table │ Page Table ? Pages │       │       │       │...?
-// ?════════?═════════════?════════════?═══════?═══════?═══════?═══════?═══?
+// ?════════?═════════════?════════════?═══════════════?═══════?═══════?═══?
+// ? Header │ Index Table │ Page Table │ Free Page Map ? Pages │       │...?
+// ?════════?═════════════?════════════?═══════════════?═══════?═══════?═══?
 // =========================================================================
 
 // All elements of this struct must be "plain old data" (POD) types since it
@@ -310,6 +358,23 @@ struct IndexTableEntry {
     time_t addTime;
     mutable time_t lastUsedTime;
     pageID firstPage;
+    uint   flags; // see EntryFlag
+    quint32 checksum; // Adler-32 of the key, its trailing null and the data
+};
+
+enum EntryFlag {
+    // The data is stored compressed by qCompress().
+    CompressedEntry = 0x1,
+    // The entry was looked up since it was inserted.
+    ReferencedEntry = 0x2,
+    // The entry was looked up repeatedly and is not evicted by the
+    // EvictScanResistant policy until it lost this flag again.
+    ProtectedEntry = 0x4,
+    // The data of the entry is still being written through
+    // KSharedDataCache::insertStreamed(), so it is not visible to lookups.
+    // Until it is complete, its checksum field holds the number of the
+    // reservation instead.
+    PendingEntry = 0x8
 };
 
 // Page table entry
@@ -337,7 +402,7 @@ struct SharedMemory {
      * e.g. the next version bump will be from 4 to 8, then 12, etc.
      */
     enum {
-        PIXMAP_CACHE_VERSION = 12,
+        PIXMAP_CACHE_VERSION = 72,
         MINIMUM_CACHE_SIZE = 4096
     };
 
@@ -364,6 +429,82 @@ struct SharedMemory {
     // written to, to allow clients to detect a changed cache quickly.
     QAtomicInt cacheTimestamp;
 
+    // Incremented whenever data already present in the pages may have been
+    // moved or released (entry removal, defragmentation, clearing). Used by
+    // KSharedDataCache::findView() to detect views that no longer point to
+    // the data they were created for.
+    QAtomicInt generation;
+
+    // Sequence counter for lock-free readers. It is odd while a writer is
+    // modifying the index or page tables and is incremented again once the
+    // writer is done, see KSharedDataCache::Private::readOptimistic().
+    QAtomicInt writeSequence;
+
+    // The maximum number of bytes to move in one call to defragment(), or 0
+    // to always defragment the whole cache.
+    QAtomicInt defragmentationBudget;
+
+    // The minimum size of data to compress when inserting it, or 0 to never
+    // compress data.
+    QAtomicInt compressionThreshold;
+
+    // Set once the cache has been replaced by a resized copy, see
+    // KSharedDataCache::resize(). Every process still using this cache must
+    // map the new one instead.
+    QAtomicInt superseded;
+
+    // The number of seconds after which entries expire, or 0 if entries
+    // never expire.
+    QAtomicInt entryTimeToLive;
+
+    // Every page before this one is known to be in use, so defragment() can
+    // start from here. Only valid while the lock is held.
+    uint defragmentHint;
+
+    // Position in the index table at which to continue looking for entries
+    // to evict. Only valid while the lock is held.
+    uint evictionClockHand;
+
+    // Position in the index table at which to continue looking for expired
+    // entries. Only valid while the lock is held.
+    uint expiryCursor;
+
+    // Position in the index table at which to continue checking the
+    // integrity of entries. Only valid while the lock is held.
+    uint integrityCursor;
+
+    // The number of the last entry reserved for streamed data, see
+    // PendingEntry. Only valid while the lock is held.
+    uint reservationCounter;
+
+    // Number of used entries in the index table, the longest distance of any
+    // entry from its home position so far, and the number of entries which
+    // could not be placed in their home position. Only valid while the lock
+    // is held.
+    uint indexUsed;
+    uint maxProbeDistance;
+    uint indexCollisions;
+
+    // Number of entries with the ProtectedEntry flag set. Only valid while
+    // the lock is held.
+    uint protectedCount;
+
+    // Usage statistics, see KSharedDataCache::statistics(). These may be
+    // updated without holding the lock.
+    QAtomicInteger<quint64> hitCount;
+    QAtomicInteger<quint64> missCount;
+    QAtomicInteger<quint64> insertCount;
+    QAtomicInteger<quint64> evictionCount;
+    QAtomicInteger<quint64> expirationCount;
+    QAtomicInteger<quint64> corruptionCount;
+    QAtomicInteger<quint64> defragmentationCount;
+    QAtomicInteger<quint64> lockCount;
+    QAtomicInteger<quint64> lockTimeoutCount;
+    QAtomicInteger<quint64> ownerDeathCount;
+    QAtomicInteger<quint64> lockHoldTime; // in nanoseconds
+    QAtomicInteger<quint64> compressionInput; // in bytes
+    QAtomicInteger<quint64> compressionOutput; // in bytes
+
     /**
      * Converts the given average item size into an appropriate page size.
      */
@@ -453,6 +594,7 @@ struct SharedMemory {
         cacheTimestamp = static_cast<unsigned>(::time(nullptr));
 
         clearInternalTables();
+        resetStatistics();
 
         // Unlock the mini-lock, and introduce a total memory barrier to make
         // sure all changes have propagated even without a mutex.
@@ -465,6 +607,15 @@ struct SharedMemory {
     {
         // Assumes we're already locked somehow.
         cacheAvail = pageTableSize();
+        defragmentHint = 0;
+        evictionClockHand = 0;
+        expiryCursor = 0;
+        integrityCursor = 0;
+        indexUsed = 0;
+        maxProbeDistance = 0;
+        indexCollisions = 0;
+        protectedCount = 0;
+        generation.ref();
 
         // Setup page tables to point nowhere
         PageTableEntry *table = pageTable();
@@ -472,18 +623,52 @@ struct SharedMemory {
             table[i].index = -1;
         }
 
+        // Mark every page as free. Bits past the end of the page table must
+        // stay clear so they are never mistaken for free pages.
+        quint64 *freeMap = freePageMap();
+        for (uint i = 0; i < freePageMapSize(); ++i) {
+            freeMap[i] = ~quint64(0);
+        }
+        if (pageTableSize() % 64) {
+            freeMap[freePageMapSize() - 1] = (quint64(1) << (pageTableSize() % 64)) - 1;
+        }
+
         // Setup index tables to be accurate.
-        IndexTableEntry *indices = indexTable();
         for (uint i = 0; i < indexTableSize(); ++i) {
-            indices[i].firstPage = -1;
-            indices[i].useCount = 0;
-            indices[i].fileNameHash = 0;
-            indices[i].totalItemSize = 0;
-            indices[i].addTime = 0;
-            indices[i].lastUsedTime = 0;
+            clearIndexEntry(i);
         }
     }
 
+    void resetStatistics()
+    {
+        hitCount.store(0);
+        missCount.store(0);
+        insertCount.store(0);
+        evictionCount.store(0);
+        expirationCount.store(0);
+        corruptionCount.store(0);
+        defragmentationCount.store(0);
+        lockCount.store(0);
+        lockTimeoutCount.store(0);
+        ownerDeathCount.store(0);
+        lockHoldTime.store(0);
+        compressionInput.store(0);
+        compressionOutput.store(0);
+    }
+
+    void clearIndexEntry(uint index)
+    {
+        IndexTableEntry *indices = indexTable();
+        indices[index].firstPage = -1;
+        indices[index].useCount = 0;
+        indices[index].fileNameHash = 0;
+        indices[index].totalItemSize = 0;
+        indices[index].addTime = 0;
+        indices[index].lastUsedTime = 0;
+        indices[index].flags = 0;
+        indices[index].checksum = 0;
+    }
+
     const IndexTableEntry *indexTable() const
     {
         // Index Table goes immediately after this struct, at the first byte
@@ -500,13 +685,21 @@ struct SharedMemory {
         return alignTo<PageTableEntry>(base);
     }
 
-    const void *cachePages() const
+    const quint64 *freePageMap() const
     {
         const PageTableEntry *tableStart = pageTable();
         tableStart += pageTableSize();
 
+        return alignTo<quint64>(tableStart);
+    }
+
+    const void *cachePages() const
+    {
+        const quint64 *mapStart = freePageMap();
+        mapStart += freePageMapSize();
+
         // Let's call wherever we end up the start of the data...
-        return alignTo<void>(tableStart, cachePageSize());
+        return alignTo<void>(mapStart, cachePageSize());
     }
 
     const void *page(pageID at) const
@@ -538,6 +731,12 @@ struct SharedMemory {
         return const_cast<PageTableEntry *>(that->pageTable());
     }
 
+    quint64 *freePageMap()
+    {
+        const SharedMemory *that = const_cast<const SharedMemory *>(this);
+        return const_cast<quint64 *>(that->freePageMap());
+    }
+
     void *cachePages()
     {
         const SharedMemory *that = const_cast<const SharedMemory *>(this);
@@ -562,6 +761,29 @@ struct SharedMemory {
         return pageTableSize() / 2;
     }
 
+    // Number of 64-bit words in the free page map.
+    uint freePageMapSize() const
+    {
+        return (pageTableSize() + 63) / 64;
+    }
+
+    /**
+     * Assigns @p page to the index table entry @p index, or marks it free if
+     * @p index is < 0. All changes to the page table must go through here to
+     * keep the free page map in sync.
+     */
+    void setPageOwner(pageID page, qint32 index)
+    {
+        pageTable()[page].index = index;
+
+        const quint64 bit = quint64(1) << (page % 64);
+        if (index < 0) {
+            freePageMap()[page / 64] |= bit;
+        } else {
+            freePageMap()[page / 64] &= ~bit;
+        }
+    }
+
     /**
      * @return the index of the first page, for the set of contiguous
      * pages that can hold @p pagesNeeded PAGES.
@@ -572,22 +794,51 @@ struct SharedMemory {
             return pageTableSize();
         }
 
-        // Loop through the page table, find the first empty page, and just
-        // makes sure that there are enough free pages.
-        const PageTableEntry *table = pageTable();
+        // Scan the free page map for the first run of enough free pages,
+        // skipping over completely used or completely free words at once.
+        const quint64 *freeMap = freePageMap();
         uint contiguousPagesFound = 0;
         pageID base = 0;
-        for (pageID i = 0; i < static_cast<int>(pageTableSize()); ++i) {
-            if (table[i].index < 0) {
+        for (uint word = 0; word < freePageMapSize(); ++word) {
+            const quint64 bits = freeMap[word];
+
+            if (bits == 0) {
+                contiguousPagesFound = 0;
+                continue;
+            }
+
+            if (bits == ~quint64(0)) {
                 if (contiguousPagesFound == 0) {
-                    base = i;
+                    base = word * 64;
                 }
-                contiguousPagesFound++;
+                contiguousPagesFound += 64;
             } else {
-                contiguousPagesFound = 0;
+                uint bit = 0;
+                while (bit < 64) {
+                    const quint64 remaining = bits >> bit;
+                    if (remaining & 1) {
+                        // Run of free pages
+                        const uint runLength = qMin(qCountTrailingZeroBits(~remaining), 64 - bit);
+                        if (contiguousPagesFound == 0) {
+                            base = word * 64 + bit;
+                        }
+                        contiguousPagesFound += runLength;
+                        if (contiguousPagesFound >= pagesNeeded) {
+                            return base;
+                        }
+                        bit += runLength;
+                    } else {
+                        // Run of used pages
+                        contiguousPagesFound = 0;
+                        if (remaining == 0) {
+                            break;
+                        }
+                        bit += qCountTrailingZeroBits(remaining);
+                    }
+                }
             }
 
-            if (contiguousPagesFound == pagesNeeded) {
+            if (contiguousPagesFound >= pagesNeeded) {
                 return base;
             }
         }
@@ -642,20 +893,74 @@ struct SharedMemory {
         return l.addTime < r.addTime;
     }
 
+    // left < right?
+    static bool scanResistantCompare(const IndexTableEntry &l, const IndexTableEntry &r)
+    {
+        // Ensure invalid entries migrate to the end
+        if (l.firstPage < 0 && r.firstPage >= 0) {
+            return false;
+        }
+        if (l.firstPage >= 0 && r.firstPage < 0) {
+            return true;
+        }
+
+        // Unprotected entries go first, otherwise the same as LRU.
+        if ((l.flags & ProtectedEntry) != (r.flags & ProtectedEntry)) {
+            return !(l.flags & ProtectedEntry);
+        }
+
+        return l.lastUsedTime < r.lastUsedTime;
+    }
+
+    // Records that @p entry was looked up @p count times. Entries looked up
+    // more than once are protected from eviction by the EvictScanResistant
+    // policy, so that data used only once (e.g. when loading many items in
+    // sequence) can not push out data that is used over and over.
+    // Must be called with the lock held.
+    void markReferenced(IndexTableEntry &entry, uint count = 1)
+    {
+        if ((count > 1 || (entry.flags & ReferencedEntry)) && !(entry.flags & ProtectedEntry)) {
+            entry.flags |= ProtectedEntry;
+            protectedCount++;
+        }
+        entry.flags |= ReferencedEntry;
+    }
+
+    /**
+     * Moves used pages towards the start of the cache so that the free pages
+     * form one contiguous block at the end.
+     *
+     * If the cache has a defragmentation budget set, this stops as soon as
+     * the budget is used up (at the next entry boundary), and the next call
+     * continues where this one left off. Otherwise the entire cache is
+     * defragmented in one go.
+     */
     void defragment()
     {
-        if (cacheAvail * cachePageSize() == cacheSize) {
-            return; // That was easy
+        pageID idLimit = static_cast<pageID>(pageTableSize());
+        const uint usedPages = pageTableSize() - cacheAvail;
+
+        // Every page before defragmentHint is in use, so if all used pages
+        // are before it we are already done. That was easy.
+        if (cacheAvail * cachePageSize() == cacheSize || defragmentHint >= usedPages) {
+            return;
         }
 
         qCDebug(KCOREADDONS_DEBUG) << "Defragmenting the shared cache";
+        defragmentationCount.fetchAndAddRelaxed(1);
+
+        // Pages are about to move, invalidate any outstanding views.
+        generation.ref();
 
         // Just do a linear scan, and anytime there is free space, swap it
         // with the pages to its right. In order to meet the precondition
         // we need to skip any used pages first.
 
-        pageID currentPage = 0;
-        pageID idLimit = static_cast<pageID>(pageTableSize());
+        const uint budget = static_cast<uint>(defragmentationBudget.load());
+        const uint pageBudget = budget / cachePageSize() + (budget % cachePageSize() ? 1 : 0);
+        uint pagesMoved = 0;
+
+        pageID currentPage = defragmentHint < static_cast<uint>(idLimit) ? defragmentHint : 0;
         PageTableEntry *pages = pageTable();
 
         if (Q_UNLIKELY(!pages || idLimit <= 0)) {
@@ -681,19 +986,31 @@ struct SharedMemory {
                 break;
             }
 
-            // Found an entry, move it.
-            qint32 affectedIndex = pages[currentPage].index;
-            if (Q_UNLIKELY(affectedIndex < 0 ||
-                           affectedIndex >= idLimit ||
-                           indexTable()[affectedIndex].firstPage != currentPage)) {
-                throw KSDCCorrupted();
-            }
-
-            indexTable()[affectedIndex].firstPage = freeSpot;
-
-            // Moving one page at a time guarantees we can use memcpy safely
-            // (in other words, the source and destination will not overlap).
+            // Found an entry, move it. Moving one page at a time guarantees
+            // we can use memcpy safely (in other words, the source and
+            // destination will not overlap).
+            qint32 affectedIndex = -1;
             while (currentPage < idLimit && pages[currentPage].index >= 0) {
+                // We're moving consecutive used pages whether they belong to
+                // the same entry or not, so detect if we've started moving
+                // the data for a different entry and adjust if necessary.
+                if (affectedIndex != pages[currentPage].index) {
+                    // Only stop in between entries, an entry must always
+                    // occupy consecutive pages.
+                    if (pageBudget > 0 && pagesMoved >= pageBudget) {
+                        defragmentHint = freeSpot;
+                        return;
+                    }
+
+                    affectedIndex = pages[currentPage].index;
+                    if (Q_UNLIKELY(static_cast<uint>(affectedIndex) >= indexTableSize() ||
+                                   indexTable()[affectedIndex].firstPage != currentPage)) {
+                        throw KSDCCorrupted();
+                    }
+
+                    indexTable()[affectedIndex].firstPage = freeSpot;
+                }
+
                 const void *const sourcePage = page(currentPage);
                 void *const destinationPage = page(freeSpot);
 
@@ -705,30 +1022,19 @@ struct SharedMemory {
                 }
 
                 ::memcpy(destinationPage, sourcePage, cachePageSize());
-                pages[freeSpot].index = affectedIndex;
-                pages[currentPage].index = -1;
+                setPageOwner(freeSpot, affectedIndex);
+                setPageOwner(currentPage, -1);
                 ++currentPage;
                 ++freeSpot;
-
-                // If we've just moved the very last page and it happened to
-                // be at the very end of the cache then we're done.
-                if (currentPage >= idLimit) {
-                    break;
-                }
-
-                // We're moving consecutive used pages whether they belong to
-                // our affected entry or not, so detect if we've started moving
-                // the data for a different entry and adjust if necessary.
-                if (affectedIndex != pages[currentPage].index) {
-                    indexTable()[pages[currentPage].index].firstPage = freeSpot;
-                }
-                affectedIndex = pages[currentPage].index;
+                ++pagesMoved;
             }
 
             // At this point currentPage is on a page that is unused, and the
             // cycle repeats. However, currentPage is not the first unused
             // page, freeSpot is, so leave it alone.
         }
+
+        defragmentHint = freeSpot;
     }
 
     /**
@@ -739,45 +1045,275 @@ struct SharedMemory {
      */
     qint32 findNamedEntry(const QByteArray &key) const
     {
-        uint keyHash = generateHash(key);
-        uint position = keyHash % indexTableSize();
-        uint probeNumber = 1; // See insert() for description
+        return findNamedEntry(key, generateHash(key));
+    }
+
+    /**
+     * Same as above, for when the hash of @p key (as returned by
+     * generateHash()) is already known.
+     */
+    qint32 findNamedEntry(const QByteArray &key, uint keyHash) const
+    {
+        const uint keySize = key.size() + 1; // including the trailing null
+        const uint tableSize = indexTableSize();
+        const uint maxDistance = qMin(maxProbeDistance, tableSize - 1);
+        uint position = keyHash % tableSize;
+
+        // Entries are kept ordered by their distance from their home position
+        // (see insertIndexEntry()), so we can stop as soon as we reach an
+        // entry closer to its home than we are to ours.
+        for (uint distance = 0; distance <= maxDistance; ++distance) {
+            const IndexTableEntry &entry = indexTable()[position];
+            if (entry.firstPage < 0 || probeDistance(position) < distance) {
+                break;
+            }
 
-        // Imagine 3 entries A, B, C in this logical probing chain. If B is
-        // later removed then we can't find C either. So, we must keep
-        // searching for probeNumber number of tries (or we find the item,
-        // obviously).
-        while (indexTable()[position].fileNameHash != keyHash &&
-                probeNumber < MAX_PROBE_COUNT) {
-            position = (keyHash + (probeNumber + probeNumber * probeNumber) / 2)
-                       % indexTableSize();
-            probeNumber++;
-        }
+            if (entry.fileNameHash == keyHash && entry.totalItemSize >= keySize &&
+                    !(entry.flags & PendingEntry)) {
+                if (static_cast<uint>(entry.firstPage) >= pageTableSize()) {
+                    return -1;
+                }
 
-        if (indexTable()[position].fileNameHash == keyHash) {
-            pageID firstPage = indexTable()[position].firstPage;
-            if (firstPage < 0 || static_cast<uint>(firstPage) >= pageTableSize()) {
-                return -1;
+                // The key can not extend past the end of the cache.
+                const uint availableSize = (pageTableSize() - entry.firstPage) * cachePageSize();
+                const void *resultPage = page(entry.firstPage);
+                if (Q_UNLIKELY(!resultPage || keySize > availableSize)) {
+                    throw KSDCCorrupted();
+                }
+
+                // Compare the trailing null as well, so that a key which is
+                // only a prefix of the stored key does not match.
+                if (::memcmp(resultPage, key.constData(), keySize) == 0) {
+                    return position;
+                }
             }
 
-            const void *resultPage = page(firstPage);
-            if (Q_UNLIKELY(!resultPage)) {
-                throw KSDCCorrupted();
+            position = (position + 1) % tableSize;
+        }
+
+        return -1; // Not found
+    }
+
+    // Returns the position of the pending entry for a key hashed to @p keyHash
+    // which was reserved as number @p reservation, or -1 if it is gone.
+    qint32 findReservation(uint keyHash, uint reservation) const
+    {
+        const uint tableSize = indexTableSize();
+        const uint maxDistance = qMin(maxProbeDistance, tableSize - 1);
+        uint position = keyHash % tableSize;
+
+        for (uint distance = 0; distance <= maxDistance; ++distance) {
+            const IndexTableEntry &entry = indexTable()[position];
+            if (entry.firstPage < 0 || probeDistance(position) < distance) {
+                break;
             }
 
-            const char *utf8FileName = reinterpret_cast<const char *>(resultPage);
-            if (qstrncmp(utf8FileName, key.constData(), cachePageSize()) == 0) {
+            if (entry.fileNameHash == keyHash && (entry.flags & PendingEntry) &&
+                    entry.checksum == reservation) {
                 return position;
             }
+
+            position = (position + 1) % tableSize;
+        }
+
+        return -1;
+    }
+
+    // Returns the distance of the entry at @p position in the index table from
+    // the position it would be at in the absence of any collisions.
+    uint probeDistance(uint position) const
+    {
+        const uint home = indexTable()[position].fileNameHash % indexTableSize();
+        return (position + indexTableSize() - home) % indexTableSize();
+    }
+
+    // The number of index table entries that may be used before entries have
+    // to be evicted to make room for new ones.
+    uint maximumIndexUsage() const
+    {
+        return indexTableSize() - qMax(1u, indexTableSize() / INDEX_TABLE_RESERVE);
+    }
+
+    // Points the pages holding the entry at @p position in the index table
+    // back to that position, after the entry has been moved there.
+    void relinkPages(uint position)
+    {
+        const IndexTableEntry &entry = indexTable()[position];
+        const uint pageCount = intCeil(entry.totalItemSize, cachePageSize());
+        if (entry.firstPage < 0 || pageCount > pageTableSize() ||
+                static_cast<uint>(entry.firstPage) > pageTableSize() - pageCount) {
+            throw KSDCCorrupted();
+        }
+
+        PageTableEntry *table = pageTable();
+        for (uint i = 0; i < pageCount; ++i) {
+            table[entry.firstPage + i].index = position;
+        }
+    }
+
+    /**
+     * Adds @p newEntry to the index table using Robin Hood hashing: while
+     * probing linearly for a free position, @p newEntry takes the place of the
+     * first entry that is closer to its own home position, which is then
+     * placed further on in the same way. This keeps all probe sequences
+     * similarly short even with a mostly full index table.
+     *
+     * The pages of any entry that is moved are linked to its new position,
+     * the pages of @p newEntry must be linked by the caller. There must be a
+     * free position in the index table.
+     *
+     * @return The position of @p newEntry in the index table.
+     * @internal
+     */
+    uint insertIndexEntry(const IndexTableEntry &newEntry)
+    {
+        if (Q_UNLIKELY(indexUsed >= indexTableSize())) {
+            throw KSDCCorrupted();
+        }
+
+        IndexTableEntry *indices = indexTable();
+        IndexTableEntry entry = newEntry;
+        uint position = entry.fileNameHash % indexTableSize();
+        uint distance = 0;
+        uint result = indexTableSize();
+
+        if (indices[position].firstPage >= 0) {
+            indexCollisions++;
+        }
+
+        for (uint i = 0; i < indexTableSize(); ++i) {
+            if (indices[position].firstPage < 0 || probeDistance(position) < distance) {
+                maxProbeDistance = qMax(maxProbeDistance, distance);
+
+                const IndexTableEntry displaced = indices[position];
+                indices[position] = entry;
+
+                if (result == indexTableSize()) {
+                    result = position;
+                } else {
+                    relinkPages(position);
+                }
+
+                if (displaced.firstPage < 0) {
+                    indexUsed++;
+                    return result;
+                }
+
+                entry = displaced;
+                distance = (position + indexTableSize() - entry.fileNameHash % indexTableSize())
+                           % indexTableSize();
+            }
+
+            position = (position + 1) % indexTableSize();
+            distance++;
+        }
+
+        // Can only happen if indexUsed was wrong.
+        throw KSDCCorrupted();
+    }
+
+    typedef bool (*EntryCompareFunction)(const IndexTableEntry &, const IndexTableEntry &);
+
+    /**
+     * @return The function ordering entries by the current eviction policy,
+     * with the entry that should be evicted first sorting first.
+     */
+    EntryCompareFunction evictionCompareFunction() const
+    {
+        switch (evictionPolicy.load()) {
+        case KSharedDataCache::EvictLeastOftenUsed:
+        case KSharedDataCache::NoEvictionPreference:
+        default:
+            return seldomUsedCompare;
+
+        case KSharedDataCache::EvictLeastRecentlyUsed:
+            return lruCompare;
+
+        case KSharedDataCache::EvictOldest:
+            return ageCompare;
+
+        case KSharedDataCache::EvictScanResistant:
+            return scanResistantCompare;
+        }
+    }
+
+    /**
+     * Moves the eviction clock hand forward to the next entry which is not
+     * protected. While more entries are protected than allowed by
+     * MAX_PROTECTED_PERCENT, every protected entry the hand passes on the way
+     * loses its protection and has to be looked up again to regain it.
+     * Entries used only once therefore always go first, no matter how many of
+     * them are inserted. Used for the EvictScanResistant policy.
+     *
+     * @return The index of the entry to evict, or <0 if the cache is empty.
+     * @internal
+     */
+    qint32 findUnprotectedEntry()
+    {
+        IndexTableEntry *table = indexTable();
+        uint position = evictionClockHand % indexTableSize();
+
+        // If every entry is protected the first round removes protection
+        // from enough of them, so two rounds are always enough.
+        for (uint scanned = 0; scanned < 2 * indexTableSize(); ++scanned) {
+            IndexTableEntry &entry = table[position];
+            const uint current = position;
+            position = (position + 1) % indexTableSize();
+
+            if (entry.firstPage < 0) {
+                continue;
+            }
+
+            if (entry.flags & ProtectedEntry) {
+                if (protectedCount * 100 > indexUsed * MAX_PROTECTED_PERCENT || scanned >= indexTableSize()) {
+                    entry.flags &= ~ProtectedEntry;
+                    protectedCount = protectedCount > 0 ? protectedCount - 1 : 0;
+                }
+                continue;
+            }
+
+            evictionClockHand = position;
+            return current;
         }
 
-        return -1; // Not found, or a different one found.
+        evictionClockHand = position;
+        return -1;
     }
 
-    // Function to use with QSharedPointer in removeUsedPages below...
-    static void deleteTable(IndexTableEntry *table)
+    /**
+     * Looks at the next few used entries after the eviction clock hand and
+     * returns the one that should be evicted first per the eviction policy.
+     * This approximates evicting entries in sorted order without having to
+     * copy and sort the whole index table.
+     *
+     * @return The index of the entry to evict, or <0 if the cache is empty.
+     * @internal
+     */
+    qint32 findEvictionCandidate()
     {
-        delete [] table;
+        if (evictionPolicy.load() == KSharedDataCache::EvictScanResistant) {
+            return findUnprotectedEntry();
+        }
+
+        const EntryCompareFunction compareFunction = evictionCompareFunction();
+        const IndexTableEntry *table = indexTable();
+        qint32 candidate = -1;
+        uint sampled = 0;
+        uint position = evictionClockHand % indexTableSize();
+
+        for (uint scanned = 0; scanned < indexTableSize() && sampled < EVICTION_SAMPLE_SIZE; ++scanned) {
+            if (table[position].firstPage >= 0) {
+                if (candidate < 0 || compareFunction(table[position], table[candidate])) {
+                    candidate = position;
+                }
+                ++sampled;
+            }
+
+            position = (position + 1) % indexTableSize();
+        }
+
+        evictionClockHand = position;
+        return candidate;
     }
 
     /**
@@ -818,104 +1354,36 @@ struct SharedMemory {
 
             if (result < pageTableSize()) {
                 return result;
-            } else {
+            } else if (defragmentationBudget.load() == 0) {
                 qCritical() << "Just defragmented a locked cache, but still there"
                             << "isn't enough room for the current request.";
             }
         }
 
-        // At this point we know we'll have to free some space up, so sort our
-        // list of entries by whatever the current criteria are and start
-        // killing expired entries.
-        QSharedPointer<IndexTableEntry> tablePtr(new IndexTableEntry[indexTableSize()], deleteTable);
-
-        if (!tablePtr) {
-            qCritical() << "Unable to allocate temporary memory for sorting the cache!";
-            clearInternalTables();
-            throw KSDCCorrupted();
+        // At this point we know we'll have to free some space up, so start
+        // evicting entries per the current criteria.
+        qint32 curIndex;
+        while (numberNeeded > cacheAvail && (curIndex = findEvictionCandidate()) >= 0) {
+            qCDebug(KCOREADDONS_DEBUG) << "Removing entry of" << indexTable()[curIndex].totalItemSize
+                     << "size";
+            evictEntry(curIndex);
         }
 
-        // We use tablePtr to ensure the data is destroyed, but do the access
-        // via a helper pointer to allow for array ops.
-        IndexTableEntry *table = tablePtr.data();
+        // At this point let's see if we have freed up enough data by
+        // defragmenting first and seeing if we can find that free space.
+        defragment();
+
+        pageID result = pageTableSize();
+        while ((static_cast<uint>(result = findEmptyPages(numberNeeded))) >= pageTableSize()) {
+            curIndex = findEvictionCandidate();
 
-        ::memcpy(table, indexTable(), sizeof(IndexTableEntry) * indexTableSize());
+            if (curIndex < 0) {
+                // One last shot.
+                defragment();
+                return findEmptyPages(numberNeeded);
+            }
 
-        // Our entry ID is simply its index into the
-        // index table, which qSort will rearrange all willy-nilly, so first
-        // we'll save the *real* entry ID into firstPage (which is useless in
-        // our copy of the index table). On the other hand if the entry is not
-        // used then we note that with -1.
-        for (uint i = 0; i < indexTableSize(); ++i) {
-            table[i].firstPage = table[i].useCount > 0 ? static_cast<pageID>(i)
-                                 : -1;
-        }
-
-        // Declare the comparison function that we'll use to pass to qSort,
-        // based on our cache eviction policy.
-        bool (*compareFunction)(const IndexTableEntry &, const IndexTableEntry &);
-        switch (evictionPolicy.load()) {
-        case KSharedDataCache::EvictLeastOftenUsed:
-        case KSharedDataCache::NoEvictionPreference:
-        default:
-            compareFunction = seldomUsedCompare;
-            break;
-
-        case KSharedDataCache::EvictLeastRecentlyUsed:
-            compareFunction = lruCompare;
-            break;
-
-        case KSharedDataCache::EvictOldest:
-            compareFunction = ageCompare;
-            break;
-        }
-
-        std::sort(table, table + indexTableSize(), compareFunction);
-
-        // Least recently used entries will be in the front.
-        // Start killing until we have room.
-
-        // Note on removeEntry: It expects an index into the index table,
-        // but our sorted list is all jumbled. But we stored the real index
-        // in the firstPage member.
-        // Remove entries until we've removed at least the required number
-        // of pages.
-        uint i = 0;
-        while (i < indexTableSize() && numberNeeded > cacheAvail) {
-            int curIndex = table[i++].firstPage; // Really an index, not a page
-
-            // Removed everything, still no luck (or curIndex is set but too high).
-            if (curIndex < 0 || static_cast<uint>(curIndex) >= indexTableSize()) {
-                qCritical() << "Trying to remove index" << curIndex
-                            << "out-of-bounds for index table of size" << indexTableSize();
-                throw KSDCCorrupted();
-            }
-
-            qCDebug(KCOREADDONS_DEBUG) << "Removing entry of" << indexTable()[curIndex].totalItemSize
-                     << "size";
-            removeEntry(curIndex);
-        }
-
-        // At this point let's see if we have freed up enough data by
-        // defragmenting first and seeing if we can find that free space.
-        defragment();
-
-        pageID result = pageTableSize();
-        while (i < indexTableSize() &&
-                (static_cast<uint>(result = findEmptyPages(numberNeeded))) >= pageTableSize()) {
-            int curIndex = table[i++].firstPage;
-
-            if (curIndex < 0) {
-                // One last shot.
-                defragment();
-                return findEmptyPages(numberNeeded);
-            }
-
-            if (Q_UNLIKELY(static_cast<uint>(curIndex) >= indexTableSize())) {
-                throw KSDCCorrupted();
-            }
-
-            removeEntry(curIndex);
+            evictEntry(curIndex);
         }
 
         // Whew.
@@ -940,14 +1408,17 @@ struct SharedMemory {
         pageTableStart = alignTo<PageTableEntry>(pageTableStart);
         pageTableStart += numberPages;
 
+        quint64 *freePageMapStart = alignTo<quint64>(pageTableStart);
+        freePageMapStart += (numberPages + 63) / 64;
+
         // The weird part, we must manually adjust the pointer based on the page size.
-        char *cacheStart = reinterpret_cast<char *>(pageTableStart);
+        char *cacheStart = alignTo<char>(freePageMapStart, effectivePageSize);
         cacheStart += (numberPages * effectivePageSize);
 
         // ALIGNOF gives pointer alignment
         cacheStart = alignTo<char>(cacheStart, ALIGNOF(void *));
 
-        // We've traversed the header, index, page table, and cache.
+        // We've traversed the header, index, page table, free page map, and cache.
         // Wherever we're at now is the size of the enchilada.
         return static_cast<uint>(reinterpret_cast<quintptr>(cacheStart));
     }
@@ -963,6 +1434,244 @@ struct SharedMemory {
     }
 
     void removeEntry(uint index);
+
+    // Removes the entry at @p index to make room for another one.
+    void evictEntry(uint index)
+    {
+        evictionCount.fetchAndAddRelaxed(1);
+        removeEntry(index);
+    }
+
+    // Returns true if @p entry is too old to be used anymore at time @p now.
+    bool isExpired(const IndexTableEntry &entry, time_t now) const
+    {
+        const int timeToLive = entryTimeToLive.load();
+        return timeToLive > 0 && now - entry.addTime >= timeToLive;
+    }
+
+    // Same as findNamedEntry(), but treats expired entries as missing.
+    qint32 findLiveEntry(const QByteArray &key, uint keyHash) const
+    {
+        const qint32 position = findNamedEntry(key, keyHash);
+        if (position >= 0 && isExpired(indexTable()[position], ::time(nullptr))) {
+            return -1;
+        }
+
+        return position;
+    }
+
+    // Removes the entry at @p index since it has expired.
+    void expireEntry(uint index)
+    {
+        expirationCount.fetchAndAddRelaxed(1);
+        removeEntry(index);
+    }
+
+    /**
+     * Removes expired entries, looking at no more than @p maxScanned index
+     * table entries after the point the previous call stopped at. This way
+     * expired entries are reclaimed eventually without holding the lock for
+     * long at any one time.
+     *
+     * @return The number of entries removed.
+     */
+    uint expireEntries(uint maxScanned)
+    {
+        if (entryTimeToLive.load() <= 0 || indexUsed == 0) {
+            return 0;
+        }
+
+        const IndexTableEntry *table = indexTable();
+        const time_t now = ::time(nullptr);
+        uint position = expiryCursor % indexTableSize();
+        uint removed = 0;
+
+        for (uint scanned = 0; scanned < qMin(maxScanned, indexTableSize()); ++scanned) {
+            if (table[position].firstPage >= 0 && isExpired(table[position], now)) {
+                // Removal shifts the following entry back into this
+                // position, so look at the same position again.
+                expireEntry(position);
+                ++removed;
+                continue;
+            }
+
+            position = (position + 1) % indexTableSize();
+        }
+
+        expiryCursor = position;
+        return removed;
+    }
+
+    // Returns true if the key and data of @p entry still match the checksum
+    // computed when it was inserted.
+    bool isIntact(const IndexTableEntry &entry) const
+    {
+        const char *item = static_cast<const char *>(page(entry.firstPage));
+        if (Q_UNLIKELY(!item ||
+                entry.totalItemSize > (pageTableSize() - entry.firstPage) * cachePageSize())) {
+            throw KSDCCorrupted();
+        }
+
+        return adler32(item, entry.totalItemSize) == entry.checksum;
+    }
+
+    // Removes the entry at @p index since its key or data were damaged. Only
+    // this entry is lost, the rest of the cache remains usable.
+    void dropDamagedEntry(uint index)
+    {
+        qCWarning(KCOREADDONS_DEBUG) << "Removing damaged entry" << index << "from the cache";
+        corruptionCount.fetchAndAddRelaxed(1);
+        removeEntry(index);
+    }
+
+    /**
+     * Rebuilds the index and page tables from the entries whose pages are
+     * all still linked to them, dropping any other entry and releasing any
+     * page not owned by a remaining entry. This repairs what a process which
+     * died while inserting, removing or moving an entry left behind, apart
+     * from the data itself (see checkEntries()).
+     */
+    void repairTables()
+    {
+        const IndexTableEntry *indices = indexTable();
+        const PageTableEntry *pages = pageTable();
+        QVector<IndexTableEntry> entries;
+        uint damagedEntries = 0;
+
+        for (uint i = 0; i < indexTableSize(); ++i) {
+            const IndexTableEntry &entry = indices[i];
+            if (entry.firstPage < 0) {
+                continue;
+            }
+
+            bool intact = static_cast<uint>(entry.firstPage) < pageTableSize() && entry.totalItemSize > 0 &&
+                          intCeil(entry.totalItemSize, cachePageSize()) <= pageTableSize() - entry.firstPage;
+            for (uint j = 0; intact && j < intCeil(entry.totalItemSize, cachePageSize()); ++j) {
+                intact = static_cast<uint>(pages[entry.firstPage + j].index) == i;
+            }
+
+            if (intact) {
+                entries.append(entry);
+            } else {
+                damagedEntries++;
+            }
+        }
+
+        for (uint i = 0; i < indexTableSize(); ++i) {
+            clearIndexEntry(i);
+        }
+        for (uint i = 0; i < pageTableSize(); ++i) {
+            setPageOwner(i, -1);
+        }
+
+        cacheAvail = pageTableSize();
+        defragmentHint = 0;
+        indexUsed = 0;
+        maxProbeDistance = 0;
+        protectedCount = 0;
+
+        for (const IndexTableEntry &entry : qAsConst(entries)) {
+            const uint position = insertIndexEntry(entry);
+            const uint pageCount = intCeil(entry.totalItemSize, cachePageSize());
+            for (uint i = 0; i < pageCount; ++i) {
+                setPageOwner(entry.firstPage + i, position);
+            }
+
+            cacheAvail -= pageCount;
+            if (entry.flags & ProtectedEntry) {
+                protectedCount++;
+            }
+        }
+
+        corruptionCount.fetchAndAddRelaxed(damagedEntries);
+        generation.ref();
+    }
+
+    /**
+     * Checks up to @p maxEntries index table entries after the point the
+     * previous call stopped at, or all of them if @p maxEntries is 0. Entries
+     * whose key or data no longer match their checksum are removed. Damage to
+     * the index or page tables themselves can not be repaired this way and
+     * results in a KSDCCorrupted exception.
+     *
+     * @return The number of entries removed.
+     */
+    uint checkEntries(uint maxEntries)
+    {
+        const IndexTableEntry *table = indexTable();
+        const PageTableEntry *pages = pageTable();
+        const uint limit = maxEntries > 0 ? qMin(maxEntries, indexTableSize()) : indexTableSize();
+        uint position = integrityCursor % indexTableSize();
+        uint removed = 0;
+
+        for (uint scanned = 0; scanned < limit;) {
+            const IndexTableEntry &entry = table[position];
+            if (entry.firstPage >= 0) {
+                if (!(entry.flags & PendingEntry) && !isIntact(entry)) {
+                    // Removal shifts the following entry back into this
+                    // position, so look at the same position again.
+                    dropDamagedEntry(position);
+                    ++removed;
+                    continue;
+                }
+
+                const uint pageCount = intCeil(entry.totalItemSize, cachePageSize());
+                for (uint i = 0; i < pageCount; ++i) {
+                    if (Q_UNLIKELY(static_cast<uint>(pages[entry.firstPage + i].index) != position)) {
+                        throw KSDCCorrupted();
+                    }
+                }
+            }
+
+            position = (position + 1) % indexTableSize();
+            ++scanned;
+        }
+
+        integrityCursor = position;
+        return removed;
+    }
+
+    /**
+     * Removes every entry whose key starts with @p prefix, in one pass over
+     * the index table.
+     *
+     * @return The number of entries removed.
+     */
+    uint removeEntriesWithPrefix(const QByteArray &prefix)
+    {
+        const IndexTableEntry *table = indexTable();
+        const uint prefixSize = prefix.size();
+        uint removed = 0;
+        uint position = 0;
+
+        while (position < indexTableSize()) {
+            const IndexTableEntry &entry = table[position];
+            if (entry.firstPage < 0 || entry.totalItemSize <= prefixSize) {
+                ++position;
+                continue;
+            }
+
+            const uint pageCount = intCeil(entry.totalItemSize, cachePageSize());
+            if (pageCount > pageTableSize() ||
+                    static_cast<uint>(entry.firstPage) > pageTableSize() - pageCount) {
+                throw KSDCCorrupted();
+            }
+
+            // The key is stored first, so comparing the start of the entry
+            // is enough.
+            if (::memcmp(page(entry.firstPage), prefix.constData(), prefixSize) == 0) {
+                // Removal shifts the following entry back into this
+                // position, so look at the same position again.
+                removeEntry(position);
+                ++removed;
+                continue;
+            }
+
+            ++position;
+        }
+
+        return removed;
+    }
 };
 
 // The per-instance private data, such as map size, whether
@@ -981,6 +1690,16 @@ public:
         , m_defaultCacheSize(defaultCacheSize)
         , m_expectedItemSize(expectedItemSize)
         , m_expectedType(LOCKTYPE_INVALID)
+        , m_generationBase(0)
+        , m_viewsHandedOut(false)
+        , m_pendingUseCount(0)
+        , m_pendingHits(0)
+        , m_pendingMisses(0)
+        , m_asyncPendingBytes(0)
+        , m_asyncStopping(false)
+        , m_asyncThread(nullptr)
+        , m_memoryHints(KSharedDataCache::NoMemoryHints)
+        , m_verifyChecksumsOnFind(false)
     {
         mapSharedMemory();
     }
@@ -995,15 +1714,295 @@ public:
         // cleared before shm is removed.
         m_lock.clear();
 
-        if (shm && 0 != ::munmap(shm, m_mapSize)) {
-            qCritical() << "Unable to unmap shared memory segment"
-                        << static_cast<void *>(shm) << ":" << ::strerror(errno);
+        if (shm) {
+            // Views returned by findView() may still point into this mapping,
+            // so keep it around until the cache object itself goes away. Make
+            // sure the generation seen by those views will never be seen
+            // again either.
+            m_generationBase += static_cast<unsigned>(shm->generation.load()) + 1;
+
+            if (m_viewsHandedOut) {
+                m_retiredMappings.append(qMakePair(static_cast<void *>(shm), m_mapSize));
+            } else if (0 != ::munmap(shm, m_mapSize)) {
+                qCritical() << "Unable to unmap shared memory segment"
+                            << static_cast<void *>(shm) << ":" << ::strerror(errno);
+            }
         }
 
         shm = nullptr;
         m_mapSize = 0;
     }
 
+    // Returns the generation of the cache as seen by this instance. This only
+    // ever increases, even across re-mappings of the shared memory.
+    unsigned currentGeneration() const
+    {
+        return m_generationBase + static_cast<unsigned>(shm->generation.fetchAndAddAcquire(0));
+    }
+
+    // Whether findLocked() and peekEntry() verify the checksum of the entry
+    // they find. This requires reading all of its data, so it is only worth
+    // it when the data is copied anyway.
+    enum ChecksumCheck {
+        IgnoreChecksum,
+        VerifyChecksum
+    };
+
+    // The checksum check find() and findMany() do for lookups which copy the
+    // data, see KSharedDataCache::setVerifyChecksumsOnFind().
+    ChecksumCheck lookupChecksumCheck() const
+    {
+        return m_verifyChecksumsOnFind ? VerifyChecksum : IgnoreChecksum;
+    }
+
+    // Looks up the entry named by @p encodedKey, whose hash is @p keyHash,
+    // and updates its usage data.
+    // Must be called with the lock held. Returns a pointer to the data within
+    // shared memory and sets @p dataSize and @p flags, or returns nullptr if
+    // there is no such entry. Expired entries are removed, as are damaged
+    // entries if @p check is VerifyChecksum.
+    const char *findLocked(const QByteArray &encodedKey, uint keyHash, uint *dataSize, uint *flags,
+                           ChecksumCheck check = IgnoreChecksum)
+    {
+        qint32 entry = shm->findNamedEntry(encodedKey, keyHash);
+        if (entry < 0) {
+            return nullptr;
+        }
+
+        IndexTableEntry *header = &shm->indexTable()[entry];
+        const time_t now = ::time(nullptr);
+        if (shm->isExpired(*header, now)) {
+            WriteSequence writing(shm);
+            shm->expireEntry(entry);
+            return nullptr;
+        }
+
+        const void *resultPage = shm->page(header->firstPage);
+        if (Q_UNLIKELY(!resultPage)) {
+            throw KSDCCorrupted();
+        }
+
+        verifyProposedMemoryAccess(resultPage, header->totalItemSize);
+
+        if (check == VerifyChecksum && !shm->isIntact(*header)) {
+            WriteSequence writing(shm);
+            shm->dropDamagedEntry(entry);
+            return nullptr;
+        }
+
+        applyPendingUses();
+        header->useCount++;
+        header->lastUsedTime = now;
+        shm->markReferenced(*header);
+
+        // Our item is the key followed immediately by the data, so skip
+        // past the key.
+        const char *cacheData = reinterpret_cast<const char *>(resultPage);
+        cacheData += encodedKey.size();
+        cacheData++; // Skip trailing null -- now we're pointing to start of data
+
+        *dataSize = header->totalItemSize - encodedKey.size() - 1;
+        *flags = header->flags;
+        return cacheData;
+    }
+
+    // Same as findLocked(), but for use without the lock through
+    // readOptimistic(). Nothing in shared memory is modified, and anything
+    // that looks inconsistent results in a return value of false instead of
+    // an exception. If the entry is not present @p data is set to nullptr.
+    // An entry failing the checksum check is left for findLocked() to remove.
+    bool peekEntry(const QByteArray &encodedKey, uint keyHash, const char **data, uint *dataSize, uint *flags,
+                   ChecksumCheck check = IgnoreChecksum) const
+    {
+        *data = nullptr;
+
+        qint32 entry = shm->findNamedEntry(encodedKey, keyHash);
+        if (entry < 0) {
+            return true;
+        }
+
+        // Copy the header, it may change under us.
+        const IndexTableEntry header = shm->indexTable()[entry];
+        if (shm->isExpired(header, ::time(nullptr))) {
+            // Left for the next writer to remove.
+            return true;
+        }
+
+        const uint keySize = encodedKey.size() + 1;
+        const void *resultPage = shm->page(header.firstPage);
+        if (!resultPage || header.totalItemSize < keySize ||
+                !isValidMemoryAccess(resultPage, header.totalItemSize)) {
+            return false;
+        }
+
+        if (check == VerifyChecksum && !shm->isIntact(header)) {
+            return false;
+        }
+
+        *data = reinterpret_cast<const char *>(resultPage) + keySize;
+        *dataSize = header.totalItemSize - keySize;
+        *flags = header.flags;
+        return true;
+    }
+
+    // Runs @p reader without holding the lock, retrying if a writer modified
+    // the cache in the meantime. The reader must not modify shared memory and
+    // its results must only be used if this function returns true. A false
+    // return means the read could not be completed consistently and must be
+    // retried with the lock held.
+    template<typename Reader>
+    bool readOptimistic(Reader reader) const
+    {
+        for (int attempt = 0; attempt < MAX_OPTIMISTIC_READS; ++attempt) {
+            // Let the lock take care of switching over to a resized cache.
+            if (Q_UNLIKELY(shm->superseded.loadAcquire())) {
+                return false;
+            }
+
+            const int sequence = shm->writeSequence.loadAcquire();
+            if (sequence & 1) {
+                // A writer is busy, give it a chance to finish.
+                ::sched_yield();
+                continue;
+            }
+
+            bool consistent = false;
+            try {
+                consistent = reader();
+            } catch (KSDCCorrupted) {
+                consistent = false;
+            }
+
+            // Ensure the reads done by the reader are complete before
+            // checking the sequence again.
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (shm->writeSequence.load() == sequence) {
+                return consistent;
+            }
+        }
+
+        return false;
+    }
+
+    // Returns @p data as it should be stored in the cache, compressed if that
+    // is enabled and worthwhile, and sets @p flags to match.
+    QByteArray encodeValue(const QByteArray &data, uint *flags) const
+    {
+        *flags = 0;
+
+        const uint threshold = shm ? static_cast<uint>(shm->compressionThreshold.load()) : 0;
+        if (threshold == 0 || static_cast<uint>(data.size()) < threshold) {
+            return data;
+        }
+
+        // Favor speed over size, entries are typically inserted while the
+        // user waits.
+        const QByteArray compressed = qCompress(data, 1);
+        shm->compressionInput.fetchAndAddRelaxed(data.size());
+
+        if (compressed.size() >= data.size()) {
+            shm->compressionOutput.fetchAndAddRelaxed(data.size());
+            return data;
+        }
+
+        shm->compressionOutput.fetchAndAddRelaxed(compressed.size());
+        *flags |= CompressedEntry;
+        return compressed;
+    }
+
+    // Returns the original data of an entry stored as @p stored with @p flags.
+    static QByteArray decodeValue(const QByteArray &stored, uint flags)
+    {
+        if (!(flags & CompressedEntry)) {
+            return stored;
+        }
+
+        const QByteArray result = qUncompress(stored);
+        if (Q_UNLIKELY(result.isEmpty())) {
+            throw KSDCCorrupted();
+        }
+
+        return result;
+    }
+
+    // Returns a copy of the original data of an entry stored in the cache.
+    static QByteArray copyValue(const char *data, uint dataSize, uint flags)
+    {
+        if (flags & CompressedEntry) {
+            return decodeValue(QByteArray::fromRawData(data, dataSize), flags);
+        }
+
+        return QByteArray(data, dataSize);
+    }
+
+    // Counts lookups for the hit and miss statistics. The counts are kept in
+    // process-local memory, so that lock-free lookups in different processes
+    // do not compete for the shared counters, and are added to those by
+    // applyLookupCounts() the next time the lock is held.
+    void recordLookups(uint hits, uint misses)
+    {
+        if (hits) {
+            m_pendingHits.fetchAndAddRelaxed(hits);
+        }
+        if (misses) {
+            m_pendingMisses.fetchAndAddRelaxed(misses);
+        }
+    }
+
+    // Must be called with the lock held.
+    void applyLookupCounts()
+    {
+        const quint32 hits = m_pendingHits.fetchAndStoreRelaxed(0);
+        const quint32 misses = m_pendingMisses.fetchAndStoreRelaxed(0);
+        if (hits) {
+            shm->hitCount.fetchAndAddRelaxed(hits);
+        }
+        if (misses) {
+            shm->missCount.fetchAndAddRelaxed(misses);
+        }
+    }
+
+    // Lock-free lookups may not modify the index table, so the usage data
+    // they generate is recorded here instead and applied to the index table
+    // the next time the lock is held. Returns true if enough usage data has
+    // accumulated that it should be applied soon.
+    bool recordPendingUse(const QByteArray &encodedKey)
+    {
+        QMutexLocker locker(&m_pendingUsesMutex);
+
+        PendingUse &use = m_pendingUses[encodedKey];
+        use.count++;
+        use.lastUsedTime = ::time(nullptr);
+
+        return ++m_pendingUseCount >= MAX_PENDING_USES;
+    }
+
+    // Must be called with the lock held.
+    void applyPendingUses()
+    {
+        QHash<QByteArray, PendingUse> pendingUses;
+        {
+            QMutexLocker locker(&m_pendingUsesMutex);
+            if (m_pendingUses.isEmpty()) {
+                return;
+            }
+            pendingUses.swap(m_pendingUses);
+            m_pendingUseCount = 0;
+        }
+
+        IndexTableEntry *indices = shm->indexTable();
+        for (auto it = pendingUses.constBegin(); it != pendingUses.constEnd(); ++it) {
+            // The entry may well be gone by now, which is fine.
+            qint32 entry = shm->findNamedEntry(it.key());
+            if (entry >= 0) {
+                indices[entry].useCount += it.value().count;
+                indices[entry].lastUsedTime = qMax(indices[entry].lastUsedTime, it.value().lastUsedTime);
+                shm->markReferenced(indices[entry], it.value().count);
+            }
+        }
+    }
+
     // This function does a lot of the important work, attempting to connect to shared
     // memory, a private anonymous mapping if that fails, and failing that, nothing (but
     // the cache remains "valid", we just don't actually do anything).
@@ -1072,15 +2071,21 @@ public:
                     shm = mapped;
                     recoverCorruptedCache();
                     return;
-                } else if (mapped->cacheSize > cacheSize) {
+                } else if (mapped->version > 0 &&
+                           SharedMemory::totalSize(mapped->cacheSize, mapped->cachePageSize()) != size) {
+                    // The existing cache may be larger or smaller than what we
+                    // asked for (e.g. if it was resized), either way we must
+                    // match its size to be able to access every entry.
                     // This order is very important. We must save the cache size
                     // before we remove the mapping, but unmap before overwriting
                     // the previous mapping size...
                     cacheSize = mapped->cacheSize;
-                    unsigned actualPageSize = mapped->cachePageSize();
+                    pageSize = mapped->cachePageSize();
                     ::munmap(mapAddress, size);
-                    size = SharedMemory::totalSize(cacheSize, actualPageSize);
-                    mapAddress = QT_MMAP(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file.handle(), 0);
+                    size = SharedMemory::totalSize(cacheSize, pageSize);
+                    mapAddress = file.size() >= size
+                                 ? QT_MMAP(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file.handle(), 0)
+                                 : MAP_FAILED;
                 }
             }
         }
@@ -1161,9 +2166,44 @@ public:
         m_lock = QSharedPointer<KSDCLock>(createLockFromId(m_expectedType, shm->shmLock));
         bool isProcessSharingSupported = false;
 
-        if (!m_lock->initialize(isProcessSharingSupported)) {
+        if (!m_lock->attach(isProcessSharingSupported)) {
             qCritical() << "Unable to setup shared cache lock, although it worked when created.";
             detachFromSharedMemory();
+            return;
+        }
+
+        applyMemoryHints();
+    }
+
+    // Passes the memory hints set with KSharedDataCache::setMemoryHints() on
+    // to the system for the current mapping.
+    void applyMemoryHints()
+    {
+        if (!shm) {
+            return;
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (m_memoryHints & KSharedDataCache::TransparentHugePages) {
+            // Only the data pages are large enough to benefit.
+            char *dataStart = static_cast<char *>(shm->cachePages());
+            const size_t dataSize = reinterpret_cast<char *>(shm) + m_mapSize - dataStart;
+            adviseMemory(dataStart, dataSize, MADV_HUGEPAGE);
+        }
+#endif
+
+        if (m_memoryHints & KSharedDataCache::PrefaultMemory) {
+            // Populating the page tables avoids a page fault on first access
+            // of every single page. This would dirty the whole file when
+            // populating for writing, so only populate for reading.
+#ifdef MADV_POPULATE_READ
+            if (adviseMemory(shm, m_mapSize, MADV_POPULATE_READ)) {
+                return;
+            }
+#endif
+#ifdef MADV_WILLNEED
+            adviseMemory(shm, m_mapSize, MADV_WILLNEED);
+#endif
         }
     }
 
@@ -1188,12 +2228,21 @@ public:
     // If the access is /not/ safe then a KSDCCorrupted exception will be
     // thrown, so be ready to catch that.
     void verifyProposedMemoryAccess(const void *base, unsigned accessLength) const
+    {
+        if (Q_UNLIKELY(!isValidMemoryAccess(base, accessLength))) {
+            throw KSDCCorrupted();
+        }
+    }
+
+    // Same as verifyProposedMemoryAccess(), but returns false instead of
+    // throwing if the access is not safe.
+    bool isValidMemoryAccess(const void *base, unsigned accessLength) const
     {
         quintptr startOfAccess = reinterpret_cast<quintptr>(base);
         quintptr startOfShm = reinterpret_cast<quintptr>(shm);
 
-        if (Q_UNLIKELY(startOfAccess < startOfShm)) {
-            throw KSDCCorrupted();
+        if (startOfAccess < startOfShm) {
+            return false;
         }
 
         quintptr endOfShm = startOfShm + m_mapSize;
@@ -1201,17 +2250,40 @@ public:
 
         // Check for unsigned integer wraparound, and then
         // bounds access
-        if (Q_UNLIKELY((endOfShm < startOfShm) ||
-                       (endOfAccess < startOfAccess) ||
-                       (endOfAccess > endOfShm))) {
-            throw KSDCCorrupted();
-        }
+        return endOfShm >= startOfShm &&
+               endOfAccess >= startOfAccess &&
+               endOfAccess <= endOfShm;
     }
 
-    bool lock() const
+    // Called with the lock held if the process which held it before died,
+    // possibly in the middle of modifying the cache. Repairs the cache as far
+    // as possible, or returns false if it has to be cleared.
+    bool repairAfterOwnerDeath()
     {
-        if (Q_LIKELY(shm && shm->shmLock.type == m_expectedType)) {
-            return m_lock->lock();
+        qCWarning(KCOREADDONS_DEBUG) << "A process died while using cache" << m_cacheName
+                                     << ", checking it for damage";
+        shm->ownerDeathCount.fetchAndAddRelaxed(1);
+
+        // Let lock-free readers continue if the write sequence was left open.
+        if (shm->writeSequence.load() & 1) {
+            shm->writeSequence.fetchAndAddRelease(1);
+        }
+
+        try {
+            WriteSequence writing(shm);
+            shm->repairTables();
+            shm->checkEntries(0);
+        } catch (KSDCCorrupted) {
+            return false;
+        }
+
+        return true;
+    }
+
+    bool lock() const
+    {
+        if (Q_LIKELY(shm && shm->shmLock.type == m_expectedType)) {
+            return m_lock->lock();
         }
 
         // No shm or wrong type --> corrupt!
@@ -1226,15 +2298,47 @@ public:
     class CacheLocker
     {
         mutable Private *d;
+        QElapsedTimer m_holdTimer;
 
         bool cautiousLock()
+        {
+            int remapCount = 0;
+
+            while (lockCurrentMapping()) {
+                if (Q_LIKELY(!d->shm->superseded.loadAcquire())) {
+                    return true;
+                }
+
+                // Another process resized the cache, switch over to the new
+                // one and lock that instead.
+                d->unlock();
+                d->detachFromSharedMemory();
+                d->mapSharedMemory();
+
+                if (!d->shm || remapCount++ > 4) {
+                    qCWarning(KCOREADDONS_DEBUG) << "Lost the connection to shared memory for cache"
+                               << d->m_cacheName;
+                    d->detachFromSharedMemory();
+                    return false;
+                }
+            }
+
+            return false;
+        }
+
+        bool lockCurrentMapping()
         {
             int lockCount = 0;
 
             // Locking can fail due to a timeout. If it happens too often even though
             // we're taking corrective action assume there's some disastrous problem
             // and give up.
-            while (!d->lock() && !isLockedCacheSafe()) {
+            while (!d->lock()) {
+                d->shm->lockTimeoutCount.fetchAndAddRelaxed(1);
+                if (isLockedCacheSafe()) {
+                    break;
+                }
+
                 d->recoverCorruptedCache();
 
                 if (!d->shm) {
@@ -1251,6 +2355,11 @@ public:
                 }
             }
 
+            if (Q_UNLIKELY(d->m_lock->previousOwnerDied()) && !d->repairAfterOwnerDeath()) {
+                d->unlock();
+                throw KSDCCorrupted();
+            }
+
             return true;
         }
 
@@ -1268,11 +2377,15 @@ public:
             if (Q_UNLIKELY(d->shm->version != SharedMemory::PIXMAP_CACHE_VERSION)) {
                 return false;
             }
+            if (Q_UNLIKELY(d->shm->indexUsed > d->shm->indexTableSize())) {
+                return false;
+            }
             switch (d->shm->evictionPolicy.load()) {
             case NoEvictionPreference:   // fallthrough
             case EvictLeastRecentlyUsed: // fallthrough
             case EvictLeastOftenUsed:    // fallthrough
-            case EvictOldest:
+            case EvictOldest:           // fallthrough
+            case EvictScanResistant:
                 break;
             default:
                 return false;
@@ -1286,12 +2399,18 @@ public:
         {
             if (Q_UNLIKELY(!d || !d->shm || !cautiousLock())) {
                 d = nullptr;
+                return;
             }
+
+            m_holdTimer.start();
         }
 
         ~CacheLocker()
         {
             if (d && d->shm) {
+                d->applyLookupCounts();
+                d->shm->lockCount.fetchAndAddRelaxed(1);
+                d->shm->lockHoldTime.fetchAndAddRelaxed(m_holdTimer.nsecsElapsed());
                 d->unlock();
             }
         }
@@ -1305,6 +2424,57 @@ public:
         }
     };
 
+    // Marks the shared memory as being modified for as long as it exists, so
+    // that lock-free readers know to retry. Must only be created while the
+    // lock is held.
+    class WriteSequence
+    {
+        SharedMemory *m_shm;
+
+    public:
+        explicit WriteSequence(SharedMemory *shm) : m_shm(shm)
+        {
+            m_shm->writeSequence.fetchAndAddOrdered(1);
+        }
+
+        ~WriteSequence()
+        {
+            m_shm->writeSequence.fetchAndAddRelease(1);
+        }
+
+        WriteSequence(const WriteSequence &) = delete;
+        WriteSequence &operator=(const WriteSequence &) = delete;
+    };
+
+    bool insertLocked(const QByteArray &encodedKey, uint keyHash, const QByteArray &data, uint flags = 0);
+    char *allocateLocked(const QByteArray &encodedKey, uint keyHash, uint dataSize, uint flags, quint32 checksum);
+    bool copyToResizedCache(uint newCacheSize);
+    QVector<uint> entriesByValue() const;
+    void readEntry(const IndexTableEntry &entry, QByteArray *key, QByteArray *data) const;
+    bool insertEntries(const QHash<QString, QByteArray> &entries);
+
+    // Asynchronous inserts, see KSharedDataCache::insertAsync(). Entries are
+    // queued in m_asyncPending and moved to m_asyncCommitting by the worker
+    // thread while it inserts them into the cache. Both are only modified
+    // with m_asyncMutex held. The worker thread uses a KSharedDataCache of
+    // its own for inserting, and touches nothing else of this instance.
+    bool enqueueInsert(const QString &key, const QByteArray &data);
+    bool findQueued(const QString &key, QByteArray *destination);
+    void cancelQueuedInsert(const QString &key);
+    void discardQueuedInserts(const QString &prefix = QString());
+    void flushQueuedInserts();
+    void stopAsyncInserts();
+    void runAsyncInserts(uint cacheSize);
+
+    // The devices returned by insertStreamed() and findStreamed().
+    class StreamWriter;
+    class StreamReader;
+
+    struct PendingUse {
+        uint count = 0;
+        time_t lastUsedTime = 0;
+    };
+
     QString m_cacheName;
     SharedMemory *shm;
     QSharedPointer<KSDCLock> m_lock;
@@ -1312,6 +2482,25 @@ public:
     uint m_defaultCacheSize;
     uint m_expectedItemSize;
     SharedLockId m_expectedType;
+    unsigned m_generationBase;
+    bool m_viewsHandedOut;
+    QVector<QPair<void *, uint> > m_retiredMappings;
+    QMutex m_pendingUsesMutex;
+    QHash<QByteArray, PendingUse> m_pendingUses;
+    int m_pendingUseCount; // Number of lookups recorded in m_pendingUses
+    QAtomicInteger<quint32> m_pendingHits;
+    QAtomicInteger<quint32> m_pendingMisses;
+    QMutex m_asyncMutex;
+    QWaitCondition m_asyncWork;
+    QWaitCondition m_asyncDone;
+    QHash<QString, QByteArray> m_asyncPending;
+    QHash<QString, QByteArray> m_asyncCommitting;
+    QAtomicInt m_asyncQueued; // Number of entries in both of the above
+    uint m_asyncPendingBytes;
+    bool m_asyncStopping;
+    QThread *m_asyncThread;
+    KSharedDataCache::MemoryHints m_memoryHints;
+    bool m_verifyChecksumsOnFind;
 };
 
 // Must be called while the lock is already held!
@@ -1324,6 +2513,12 @@ void SharedMemory::removeEntry(uint index)
     PageTableEntry *pageTableEntries = pageTable();
     IndexTableEntry *entriesIndex = indexTable();
 
+    generation.ref();
+
+    if ((entriesIndex[index].flags & ProtectedEntry) && protectedCount > 0) {
+        protectedCount--;
+    }
+
     // Update page table first
     pageID firstPage = entriesIndex[index].firstPage;
     if (firstPage < 0 || static_cast<quint32>(firstPage) >= pageTableSize()) {
@@ -1332,6 +2527,10 @@ void SharedMemory::removeEntry(uint index)
         throw KSDCCorrupted();
     }
 
+    if (static_cast<uint>(firstPage) < defragmentHint) {
+        defragmentHint = firstPage;
+    }
+
     if (index != static_cast<uint>(pageTableEntries[firstPage].index)) {
         qCritical() << "Removing entry" << index << "but the matching data"
                     << "doesn't link back -- cache is corrupt, clearing.";
@@ -1342,7 +2541,7 @@ void SharedMemory::removeEntry(uint index)
     uint savedCacheSize = cacheAvail;
     for (uint i = firstPage; i < pageTableSize() &&
             static_cast<uint>(pageTableEntries[i].index) == index; ++i) {
-        pageTableEntries[i].index = -1;
+        setPageOwner(i, -1);
         cacheAvail++;
     }
 
@@ -1366,331 +2565,1738 @@ void SharedMemory::removeEntry(uint index)
     }
 #endif
 
-    // Update the index
-    entriesIndex[index].fileNameHash = 0;
-    entriesIndex[index].totalItemSize = 0;
-    entriesIndex[index].useCount = 0;
-    entriesIndex[index].lastUsedTime = 0;
-    entriesIndex[index].addTime = 0;
-    entriesIndex[index].firstPage = -1;
-}
-
-KSharedDataCache::KSharedDataCache(const QString &cacheName,
-                                   unsigned defaultCacheSize,
-                                   unsigned expectedItemSize)
-    : d(nullptr)
-{
-    try {
-        d = new Private(cacheName, defaultCacheSize, expectedItemSize);
-    } catch (KSDCCorrupted) {
-        KSharedDataCache::deleteCache(cacheName);
-
-        // Try only once more
-        try {
-            d = new Private(cacheName, defaultCacheSize, expectedItemSize);
-        } catch (KSDCCorrupted) {
-            qCritical()
-                    << "Even a brand-new cache starts off corrupted, something is"
-                    << "seriously wrong. :-(";
-            d = nullptr; // Just in case
-        }
+    // Update the index. Entries following the removed one in its probe
+    // sequence are shifted back by one so lookups never stop short of them
+    // (see insertIndexEntry()).
+    clearIndexEntry(index);
+    indexUsed--;
+
+    uint hole = index;
+    uint next = (hole + 1) % indexTableSize();
+    while (entriesIndex[next].firstPage >= 0 && probeDistance(next) > 0) {
+        entriesIndex[hole] = entriesIndex[next];
+        relinkPages(hole);
+        clearIndexEntry(next);
+
+        hole = next;
+        next = (next + 1) % indexTableSize();
     }
 }
 
-KSharedDataCache::~KSharedDataCache()
+// Must be called while the lock is already held!
+bool KSharedDataCache::Private::insertLocked(const QByteArray &encodedKey, uint keyHash, const QByteArray &data, uint flags)
 {
-    // Note that there is no other actions required to separate from the
-    // shared memory segment, simply unmapping is enough. This makes things
-    // *much* easier so I'd recommend maintaining this ideal.
-    if (!d) {
-        return;
+    // Reclaim some expired entries while we're at it.
+    shm->expireEntries(EXPIRY_SWEEP_SIZE);
+
+    // See if we're overwriting an existing entry.
+    qint32 existing = shm->findNamedEntry(encodedKey, keyHash);
+    if (existing >= 0) {
+        shm->removeEntry(existing);
     }
 
-    if (d->shm) {
-#ifdef KSDC_MSYNC_SUPPORTED
-        ::msync(d->shm, d->m_mapSize, MS_INVALIDATE | MS_ASYNC);
-#endif
-        ::munmap(d->shm, d->m_mapSize);
+    const quint32 checksum = adler32(data, adler32(encodedKey.constData(), encodedKey.size() + 1));
+    char *dataStart = allocateLocked(encodedKey, keyHash, data.size(), flags, checksum);
+    if (!dataStart) {
+        return false;
     }
 
-    // Do not delete d->shm, it was never constructed, it's just an alias.
-    d->shm = nullptr;
+    ::memcpy(dataStart, data.constData(), data.size());
 
-    delete d;
+    shm->insertCount.fetchAndAddRelaxed(1);
+    return true;
 }
 
-bool KSharedDataCache::insert(const QString &key, const QByteArray &data)
+// Must be called while the lock is already held! Makes room for @p dataSize
+// bytes of data named by @p encodedKey, adds an index entry with @p flags and
+// @p checksum for them and copies the key in place. Returns where the data
+// has to be copied to, or nullptr if there is no room for it.
+char *KSharedDataCache::Private::allocateLocked(const QByteArray &encodedKey, uint keyHash, uint dataSize,
+                                                uint flags, quint32 checksum)
 {
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
-            return false;
+    // Make sure there is room in the index table.
+    while (shm->indexUsed >= shm->maximumIndexUsage()) {
+        qint32 victim = shm->findEvictionCandidate();
+        if (Q_UNLIKELY(victim < 0)) {
+            throw KSDCCorrupted();
         }
 
-        QByteArray encodedKey = key.toUtf8();
-        uint keyHash = generateHash(encodedKey);
-        uint position = keyHash % d->shm->indexTableSize();
+        shm->evictEntry(victim);
+    }
 
-        // See if we're overwriting an existing entry.
-        IndexTableEntry *indices = d->shm->indexTable();
+    // Data will be stored as fileNamefoo\0PNGimagedata.....
+    // So total size required is the length of the encoded file name + 1
+    // for the trailing null, and then the length of the image data.
+    uint fileNameLength = 1 + encodedKey.length();
+    uint requiredSize = fileNameLength + dataSize;
+    uint pagesNeeded = intCeil(requiredSize, shm->cachePageSize());
+    uint firstPage(-1);
+
+    if (pagesNeeded >= shm->pageTableSize()) {
+        qCWarning(KCOREADDONS_DEBUG) << encodedKey << "is too large to be cached.";
+        return nullptr;
+    }
 
-        // In order to avoid the issue of a very long-lived cache having items
-        // with a use count of 1 near-permanently, we attempt to artifically
-        // reduce the use count of long-lived items when there is high load on
-        // the cache. We do this randomly, with a weighting that makes the event
-        // impossible if load < 0.5, and guaranteed if load >= 0.96.
-        const static double startCullPoint = 0.5l;
-        const static double mustCullPoint = 0.96l;
+    // If the cache has no room, or the fragmentation is too great to find
+    // the required number of consecutive free pages, take action.
+    if (pagesNeeded > shm->cacheAvail ||
+            (firstPage = shm->findEmptyPages(pagesNeeded)) >= shm->pageTableSize()) {
+        // If we have enough free space just defragment
+        uint freePagesDesired = 3 * qMax(1u, pagesNeeded / 2);
+
+        if (shm->cacheAvail > freePagesDesired) {
+            shm->defragment();
+            firstPage = shm->findEmptyPages(pagesNeeded);
+        } else {
+            // If we already have free pages we don't want to remove a ton
+            // extra. However we can't rely on the return value of
+            // removeUsedPages giving us a good location since we're not
+            // passing in the actual number of pages that we need.
+            shm->removeUsedPages(qMin(2 * freePagesDesired, shm->pageTableSize())
+                                    - shm->cacheAvail);
+            firstPage = shm->findEmptyPages(pagesNeeded);
+        }
 
-        // cacheAvail is in pages, cacheSize is in bytes.
-        double loadFactor = 1.0 - (1.0l * d->shm->cacheAvail * d->shm->cachePageSize()
-                                   / d->shm->cacheSize);
-        bool cullCollisions = false;
+        // The defragmentation budget may not have allowed to make enough
+        // room, try again by evicting entries instead.
+        if (firstPage >= shm->pageTableSize()) {
+            firstPage = shm->removeUsedPages(pagesNeeded);
+        }
 
-        if (Q_UNLIKELY(loadFactor >= mustCullPoint)) {
-            cullCollisions = true;
-        } else if (loadFactor > startCullPoint) {
-            const int tripWireValue = RAND_MAX * (loadFactor - startCullPoint) / (mustCullPoint - startCullPoint);
-            if (KRandom::random() >= tripWireValue) {
-                cullCollisions = true;
-            }
+        if (firstPage >= shm->pageTableSize() ||
+                shm->cacheAvail < pagesNeeded) {
+            qCritical() << "Unable to free up memory for" << encodedKey;
+            return nullptr;
         }
+    }
 
-        // In case of collisions in the index table (i.e. identical positions), use
-        // quadratic chaining to attempt to find an empty slot. The equation we use
-        // is:
-        // position = (hash + (i + i*i) / 2) % size, where i is the probe number.
-        uint probeNumber = 1;
-        while (indices[position].useCount > 0 && probeNumber < MAX_PROBE_COUNT) {
-            // If we actually stumbled upon an old version of the key we are
-            // overwriting, then use that position, do not skip over it.
+    // Update index
+    IndexTableEntry entry;
+    entry.fileNameHash = keyHash;
+    entry.totalItemSize = requiredSize;
+    entry.useCount = 1;
+    entry.addTime = ::time(nullptr);
+    entry.lastUsedTime = entry.addTime;
+    entry.firstPage = firstPage;
+    entry.flags = flags;
+    entry.checksum = checksum;
+
+    uint position = shm->insertIndexEntry(entry);
+
+    // Update page table
+    for (uint i = 0; i < pagesNeeded; ++i) {
+        shm->setPageOwner(firstPage + i, position);
+    }
 
-            if (Q_UNLIKELY(indices[position].fileNameHash == keyHash)) {
-                break;
-            }
+    // Update cache
+    shm->cacheAvail -= pagesNeeded;
 
-            // If we are "culling" old entries, see if this one is old and if so
-            // reduce its use count. If it reduces to zero then eliminate it and
-            // use its old spot.
+    // Actually move the data in place
+    void *dataPage = shm->page(firstPage);
+    if (Q_UNLIKELY(!dataPage)) {
+        throw KSDCCorrupted();
+    }
 
-            if (cullCollisions && (::time(nullptr) - indices[position].lastUsedTime) > 60) {
-                indices[position].useCount >>= 1;
-                if (indices[position].useCount == 0) {
-                    qCDebug(KCOREADDONS_DEBUG) << "Overwriting existing old cached entry due to collision.";
-                    d->shm->removeEntry(position); // Remove it first
-                    break;
-                }
-            }
+    // Verify it will all fit
+    verifyProposedMemoryAccess(dataPage, requiredSize);
 
-            position = (keyHash + (probeNumber + probeNumber * probeNumber) / 2)
-                       % d->shm->indexTableSize();
-            probeNumber++;
-        }
+    // Cast for byte-sized pointer arithmetic
+    char *startOfPageData = reinterpret_cast<char *>(dataPage);
+    ::memcpy(startOfPageData, encodedKey.constData(), fileNameLength);
+
+    return startOfPageData + fileNameLength;
+}
 
-        if (indices[position].useCount > 0 && indices[position].firstPage >= 0) {
-            //qCDebug(KCOREADDONS_DEBUG) << "Overwriting existing cached entry due to collision.";
-            d->shm->removeEntry(position); // Remove it first
+bool KSharedDataCache::Private::insertEntries(const QHash<QString, QByteArray> &entries)
+{
+    try {
+        if (!shm) {
+            return false;
         }
 
-        // Data will be stored as fileNamefoo\0PNGimagedata.....
-        // So total size required is the length of the encoded file name + 1
-        // for the trailing null, and then the length of the image data.
-        uint fileNameLength = 1 + encodedKey.length();
-        uint requiredSize = fileNameLength + data.size();
-        uint pagesNeeded = intCeil(requiredSize, d->shm->cachePageSize());
-        uint firstPage(-1);
+        QVector<QByteArray> encodedKeys;
+        QVector<uint> keyHashes;
+        QVector<QByteArray> storedData;
+        QVector<uint> flags;
+        encodedKeys.reserve(entries.size());
+        keyHashes.reserve(entries.size());
+        storedData.reserve(entries.size());
+        flags.reserve(entries.size());
+
+        for (auto it = entries.constBegin(); it != entries.constEnd(); ++it) {
+            uint entryFlags = 0;
+            encodedKeys.append(it.key().toUtf8());
+            keyHashes.append(generateHash(encodedKeys.last()));
+            storedData.append(encodeValue(it.value(), &entryFlags));
+            flags.append(entryFlags);
+        }
 
-        if (pagesNeeded >= d->shm->pageTableSize()) {
-            qCWarning(KCOREADDONS_DEBUG) << key << "is too large to be cached.";
+        CacheLocker lock(this);
+        if (lock.failed()) {
             return false;
         }
 
-        // If the cache has no room, or the fragmentation is too great to find
-        // the required number of consecutive free pages, take action.
-        if (pagesNeeded > d->shm->cacheAvail ||
-                (firstPage = d->shm->findEmptyPages(pagesNeeded)) >= d->shm->pageTableSize()) {
-            // If we have enough free space just defragment
-            uint freePagesDesired = 3 * qMax(1u, pagesNeeded / 2);
+        WriteSequence writing(shm);
+        applyPendingUses();
 
-            if (d->shm->cacheAvail > freePagesDesired) {
-                // TODO: How the hell long does this actually take on real
-                // caches?
-                d->shm->defragment();
-                firstPage = d->shm->findEmptyPages(pagesNeeded);
-            } else {
-                // If we already have free pages we don't want to remove a ton
-                // extra. However we can't rely on the return value of
-                // removeUsedPages giving us a good location since we're not
-                // passing in the actual number of pages that we need.
-                d->shm->removeUsedPages(qMin(2 * freePagesDesired, d->shm->pageTableSize())
-                                        - d->shm->cacheAvail);
-                firstPage = d->shm->findEmptyPages(pagesNeeded);
-            }
-
-            if (firstPage >= d->shm->pageTableSize() ||
-                    d->shm->cacheAvail < pagesNeeded) {
-                qCritical() << "Unable to free up memory for" << key;
-                return false;
+        // Pages of entries which are about to be replaced become free anyway.
+        const uint pageSize = shm->cachePageSize();
+        quint64 pagesNeeded = 0;
+        quint64 pagesReplaced = 0;
+        for (int i = 0; i < encodedKeys.size(); ++i) {
+            pagesNeeded += intCeil(encodedKeys.at(i).size() + 1 + storedData.at(i).size(), pageSize);
+
+            const qint32 existing = shm->findNamedEntry(encodedKeys.at(i), keyHashes.at(i));
+            if (existing >= 0) {
+                pagesReplaced += intCeil(shm->indexTable()[existing].totalItemSize, pageSize);
             }
         }
 
-        // Update page table
-        PageTableEntry *table = d->shm->pageTable();
-        for (uint i = 0; i < pagesNeeded; ++i) {
-            table[firstPage + i].index = position;
+        // Evict enough entries for the whole batch at once, instead of
+        // looking for eviction candidates separately for every entry that
+        // does not fit. Each entry only needs a run of pages of its own, which
+        // insertLocked() finds (or defragments for) as usual. A batch larger
+        // than the cache is left to insertLocked() as well, so that it does
+        // not clear out everything else first.
+        pagesNeeded = pagesNeeded > pagesReplaced ? pagesNeeded - pagesReplaced : 0;
+        if (pagesNeeded < shm->pageTableSize()) {
+            qint32 victim;
+            while (pagesNeeded > shm->cacheAvail && (victim = shm->findEvictionCandidate()) >= 0) {
+                shm->evictEntry(victim);
+            }
         }
 
-        // Update index
-        indices[position].fileNameHash = keyHash;
-        indices[position].totalItemSize = requiredSize;
-        indices[position].useCount = 1;
-        indices[position].addTime = ::time(nullptr);
-        indices[position].lastUsedTime = indices[position].addTime;
-        indices[position].firstPage = firstPage;
+        bool allInserted = true;
+        for (int i = 0; i < encodedKeys.size(); ++i) {
+            if (!insertLocked(encodedKeys.at(i), keyHashes.at(i), storedData.at(i), flags.at(i))) {
+                allInserted = false;
+            }
+        }
 
-        // Update cache
-        d->shm->cacheAvail -= pagesNeeded;
+        return allInserted;
+    } catch (KSDCCorrupted) {
+        recoverCorruptedCache();
+        return false;
+    }
+}
 
-        // Actually move the data in place
-        void *dataPage = d->shm->page(firstPage);
-        if (Q_UNLIKELY(!dataPage)) {
-            throw KSDCCorrupted();
+// Must be called while the lock is already held! Returns the positions of all
+// entries in the index table which have not expired, ordered by how much they
+// are worth keeping according to the eviction policy, most valuable first.
+QVector<uint> KSharedDataCache::Private::entriesByValue() const
+{
+    const SharedMemory::EntryCompareFunction compareFunction = shm->evictionCompareFunction();
+    const IndexTableEntry *indices = shm->indexTable();
+    const time_t now = ::time(nullptr);
+
+    QVector<uint> entries;
+    entries.reserve(shm->indexUsed);
+    for (uint i = 0; i < shm->indexTableSize(); ++i) {
+        if (indices[i].firstPage >= 0 && !(indices[i].flags & PendingEntry) &&
+                !shm->isExpired(indices[i], now)) {
+            entries.append(i);
         }
+    }
 
-        // Verify it will all fit
-        d->verifyProposedMemoryAccess(dataPage, requiredSize);
+    std::sort(entries.begin(), entries.end(), [=](uint left, uint right) {
+        return compareFunction(indices[right], indices[left]);
+    });
 
-        // Cast for byte-sized pointer arithmetic
-        uchar *startOfPageData = reinterpret_cast<uchar *>(dataPage);
-        ::memcpy(startOfPageData, encodedKey.constData(), fileNameLength);
-        ::memcpy(startOfPageData + fileNameLength, data.constData(), data.size());
+    return entries;
+}
 
-        return true;
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
-        return false;
+// Must be called while the lock is already held! Sets @p key to the UTF-8
+// encoded key of @p entry, and @p data to the data of @p entry as stored in
+// shared memory (i.e. possibly compressed, without making a copy).
+void KSharedDataCache::Private::readEntry(const IndexTableEntry &entry, QByteArray *key, QByteArray *data) const
+{
+    const char *item = static_cast<const char *>(shm->page(entry.firstPage));
+    if (!item || !isValidMemoryAccess(item, entry.totalItemSize)) {
+        throw KSDCCorrupted();
+    }
+
+    const uint keySize = qstrnlen(item, entry.totalItemSize);
+    if (keySize >= entry.totalItemSize) {
+        throw KSDCCorrupted();
     }
+
+    *key = QByteArray(item, keySize);
+    *data = QByteArray::fromRawData(item + keySize + 1, entry.totalItemSize - keySize - 1);
 }
 
-bool KSharedDataCache::find(const QString &key, QByteArray *destination) const
+// Must be called while the lock is already held! Creates a copy of the cache
+// sized @p newCacheSize, replaces the cache file with it and marks this cache
+// as superseded. The caller has to map the new cache afterwards.
+bool KSharedDataCache::Private::copyToResizedCache(uint newCacheSize)
 {
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
-            return false;
-        }
+    const uint pageSize = shm->cachePageSize();
+    newCacheSize = qMax(newCacheSize, qMax(pageSize * 256, uint(SharedMemory::MINIMUM_CACHE_SIZE)));
+    const uint newMapSize = SharedMemory::totalSize(newCacheSize, pageSize);
+
+    const QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation);
+    const QString cacheName = cacheDir + QLatin1String("/") + m_cacheName + QLatin1String(".kcache");
+    const QString newCacheName = cacheName + QLatin1String(".new");
+
+    // Left over from an earlier attempt, if at all. Nobody else can be using
+    // it since we hold the lock.
+    QFile::remove(newCacheName);
+
+    QFile file(newCacheName);
+    if (!file.open(QIODevice::ReadWrite) || !file.resize(newMapSize) ||
+            !ensureFileAllocated(file.handle(), newMapSize)) {
+        qCWarning(KCOREADDONS_DEBUG) << "Unable to create resized cache" << newCacheName;
+        file.remove();
+        return false;
+    }
 
-        // Search in the index for our data, hashed by key;
-        QByteArray encodedKey = key.toUtf8();
-        qint32 entry = d->shm->findNamedEntry(encodedKey);
+    void *mapAddress = QT_MMAP(nullptr, newMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, file.handle(), 0);
+    if (mapAddress == MAP_FAILED) {
+        file.remove();
+        return false;
+    }
 
-        if (entry >= 0) {
-            const IndexTableEntry *header = &d->shm->indexTable()[entry];
-            const void *resultPage = d->shm->page(header->firstPage);
-            if (Q_UNLIKELY(!resultPage)) {
-                throw KSDCCorrupted();
-            }
+    SharedMemory *target = reinterpret_cast<SharedMemory *>(mapAddress);
+    target->ready.testAndSetAcquire(0, 1);
+    if (!target->performInitialSetup(newCacheSize, pageSize)) {
+        ::munmap(mapAddress, newMapSize);
+        file.remove();
+        return false;
+    }
 
-            d->verifyProposedMemoryAccess(resultPage, header->totalItemSize);
+    target->evictionPolicy.store(shm->evictionPolicy.load());
+    target->defragmentationBudget.store(shm->defragmentationBudget.load());
+    target->compressionThreshold.store(shm->compressionThreshold.load());
+    target->entryTimeToLive.store(shm->entryTimeToLive.load());
+    target->cacheTimestamp.store(shm->cacheTimestamp.load());
 
-            header->useCount++;
-            header->lastUsedTime = ::time(nullptr);
+    // Copy the entries most worth keeping first, in case not all of them fit.
+    const QVector<uint> entries = entriesByValue();
+    const IndexTableEntry *indices = shm->indexTable();
 
-            // Our item is the key followed immediately by the data, so skip
-            // past the key.
-            const char *cacheData = reinterpret_cast<const char *>(resultPage);
-            cacheData += encodedKey.size();
-            cacheData++; // Skip trailing null -- now we're pointing to start of data
+    SharedMemory *const source = shm;
+    const uint sourceMapSize = m_mapSize;
 
-            if (destination) {
-                *destination = QByteArray(cacheData, header->totalItemSize - encodedKey.size() - 1);
+    try {
+        for (uint i : entries) {
+            const IndexTableEntry entry = indices[i];
+            if (!shm->isIntact(entry)) {
+                continue;
             }
 
-            return true;
+            QByteArray key;
+            QByteArray data;
+            readEntry(entry, &key, &data);
+
+            // insertLocked() works on shm, so point that to the new cache
+            // while copying over, but stop once it would have to evict.
+            shm = target;
+            m_mapSize = newMapSize;
+
+            const uint pagesNeeded = intCeil(entry.totalItemSize, pageSize);
+            if (shm->indexUsed < shm->maximumIndexUsage() &&
+                    static_cast<uint>(shm->findEmptyPages(pagesNeeded)) < shm->pageTableSize() &&
+                    insertLocked(key, entry.fileNameHash, data, entry.flags & CompressedEntry)) {
+                const qint32 position = shm->findNamedEntry(key, entry.fileNameHash);
+                if (position >= 0) {
+                    IndexTableEntry &copy = shm->indexTable()[position];
+                    copy.useCount = entry.useCount;
+                    copy.addTime = entry.addTime;
+                    copy.lastUsedTime = entry.lastUsedTime;
+                    if (entry.flags & ReferencedEntry) {
+                        shm->markReferenced(copy, (entry.flags & ProtectedEntry) ? 2 : 1);
+                    }
+                }
+            }
+
+            shm = source;
+            m_mapSize = sourceMapSize;
         }
     } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
+        shm = source;
+        m_mapSize = sourceMapSize;
+        ::munmap(mapAddress, newMapSize);
+        file.remove();
+        throw;
     }
 
-    return false;
+    // The statistics carry over as well.
+    target->hitCount.store(shm->hitCount.load());
+    target->missCount.store(shm->missCount.load());
+    target->insertCount.store(shm->insertCount.load());
+    target->evictionCount.store(shm->evictionCount.load());
+    target->expirationCount.store(shm->expirationCount.load());
+    target->corruptionCount.store(shm->corruptionCount.load());
+    target->defragmentationCount.store(shm->defragmentationCount.load());
+    target->lockCount.store(shm->lockCount.load());
+    target->lockTimeoutCount.store(shm->lockTimeoutCount.load());
+    target->ownerDeathCount.store(shm->ownerDeathCount.load());
+    target->lockHoldTime.store(shm->lockHoldTime.load());
+    target->compressionInput.store(shm->compressionInput.load());
+    target->compressionOutput.store(shm->compressionOutput.load());
+
+    ::munmap(mapAddress, newMapSize);
+
+    // Atomically replace the cache file, anyone opening the cache from now
+    // on gets the new one. Everyone else notices the next time they lock.
+    if (::rename(QFile::encodeName(newCacheName).constData(), QFile::encodeName(cacheName).constData()) != 0) {
+        qCWarning(KCOREADDONS_DEBUG) << "Unable to replace" << cacheName << "by the resized cache:"
+                                     << ::strerror(errno);
+        file.remove();
+        return false;
+    }
+
+    shm->superseded.storeRelease(1);
+    shm->generation.ref();
+
+    return true;
 }
 
-void KSharedDataCache::clear()
+bool KSharedDataCache::Private::enqueueInsert(const QString &key, const QByteArray &data)
 {
-    try {
-        Private::CacheLocker lock(d);
+    if (!shm) {
+        return false;
+    }
 
-        if (!lock.failed()) {
-            d->shm->clear();
-        }
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
+    // Anything beyond this would likely be evicted again by the same batch.
+    const uint maximumBytes = shm->cacheSize / 4;
+
+    QMutexLocker locker(&m_asyncMutex);
+
+    uint pendingBytes = m_asyncPendingBytes + data.size();
+    const auto existing = m_asyncPending.constFind(key);
+    if (existing != m_asyncPending.constEnd()) {
+        pendingBytes -= existing.value().size();
+    }
+
+    if (pendingBytes > maximumBytes) {
+        return false;
     }
+
+    if (!m_asyncThread) {
+        const uint cacheSize = m_defaultCacheSize;
+        m_asyncThread = QThread::create([this, cacheSize]() {
+            runAsyncInserts(cacheSize);
+        });
+        m_asyncThread->start();
+    }
+
+    m_asyncPending.insert(key, data);
+    m_asyncPendingBytes = pendingBytes;
+    m_asyncQueued.store(m_asyncPending.size() + m_asyncCommitting.size());
+    m_asyncWork.wakeOne();
+
+    return true;
 }
 
-bool KSharedDataCache::contains(const QString &key) const
+bool KSharedDataCache::Private::findQueued(const QString &key, QByteArray *destination)
 {
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
+    if (m_asyncQueued.load() == 0) {
+        return false;
+    }
+
+    QMutexLocker locker(&m_asyncMutex);
+
+    // Pending entries are newer than the ones being committed.
+    auto it = m_asyncPending.constFind(key);
+    if (it == m_asyncPending.constEnd()) {
+        it = m_asyncCommitting.constFind(key);
+        if (it == m_asyncCommitting.constEnd()) {
             return false;
         }
+    }
 
-        return d->shm->findNamedEntry(key.toUtf8()) >= 0;
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
-        return false;
+    if (destination) {
+        *destination = it.value();
     }
+
+    return true;
 }
 
-void KSharedDataCache::deleteCache(const QString &cacheName)
+// Makes sure no queued insert of @p key overwrites an entry inserted right
+// now.
+void KSharedDataCache::Private::cancelQueuedInsert(const QString &key)
 {
-    QString cachePath = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QLatin1String("/") + cacheName + QLatin1String(".kcache");
+    if (m_asyncQueued.load() == 0) {
+        return;
+    }
 
-    // Note that it is important to simply unlink the file, and not truncate it
-    // smaller first to avoid SIGBUS errors and similar with shared memory
-    // attached to the underlying inode.
-    qCDebug(KCOREADDONS_DEBUG) << "Removing cache at" << cachePath;
-    QFile::remove(cachePath);
+    QMutexLocker locker(&m_asyncMutex);
+
+    const auto it = m_asyncPending.find(key);
+    if (it != m_asyncPending.end()) {
+        m_asyncPendingBytes -= it.value().size();
+        m_asyncPending.erase(it);
+        m_asyncQueued.store(m_asyncPending.size() + m_asyncCommitting.size());
+    }
+
+    while (m_asyncCommitting.contains(key)) {
+        m_asyncDone.wait(&m_asyncMutex);
+    }
 }
 
-unsigned KSharedDataCache::totalSize() const
+// Drops all queued inserts whose key starts with @p prefix, and waits for
+// any such insert already being committed to finish.
+void KSharedDataCache::Private::discardQueuedInserts(const QString &prefix)
 {
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
-            return 0u;
+    QMutexLocker locker(&m_asyncMutex);
+
+    for (auto it = m_asyncPending.begin(); it != m_asyncPending.end();) {
+        if (it.key().startsWith(prefix)) {
+            m_asyncPendingBytes -= it.value().size();
+            it = m_asyncPending.erase(it);
+        } else {
+            ++it;
         }
+    }
 
-        return d->shm->cacheSize;
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
-        return 0u;
+    auto isCommitting = [&]() {
+        for (auto it = m_asyncCommitting.constBegin(); it != m_asyncCommitting.constEnd(); ++it) {
+            if (it.key().startsWith(prefix)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    while (isCommitting()) {
+        m_asyncDone.wait(&m_asyncMutex);
     }
+
+    m_asyncQueued.store(m_asyncPending.size() + m_asyncCommitting.size());
 }
 
-unsigned KSharedDataCache::freeSize() const
+void KSharedDataCache::Private::flushQueuedInserts()
 {
-    try {
-        Private::CacheLocker lock(d);
-        if (lock.failed()) {
-            return 0u;
-        }
+    QMutexLocker locker(&m_asyncMutex);
 
-        return d->shm->cacheAvail * d->shm->cachePageSize();
-    } catch (KSDCCorrupted) {
-        d->recoverCorruptedCache();
-        return 0u;
+    while (!m_asyncPending.isEmpty() || !m_asyncCommitting.isEmpty()) {
+        m_asyncDone.wait(&m_asyncMutex);
     }
 }
 
-KSharedDataCache::EvictionPolicy KSharedDataCache::evictionPolicy() const
+// Commits all queued inserts and stops the worker thread.
+void KSharedDataCache::Private::stopAsyncInserts()
 {
-    if (d && d->shm) {
-        return static_cast<EvictionPolicy>(d->shm->evictionPolicy.fetchAndAddAcquire(0));
+    {
+        QMutexLocker locker(&m_asyncMutex);
+        if (!m_asyncThread) {
+            return;
+        }
+
+        m_asyncStopping = true;
+        m_asyncWork.wakeOne();
     }
 
-    return NoEvictionPreference;
+    m_asyncThread->wait();
+    delete m_asyncThread;
+    m_asyncThread = nullptr;
+}
+
+void KSharedDataCache::Private::runAsyncInserts(uint cacheSize)
+{
+    // The worker attaches to the cache on its own, with a mapping and lock of
+    // its own. Remapping the cache (e.g. after another process resized it)
+    // may then never pull the shared memory out from under a lock-free
+    // lookup of the thread owning this instance.
+    KSharedDataCache worker(m_cacheName, cacheSize, m_expectedItemSize);
+
+    QMutexLocker locker(&m_asyncMutex);
+
+    while (true) {
+        while (m_asyncPending.isEmpty() && !m_asyncStopping) {
+            m_asyncWork.wait(&m_asyncMutex);
+        }
+
+        if (m_asyncPending.isEmpty()) {
+            break;
+        }
+
+        // Everything queued up to now is committed as one batch, so the
+        // cache only has to be locked once for all of it.
+        m_asyncCommitting.swap(m_asyncPending);
+        m_asyncPendingBytes = 0;
+
+        locker.unlock();
+        if (worker.d) {
+            worker.d->insertEntries(m_asyncCommitting);
+        }
+        locker.relock();
+
+        m_asyncCommitting.clear();
+        m_asyncQueued.store(m_asyncPending.size());
+        m_asyncDone.wakeAll();
+    }
+}
+
+// The device returned by KSharedDataCache::insertStreamed(). Each write locks
+// the cache, looks up the entry reserved for the data, which may have been
+// moved since the last write, and copies the data straight into it. Once all
+// of the data is written the entry is made visible.
+class KSharedDataCache::Private::StreamWriter : public QIODevice
+{
+public:
+    StreamWriter(Private *d, const QByteArray &encodedKey, uint keyHash,
+                     uint reservation, uint size)
+        : d(d)
+        , m_encodedKey(encodedKey)
+        , m_keyHash(keyHash)
+        , m_reservation(reservation)
+        , m_size(size)
+        , m_written(0)
+        , m_checksum(adler32(encodedKey.constData(), encodedKey.size() + 1))
+    {
+        open(QIODevice::WriteOnly | QIODevice::Unbuffered);
+    }
+
+    ~StreamWriter() override
+    {
+        close();
+    }
+
+    bool isSequential() const override
+    {
+        return true;
+    }
+
+    void close() override
+    {
+        if (isOpen() && m_written < m_size) {
+            discard();
+        }
+
+        QIODevice::close();
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        Q_UNUSED(data);
+        Q_UNUSED(maxSize);
+        return -1;
+    }
+
+    qint64 writeData(const char *data, qint64 length) override
+    {
+        if (length > m_size - m_written) {
+            setErrorString(QStringLiteral("More data written than reserved"));
+            return -1;
+        }
+
+        try {
+            if (!d->shm) {
+                return -1;
+            }
+
+            CacheLocker lock(d);
+            if (lock.failed()) {
+                return -1;
+            }
+
+            qint32 position = d->shm->findReservation(m_keyHash, m_reservation);
+            if (position < 0) {
+                setErrorString(QStringLiteral("The entry was removed from the cache before it was complete"));
+                return -1;
+            }
+
+            // Pending entries are invisible to readers, so there is no need
+            // for a write sequence until the entry is committed.
+            const IndexTableEntry &entry = d->shm->indexTable()[position];
+            char *item = static_cast<char *>(d->shm->page(entry.firstPage));
+            if (Q_UNLIKELY(!item)) {
+                throw KSDCCorrupted();
+            }
+
+            d->verifyProposedMemoryAccess(item, entry.totalItemSize);
+            ::memcpy(item + m_encodedKey.size() + 1 + m_written, data, length);
+            m_checksum = adler32(data, length, m_checksum);
+            m_written += length;
+
+            if (m_written < m_size) {
+                return length;
+            }
+
+            WriteSequence writing(d->shm);
+
+            const qint32 existing = d->shm->findNamedEntry(m_encodedKey, m_keyHash);
+            if (existing >= 0) {
+                // Removing an entry may move others in the index.
+                d->shm->removeEntry(existing);
+                position = d->shm->findReservation(m_keyHash, m_reservation);
+                if (Q_UNLIKELY(position < 0)) {
+                    throw KSDCCorrupted();
+                }
+            }
+
+            IndexTableEntry &committed = d->shm->indexTable()[position];
+            committed.flags &= ~PendingEntry;
+            committed.checksum = m_checksum;
+            committed.addTime = ::time(nullptr);
+            committed.lastUsedTime = committed.addTime;
+            d->shm->insertCount.fetchAndAddRelaxed(1);
+
+            return length;
+        } catch (KSDCCorrupted) {
+            d->recoverCorruptedCache();
+            setErrorString(QStringLiteral("The cache is corrupt"));
+            return -1;
+        }
+    }
+
+private:
+    void discard()
+    {
+        try {
+            if (!d->shm) {
+                return;
+            }
+
+            CacheLocker lock(d);
+            if (lock.failed()) {
+                return;
+            }
+
+            // Removing the reservation may move committed entries in the
+            // index, which readers without the lock must notice.
+            WriteSequence writing(d->shm);
+
+            const qint32 position = d->shm->findReservation(m_keyHash, m_reservation);
+            if (position >= 0) {
+                d->shm->removeEntry(position);
+            }
+        } catch (KSDCCorrupted) {
+            d->recoverCorruptedCache();
+        }
+    }
+
+    Private *d;
+    const QByteArray m_encodedKey;
+    const uint m_keyHash;
+    const uint m_reservation;
+    const qint64 m_size;
+    qint64 m_written;
+    quint32 m_checksum;
+};
+
+// The device returned by KSharedDataCache::findStreamed(). Reads copy from
+// the entry in shared memory without locking the cache where possible. As
+// long as the generation of the cache is unchanged the entry is known to be
+// where it was, otherwise it is looked up again and reading fails if it is
+// not the same entry anymore.
+class KSharedDataCache::Private::StreamReader : public QIODevice
+{
+public:
+    StreamReader(const Private *d, const QByteArray &encodedKey, uint keyHash,
+                     const IndexTableEntry &entry, const char *data, unsigned generation)
+        : d(d)
+        , m_encodedKey(encodedKey)
+        , m_keyHash(keyHash)
+        , m_entry(entry)
+        , m_data(data)
+        , m_generation(generation)
+    {
+        open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    }
+
+    qint64 size() const override
+    {
+        return m_entry.totalItemSize - m_encodedKey.size() - 1;
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        const qint64 length = qMin(maxSize, size() - pos());
+        if (length <= 0) {
+            return 0;
+        }
+
+        try {
+            if (!d->shm) {
+                return -1;
+            }
+
+            const char *source = nullptr;
+            unsigned generation = 0;
+            auto reader = [&]() {
+                generation = d->currentGeneration();
+                source = generation == m_generation ? m_data : locate();
+                if (source) {
+                    ::memcpy(data, source + pos(), length);
+                }
+                return true;
+            };
+
+            if (!d->readOptimistic(reader)) {
+                CacheLocker lock(d);
+                if (lock.failed()) {
+                    return -1;
+                }
+
+                reader();
+            }
+
+            if (!source) {
+                setErrorString(QStringLiteral("The entry was removed from the cache"));
+                return -1;
+            }
+
+            // Only remember where the entry is once the read is known to
+            // have been consistent.
+            m_data = source;
+            m_generation = generation;
+            return length;
+        } catch (KSDCCorrupted) {
+            const_cast<Private *>(d)->recoverCorruptedCache();
+            setErrorString(QStringLiteral("The cache is corrupt"));
+            return -1;
+        }
+    }
+
+    qint64 writeData(const char *data, qint64 length) override
+    {
+        Q_UNUSED(data);
+        Q_UNUSED(length);
+        return -1;
+    }
+
+private:
+    // Returns the data of the entry read from, or nullptr if it is gone.
+    const char *locate() const
+    {
+        const qint32 position = d->shm->findNamedEntry(m_encodedKey, m_keyHash);
+        if (position < 0) {
+            return nullptr;
+        }
+
+        const IndexTableEntry &entry = d->shm->indexTable()[position];
+        if (entry.totalItemSize != m_entry.totalItemSize || entry.addTime != m_entry.addTime ||
+                entry.checksum != m_entry.checksum) {
+            return nullptr;
+        }
+
+        const char *item = static_cast<const char *>(d->shm->page(entry.firstPage));
+        if (!item || !d->isValidMemoryAccess(item, entry.totalItemSize)) {
+            return nullptr;
+        }
+
+        return item + m_encodedKey.size() + 1;
+    }
+
+    const Private *d;
+    const QByteArray m_encodedKey;
+    const uint m_keyHash;
+    const IndexTableEntry m_entry;
+    const char *m_data;
+    unsigned m_generation;
+};
+
+KSharedDataCache::KSharedDataCache(const QString &cacheName,
+                                   unsigned defaultCacheSize,
+                                   unsigned expectedItemSize)
+    : d(nullptr)
+{
+    try {
+        d = new Private(cacheName, defaultCacheSize, expectedItemSize);
+    } catch (KSDCCorrupted) {
+        KSharedDataCache::deleteCache(cacheName);
+
+        // Try only once more
+        try {
+            d = new Private(cacheName, defaultCacheSize, expectedItemSize);
+        } catch (KSDCCorrupted) {
+            qCritical()
+                    << "Even a brand-new cache starts off corrupted, something is"
+                    << "seriously wrong. :-(";
+            d = nullptr; // Just in case
+        }
+    }
+}
+
+KSharedDataCache::~KSharedDataCache()
+{
+    // Note that there is no other actions required to separate from the
+    // shared memory segment, simply unmapping is enough. This makes things
+    // *much* easier so I'd recommend maintaining this ideal.
+    if (!d) {
+        return;
+    }
+
+    d->stopAsyncInserts();
+
+    if (d->shm) {
+        // Without the lock, as this is the last chance to add them.
+        d->applyLookupCounts();
+
+#ifdef KSDC_MSYNC_SUPPORTED
+        ::msync(d->shm, d->m_mapSize, MS_INVALIDATE | MS_ASYNC);
+#endif
+        ::munmap(d->shm, d->m_mapSize);
+    }
+
+    // Do not delete d->shm, it was never constructed, it's just an alias.
+    d->shm = nullptr;
+
+    for (const auto &mapping : qAsConst(d->m_retiredMappings)) {
+        ::munmap(mapping.first, mapping.second);
+    }
+
+    delete d;
+}
+
+class Q_DECL_HIDDEN KSharedDataCache::Key::Private : public QSharedData
+{
+public:
+    QString key;
+    QByteArray encodedKey;
+    uint hash = 0;
+};
+
+KSharedDataCache::Key::Key()
+    : d(new Private)
+{
+}
+
+KSharedDataCache::Key::Key(const QString &key)
+    : d(new Private)
+{
+    d->key = key;
+    d->encodedKey = key.toUtf8();
+    d->hash = generateHash(d->encodedKey);
+}
+
+KSharedDataCache::Key::Key(const Key &other)
+    : d(other.d)
+{
+}
+
+KSharedDataCache::Key &KSharedDataCache::Key::operator=(const Key &other)
+{
+    d = other.d;
+    return *this;
+}
+
+KSharedDataCache::Key::~Key()
+{
+}
+
+QString KSharedDataCache::Key::toString() const
+{
+    return d->key;
+}
+
+bool KSharedDataCache::insert(const QString &key, const QByteArray &data)
+{
+    return insert(Key(key), data);
+}
+
+bool KSharedDataCache::insert(const Key &key, const QByteArray &data)
+{
+    try {
+        if (!d || !d->shm) {
+            return false;
+        }
+
+        d->cancelQueuedInsert(key.d->key);
+
+        // Compress before locking, so other processes need not wait for it.
+        uint flags = 0;
+        const QByteArray storedData = d->encodeValue(data, &flags);
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return false;
+        }
+
+        Private::WriteSequence writing(d->shm);
+        d->applyPendingUses();
+
+        return d->insertLocked(key.d->encodedKey, key.d->hash, storedData, flags);
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return false;
+    }
+}
+
+bool KSharedDataCache::insertMany(const QHash<QString, QByteArray> &entries)
+{
+    if (!d) {
+        return false;
+    }
+
+    for (auto it = entries.constBegin(); it != entries.constEnd(); ++it) {
+        d->cancelQueuedInsert(it.key());
+    }
+
+    return d->insertEntries(entries);
+}
+
+bool KSharedDataCache::insertAsync(const QString &key, const QByteArray &data)
+{
+    return d && d->enqueueInsert(key, data);
+}
+
+bool KSharedDataCache::insertAsync(const Key &key, const QByteArray &data)
+{
+    // The worker thread prepares the key again, which costs this thread
+    // nothing.
+    return insertAsync(key.d->key, data);
+}
+
+void KSharedDataCache::flush()
+{
+    if (d) {
+        d->flushQueuedInserts();
+    }
+}
+
+bool KSharedDataCache::find(const QString &key, QByteArray *destination) const
+{
+    return find(Key(key), destination);
+}
+
+bool KSharedDataCache::find(const Key &key, QByteArray *destination) const
+{
+    try {
+        if (!d || !d->shm) {
+            return false;
+        }
+
+        if (d->findQueued(key.d->key, destination)) {
+            d->recordLookups(1, 0);
+            return true;
+        }
+
+        const QByteArray &encodedKey = key.d->encodedKey;
+        const Private::ChecksumCheck check = destination ? d->lookupChecksumCheck() : Private::IgnoreChecksum;
+
+        // Most lookups should not need to wait on the lock, try without it
+        // first.
+        const char *cacheData = nullptr;
+        uint dataSize = 0;
+        uint flags = 0;
+        QByteArray result;
+        const bool consistent = d->readOptimistic([&]() {
+            if (!d->peekEntry(encodedKey, key.d->hash, &cacheData, &dataSize, &flags, check)) {
+                return false;
+            }
+            if (cacheData && destination) {
+                result = QByteArray(cacheData, dataSize);
+            }
+            return true;
+        });
+
+        if (consistent) {
+            if (!cacheData) {
+                d->recordLookups(0, 1);
+                return false;
+            }
+
+            d->recordLookups(1, 0);
+
+            if (destination) {
+                *destination = Private::decodeValue(result, flags);
+            }
+
+            if (d->recordPendingUse(encodedKey)) {
+                Private::CacheLocker lock(d);
+                if (!lock.failed()) {
+                    d->applyPendingUses();
+                }
+            }
+
+            return true;
+        }
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return false;
+        }
+
+        // Search in the index for our data, hashed by key;
+        cacheData = d->findLocked(encodedKey, key.d->hash, &dataSize, &flags, check);
+        d->recordLookups(cacheData ? 1 : 0, cacheData ? 0 : 1);
+
+        if (cacheData) {
+            if (destination) {
+                *destination = Private::copyValue(cacheData, dataSize, flags);
+            }
+
+            return true;
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+
+    return false;
+}
+
+QHash<QString, QByteArray> KSharedDataCache::findMany(const QStringList &keys) const
+{
+    QList<Key> preparedKeys;
+    preparedKeys.reserve(keys.size());
+    for (const QString &key : keys) {
+        preparedKeys.append(Key(key));
+    }
+
+    return findMany(preparedKeys);
+}
+
+QHash<QString, QByteArray> KSharedDataCache::findMany(const QList<Key> &keys) const
+{
+    QHash<QString, QByteArray> results;
+
+    try {
+        if (!d || !d->shm) {
+            return results;
+        }
+
+        // Entries still waiting to be inserted are newer than anything in
+        // the cache.
+        QList<Key> remainingKeys;
+        QHash<QString, QByteArray> queuedResults;
+        for (const Key &key : keys) {
+            QByteArray data;
+            if (d->findQueued(key.d->key, &data)) {
+                queuedResults.insert(key.d->key, data);
+            } else {
+                remainingKeys.append(key);
+            }
+        }
+
+        if (!queuedResults.isEmpty()) {
+            d->recordLookups(queuedResults.size(), 0);
+            queuedResults.unite(findMany(remainingKeys));
+            return queuedResults;
+        }
+
+        const Private::ChecksumCheck check = d->lookupChecksumCheck();
+        QVector<int> compressedKeys;
+        const bool consistent = d->readOptimistic([&]() {
+            results.clear();
+            compressedKeys.clear();
+            for (int i = 0; i < keys.size(); ++i) {
+                const Key::Private &key = *keys.at(i).d;
+                const char *cacheData = nullptr;
+                uint dataSize = 0;
+                uint flags = 0;
+                if (!d->peekEntry(key.encodedKey, key.hash, &cacheData, &dataSize, &flags, check)) {
+                    return false;
+                }
+                if (cacheData && !results.contains(key.key)) {
+                    results.insert(key.key, QByteArray(cacheData, dataSize));
+                    if (flags & CompressedEntry) {
+                        compressedKeys.append(i);
+                    }
+                }
+            }
+            return true;
+        });
+
+        if (consistent) {
+            d->recordLookups(results.size(), keys.size() - results.size());
+
+            for (int i : qAsConst(compressedKeys)) {
+                QByteArray &value = results[keys.at(i).d->key];
+                value = Private::decodeValue(value, CompressedEntry);
+            }
+
+            bool applyUses = false;
+            for (const Key &key : keys) {
+                if (results.contains(key.d->key) && d->recordPendingUse(key.d->encodedKey)) {
+                    applyUses = true;
+                }
+            }
+
+            if (applyUses) {
+                Private::CacheLocker lock(d);
+                if (!lock.failed()) {
+                    d->applyPendingUses();
+                }
+            }
+
+            return results;
+        }
+
+        results.clear();
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return results;
+        }
+
+        for (const Key &key : keys) {
+            uint dataSize = 0;
+            uint flags = 0;
+            const char *cacheData = d->findLocked(key.d->encodedKey, key.d->hash, &dataSize, &flags, check);
+            if (cacheData) {
+                results.insert(key.d->key, Private::copyValue(cacheData, dataSize, flags));
+            }
+        }
+
+        d->recordLookups(results.size(), keys.size() - results.size());
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        results.clear();
+    }
+
+    return results;
+}
+
+bool KSharedDataCache::findView(const QString &key, QByteArray *destination, unsigned *generation) const
+{
+    return findView(Key(key), destination, generation);
+}
+
+bool KSharedDataCache::findView(const Key &key, QByteArray *destination, unsigned *generation) const
+{
+    try {
+        if (!d || !d->shm) {
+            return false;
+        }
+
+        if (d->findQueued(key.d->key, destination)) {
+            if (generation) {
+                *generation = d->currentGeneration();
+            }
+            d->recordLookups(1, 0);
+            return true;
+        }
+
+        const QByteArray &encodedKey = key.d->encodedKey;
+        const uint keyHash = key.d->hash;
+
+        const char *cacheData = nullptr;
+        uint dataSize = 0;
+        uint flags = 0;
+        unsigned viewGeneration = 0;
+        QByteArray compressed;
+        const bool consistent = d->readOptimistic([&]() {
+            viewGeneration = d->currentGeneration();
+            if (!d->peekEntry(encodedKey, keyHash, &cacheData, &dataSize, &flags)) {
+                return false;
+            }
+
+            // Compressed data can not be viewed in place, so copy it while
+            // it is known to be intact.
+            if (cacheData && destination && (flags & CompressedEntry)) {
+                compressed = QByteArray(cacheData, dataSize);
+            }
+            return true;
+        });
+
+        if (consistent) {
+            if (!cacheData) {
+                d->recordLookups(0, 1);
+                return false;
+            }
+
+            d->recordLookups(1, 0);
+
+            if (destination) {
+                if (flags & CompressedEntry) {
+                    *destination = Private::decodeValue(compressed, flags);
+                } else {
+                    d->m_viewsHandedOut = true;
+                    *destination = QByteArray::fromRawData(cacheData, dataSize);
+                }
+            }
+            if (generation) {
+                *generation = viewGeneration;
+            }
+
+            if (d->recordPendingUse(encodedKey)) {
+                Private::CacheLocker lock(d);
+                if (!lock.failed()) {
+                    d->applyPendingUses();
+                }
+            }
+
+            return true;
+        }
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return false;
+        }
+
+        cacheData = d->findLocked(encodedKey, keyHash, &dataSize, &flags);
+        d->recordLookups(cacheData ? 1 : 0, cacheData ? 0 : 1);
+
+        if (cacheData) {
+            if (destination) {
+                if (flags & CompressedEntry) {
+                    *destination = Private::copyValue(cacheData, dataSize, flags);
+                } else {
+                    d->m_viewsHandedOut = true;
+                    *destination = QByteArray::fromRawData(cacheData, dataSize);
+                }
+            }
+            if (generation) {
+                *generation = d->currentGeneration();
+            }
+
+            return true;
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+
+    return false;
+}
+
+// Returns a device reading @p data, for lookups which can not be streamed.
+static QIODevice *createBuffer(const QByteArray &data)
+{
+    QBuffer *buffer = new QBuffer;
+    buffer->setData(data);
+    buffer->open(QIODevice::ReadOnly);
+    return buffer;
+}
+
+QIODevice *KSharedDataCache::insertStreamed(const QString &key, unsigned size)
+{
+    try {
+        if (!d || !d->shm || size >= d->shm->cacheSize) {
+            return nullptr;
+        }
+
+        d->cancelQueuedInsert(key);
+
+        const QByteArray encodedKey = key.toUtf8();
+        const uint keyHash = generateHash(encodedKey);
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return nullptr;
+        }
+
+        Private::WriteSequence writing(d->shm);
+        d->applyPendingUses();
+
+        // There is nothing to stream, so the entry is complete right away.
+        if (size == 0) {
+            if (!d->insertLocked(encodedKey, keyHash, QByteArray())) {
+                return nullptr;
+            }
+
+            return new Private::StreamWriter(d, encodedKey, keyHash, 0, 0);
+        }
+
+        d->shm->expireEntries(EXPIRY_SWEEP_SIZE);
+
+        const uint reservation = ++d->shm->reservationCounter;
+        if (!d->allocateLocked(encodedKey, keyHash, size, PendingEntry, reservation)) {
+            return nullptr;
+        }
+
+        return new Private::StreamWriter(d, encodedKey, keyHash, reservation, size);
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return nullptr;
+    }
+}
+
+QIODevice *KSharedDataCache::findStreamed(const QString &key) const
+{
+    try {
+        if (!d || !d->shm) {
+            return nullptr;
+        }
+
+        QByteArray queued;
+        if (d->findQueued(key, &queued)) {
+            d->recordLookups(1, 0);
+            return createBuffer(queued);
+        }
+
+        const QByteArray encodedKey = key.toUtf8();
+        const uint keyHash = generateHash(encodedKey);
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return nullptr;
+        }
+
+        uint dataSize = 0;
+        uint flags = 0;
+        const char *cacheData = d->findLocked(encodedKey, keyHash, &dataSize, &flags);
+        d->recordLookups(cacheData ? 1 : 0, cacheData ? 0 : 1);
+
+        if (!cacheData) {
+            return nullptr;
+        }
+
+        // Compressed data can only be uncompressed as a whole.
+        if (flags & CompressedEntry) {
+            return createBuffer(Private::copyValue(cacheData, dataSize, flags));
+        }
+
+        const qint32 position = d->shm->findNamedEntry(encodedKey, keyHash);
+        if (Q_UNLIKELY(position < 0)) {
+            throw KSDCCorrupted();
+        }
+
+        return new Private::StreamReader(d, encodedKey, keyHash, d->shm->indexTable()[position],
+                                    cacheData, d->currentGeneration());
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return nullptr;
+    }
+}
+
+unsigned KSharedDataCache::generation() const
+{
+    if (d && d->shm) {
+        return d->currentGeneration();
+    }
+
+    // Without shared memory there is nothing that could be viewed, so make
+    // sure no view compares as current.
+    return d ? d->m_generationBase : 0;
+}
+
+void KSharedDataCache::clear()
+{
+    try {
+        if (d) {
+            d->discardQueuedInserts();
+        }
+
+        Private::CacheLocker lock(d);
+
+        if (!lock.failed()) {
+            Private::WriteSequence writing(d->shm);
+            d->shm->clear();
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+    }
+}
+
+bool KSharedDataCache::saveSnapshot(const QString &fileName, unsigned maxSize) const
+{
+    // The entries are collected in memory first, so the cache does not stay
+    // locked while writing to disk.
+    QByteArray entries;
+    quint32 entryCount = 0;
+
+    try {
+        if (!d || !d->shm) {
+            return false;
+        }
+
+        d->flushQueuedInserts();
+
+        QDataStream stream(&entries, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_6);
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return false;
+        }
+
+        d->applyPendingUses();
+
+        // Save the entries most worth keeping first, so that the size limit
+        // (and the size of the cache when loading) cuts off the least useful
+        // ones.
+        const IndexTableEntry *indices = d->shm->indexTable();
+        quint64 savedSize = 0;
+        for (uint i : d->entriesByValue()) {
+            if (!d->shm->isIntact(indices[i])) {
+                continue;
+            }
+
+            savedSize += indices[i].totalItemSize;
+            if (maxSize > 0 && savedSize > maxSize) {
+                break;
+            }
+
+            QByteArray key;
+            QByteArray data;
+            d->readEntry(indices[i], &key, &data);
+
+            const quint32 flags = indices[i].flags & CompressedEntry;
+            stream << key << flags << data << adler32(data, adler32(key));
+            entryCount++;
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return false;
+    }
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(KCOREADDONS_DEBUG) << "Unable to write cache snapshot" << fileName << ":" << file.errorString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream << SNAPSHOT_MAGIC << SNAPSHOT_VERSION << entryCount << entries;
+
+    return stream.status() == QDataStream::Ok && file.commit();
+}
+
+bool KSharedDataCache::loadSnapshot(const QString &fileName)
+{
+    if (!d || !d->shm) {
+        return false;
+    }
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    quint32 entryCount = 0;
+    QByteArray entries;
+    stream >> magic >> version >> entryCount >> entries;
+
+    if (stream.status() != QDataStream::Ok || magic != SNAPSHOT_MAGIC ||
+            version != SNAPSHOT_VERSION) {
+        qCWarning(KCOREADDONS_DEBUG) << "Ignoring invalid cache snapshot" << fileName;
+        return false;
+    }
+
+    QDataStream entryStream(entries);
+    entryStream.setVersion(QDataStream::Qt_5_6);
+
+    QHash<QString, QByteArray> values;
+    const quint64 capacity = totalSize();
+    quint64 loadedSize = 0;
+    for (quint32 i = 0; i < entryCount; ++i) {
+        QByteArray key;
+        quint32 flags = 0;
+        QByteArray data;
+        quint32 entryChecksum = 0;
+        entryStream >> key >> flags >> data >> entryChecksum;
+
+        // Damage to the framing leaves the rest of the entries unreadable,
+        // but the ones read so far are still fine.
+        if (entryStream.status() != QDataStream::Ok) {
+            break;
+        }
+
+        // Skip damaged entries, the others are still fine.
+        if (key.isEmpty() || (flags & ~quint32(CompressedEntry)) ||
+                adler32(data, adler32(key)) != entryChecksum) {
+            continue;
+        }
+
+        // The most useful entries come first, so stop once the cache is full.
+        loadedSize += key.size() + 1 + data.size();
+        if (loadedSize > capacity) {
+            break;
+        }
+
+        // Whatever is in the cache already is newer than the snapshot.
+        const QString name = QString::fromUtf8(key);
+        if (contains(name)) {
+            continue;
+        }
+
+        try {
+            values.insert(name, Private::decodeValue(data, flags));
+        } catch (KSDCCorrupted) {
+            continue;
+        }
+    }
+
+    return d->insertEntries(values);
+}
+
+int KSharedDataCache::removeByPrefix(const QString &prefix)
+{
+    try {
+        if (!d || !d->shm) {
+            return 0;
+        }
+
+        d->discardQueuedInserts(prefix);
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return 0;
+        }
+
+        Private::WriteSequence writing(d->shm);
+        d->applyPendingUses();
+
+        return static_cast<int>(d->shm->removeEntriesWithPrefix(prefix.toUtf8()));
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return 0;
+    }
+}
+
+int KSharedDataCache::checkIntegrity(unsigned maxEntries)
+{
+    try {
+        if (!d || !d->shm) {
+            return 0;
+        }
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return 0;
+        }
+
+        Private::WriteSequence writing(d->shm);
+        d->applyPendingUses();
+
+        return static_cast<int>(d->shm->checkEntries(maxEntries));
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return -1;
+    }
+}
+
+bool KSharedDataCache::resize(unsigned newCacheSize)
+{
+    try {
+        if (!d || !d->shm) {
+            return false;
+        }
+
+        d->flushQueuedInserts();
+
+        {
+            Private::CacheLocker lock(d);
+            if (lock.failed()) {
+                return false;
+            }
+
+            d->applyPendingUses();
+            if (!d->copyToResizedCache(newCacheSize)) {
+                return false;
+            }
+        }
+
+        d->m_defaultCacheSize = newCacheSize;
+        d->detachFromSharedMemory();
+        d->mapSharedMemory();
+
+        return d->shm != nullptr;
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return false;
+    }
+}
+
+bool KSharedDataCache::contains(const QString &key) const
+{
+    return contains(Key(key));
+}
+
+bool KSharedDataCache::contains(const Key &key) const
+{
+    try {
+        if (!d || !d->shm) {
+            return false;
+        }
+
+        if (d->findQueued(key.d->key, nullptr)) {
+            return true;
+        }
+
+        qint32 entry = -1;
+        if (d->readOptimistic([&]() {
+            entry = d->shm->findLiveEntry(key.d->encodedKey, key.d->hash);
+            return true;
+        })) {
+            return entry >= 0;
+        }
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return false;
+        }
+
+        return d->shm->findLiveEntry(key.d->encodedKey, key.d->hash) >= 0;
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return false;
+    }
+}
+
+void KSharedDataCache::deleteCache(const QString &cacheName)
+{
+    QString cachePath = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QLatin1String("/") + cacheName + QLatin1String(".kcache");
+
+    // Note that it is important to simply unlink the file, and not truncate it
+    // smaller first to avoid SIGBUS errors and similar with shared memory
+    // attached to the underlying inode.
+    qCDebug(KCOREADDONS_DEBUG) << "Removing cache at" << cachePath;
+    QFile::remove(cachePath);
+}
+
+unsigned KSharedDataCache::totalSize() const
+{
+    try {
+        if (!d || !d->shm) {
+            return 0u;
+        }
+
+        unsigned size = 0;
+        if (d->readOptimistic([&]() {
+            size = d->shm->cacheSize;
+            return true;
+        })) {
+            return size;
+        }
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return 0u;
+        }
+
+        return d->shm->cacheSize;
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return 0u;
+    }
+}
+
+unsigned KSharedDataCache::freeSize() const
+{
+    try {
+        if (!d || !d->shm) {
+            return 0u;
+        }
+
+        unsigned size = 0;
+        if (d->readOptimistic([&]() {
+            size = d->shm->cacheAvail * d->shm->cachePageSize();
+            return true;
+        })) {
+            return size;
+        }
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return 0u;
+        }
+
+        return d->shm->cacheAvail * d->shm->cachePageSize();
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return 0u;
+    }
+}
+
+KSharedDataCache::EvictionPolicy KSharedDataCache::evictionPolicy() const
+{
+    if (d && d->shm) {
+        return static_cast<EvictionPolicy>(d->shm->evictionPolicy.fetchAndAddAcquire(0));
+    }
+
+    return NoEvictionPreference;
 }
 
 void KSharedDataCache::setEvictionPolicy(EvictionPolicy newPolicy)
@@ -1700,6 +4306,152 @@ void KSharedDataCache::setEvictionPolicy(EvictionPolicy newPolicy)
     }
 }
 
+unsigned KSharedDataCache::defragmentationBudget() const
+{
+    if (d && d->shm) {
+        return static_cast<unsigned>(d->shm->defragmentationBudget.fetchAndAddAcquire(0));
+    }
+
+    return 0;
+}
+
+void KSharedDataCache::setDefragmentationBudget(unsigned budget)
+{
+    if (d && d->shm) {
+        d->shm->defragmentationBudget.fetchAndStoreRelease(static_cast<int>(budget));
+    }
+}
+
+unsigned KSharedDataCache::compressionThreshold() const
+{
+    if (d && d->shm) {
+        return static_cast<unsigned>(d->shm->compressionThreshold.fetchAndAddAcquire(0));
+    }
+
+    return 0;
+}
+
+void KSharedDataCache::setCompressionThreshold(unsigned threshold)
+{
+    if (d && d->shm) {
+        d->shm->compressionThreshold.fetchAndStoreRelease(static_cast<int>(threshold));
+    }
+}
+
+unsigned KSharedDataCache::entryTimeToLive() const
+{
+    if (d && d->shm) {
+        return static_cast<unsigned>(d->shm->entryTimeToLive.fetchAndAddAcquire(0));
+    }
+
+    return 0;
+}
+
+void KSharedDataCache::setEntryTimeToLive(unsigned seconds)
+{
+    if (d && d->shm) {
+        d->shm->entryTimeToLive.fetchAndStoreRelease(static_cast<int>(seconds));
+    }
+}
+
+KSharedDataCache::MemoryHints KSharedDataCache::memoryHints() const
+{
+    return d ? d->m_memoryHints : NoMemoryHints;
+}
+
+void KSharedDataCache::setMemoryHints(MemoryHints hints)
+{
+    if (d) {
+        d->m_memoryHints = hints;
+        d->applyMemoryHints();
+    }
+}
+
+bool KSharedDataCache::verifyChecksumsOnFind() const
+{
+    return d && d->m_verifyChecksumsOnFind;
+}
+
+void KSharedDataCache::setVerifyChecksumsOnFind(bool verify)
+{
+    if (d) {
+        d->m_verifyChecksumsOnFind = verify;
+    }
+}
+
+KSharedDataCache::IndexStatistics KSharedDataCache::indexStatistics() const
+{
+    IndexStatistics result;
+
+    try {
+        if (!d || !d->shm) {
+            return result;
+        }
+
+        Private::CacheLocker lock(d);
+        if (lock.failed()) {
+            return result;
+        }
+
+        const IndexTableEntry *indices = d->shm->indexTable();
+        quint64 totalProbe = 0;
+        for (uint i = 0; i < d->shm->indexTableSize(); ++i) {
+            if (indices[i].firstPage >= 0) {
+                const uint distance = d->shm->probeDistance(i);
+                result.longestProbe = qMax(result.longestProbe, distance);
+                totalProbe += distance;
+                result.entryCount++;
+            }
+        }
+
+        result.capacity = d->shm->maximumIndexUsage();
+        result.collisions = d->shm->indexCollisions;
+        if (result.entryCount > 0) {
+            result.averageProbe = double(totalProbe) / result.entryCount;
+        }
+    } catch (KSDCCorrupted) {
+        d->recoverCorruptedCache();
+        return IndexStatistics();
+    }
+
+    return result;
+}
+
+KSharedDataCache::Statistics KSharedDataCache::statistics() const
+{
+    Statistics result;
+
+    // The counters are atomic, so there is no need to lock the cache. Lookups
+    // of this process not yet added to the shared counters are included as
+    // well, those of other processes only once they held the lock.
+    if (d && d->shm) {
+        result.hits = d->shm->hitCount.load() + d->m_pendingHits.load();
+        result.misses = d->shm->missCount.load() + d->m_pendingMisses.load();
+        result.inserts = d->shm->insertCount.load();
+        result.evictions = d->shm->evictionCount.load();
+        result.expirations = d->shm->expirationCount.load();
+        result.corruptions = d->shm->corruptionCount.load();
+        result.defragmentations = d->shm->defragmentationCount.load();
+        result.lockCount = d->shm->lockCount.load();
+        result.lockTimeouts = d->shm->lockTimeoutCount.load();
+        result.ownerDeaths = d->shm->ownerDeathCount.load();
+        result.lockHoldTime = d->shm->lockHoldTime.load();
+        result.compressionInput = d->shm->compressionInput.load();
+        result.compressionOutput = d->shm->compressionOutput.load();
+    }
+
+    return result;
+}
+
+void KSharedDataCache::resetStatistics()
+{
+    if (d && d->shm) {
+        d->m_pendingHits.store(0);
+        d->m_pendingMisses.store(0);
+        d->shm->resetStatistics();
+    }
+}
+
 unsigned KSharedDataCache::timestamp() const
 {
     if (d && d->shm) {
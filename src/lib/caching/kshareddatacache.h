@@ -22,8 +22,15 @@
 
 #include <kcoreaddons_export.h>
 
-class QString;
+#include <QFlags>
+#include <QSharedDataPointer>
+
 class QByteArray;
+template <class Key, class T> class QHash;
+class QIODevice;
+template <typename T> class QList;
+class QString;
+class QStringList;
 
 /**
  * @class KSharedDataCache kshareddatacache.h KSharedDataCache
@@ -91,7 +98,15 @@ public:
         NoEvictionPreference = 0,
         EvictLeastRecentlyUsed,
         EvictLeastOftenUsed,
-        EvictOldest
+        EvictOldest,
+        /**
+         * Evicts entries looked up at most once before entries looked up
+         * repeatedly, so that a large amount of data used only once (such as
+         * when browsing through a folder of images) does not push frequently
+         * used data out of the cache.
+         * @since 5.64
+         */
+        EvictScanResistant
     };
 
     /**
@@ -108,6 +123,153 @@ public:
      */
     void setEvictionPolicy(EvictionPolicy newPolicy);
 
+    /**
+     * @return The maximum amount of data, in bytes, moved around each time
+     *         the shared cache is defragmented, or 0 if there is no limit.
+     * @see setDefragmentationBudget()
+     * @since 5.64
+     */
+    unsigned defragmentationBudget() const;
+
+    /**
+     * Limits the amount of data moved around each time the shared cache is
+     * defragmented to @p budget bytes (rounded up to whole entries). The
+     * default is 0, which defragments the entire cache at once.
+     *
+     * Defragmenting a large cache in one go can keep every process using the
+     * cache waiting for a long time. With a budget set, each insert() that
+     * needs to defragment only does a bounded amount of work and continues
+     * where the previous one stopped, evicting entries instead if that does
+     * not free up enough room. This trades a somewhat higher eviction rate for
+     * consistent latency.
+     *
+     * Like the eviction policy, the budget is shared by all processes using
+     * the cache.
+     *
+     * @see defragmentationBudget()
+     * @since 5.64
+     */
+    void setDefragmentationBudget(unsigned budget);
+
+    /**
+     * @return The minimum size, in bytes, of data which is compressed when
+     *         inserted into the cache, or 0 if data is never compressed.
+     * @see setCompressionThreshold()
+     * @since 5.64
+     */
+    unsigned compressionThreshold() const;
+
+    /**
+     * Enables compressing data of at least @p threshold bytes when it is
+     * inserted into the cache, which allows to store more data in the same
+     * amount of memory. The default is 0, which disables compression.
+     *
+     * Compression favors speed over size, and data that does not become
+     * smaller is stored as is. Data is uncompressed transparently when it is
+     * found, with the exception that findView() returns a copy instead of a
+     * view for compressed data. Small data rarely compresses well, so
+     * thresholds below a few hundred bytes are not useful.
+     *
+     * Like the eviction policy, the threshold is shared by all processes
+     * using the cache.
+     *
+     * @see compressionThreshold(), statistics()
+     * @since 5.64
+     */
+    void setCompressionThreshold(unsigned threshold);
+
+    /**
+     * @return The number of seconds after which entries expire, or 0 if
+     *         entries never expire.
+     * @see setEntryTimeToLive()
+     * @since 5.64
+     */
+    unsigned entryTimeToLive() const;
+
+    /**
+     * Makes entries expire @p seconds after they were inserted, after which
+     * they are no longer found and are removed from the cache. This is a more
+     * gentle alternative to clearing the whole cache whenever its data may be
+     * outdated. The default is 0, which means entries never expire.
+     *
+     * Expired entries are removed when they are looked up, and a few at a
+     * time when other entries are inserted, so there is no need to sweep the
+     * cache periodically.
+     *
+     * Like the eviction policy, the time to live is shared by all processes
+     * using the cache, and applies to entries already in the cache as well.
+     *
+     * @see entryTimeToLive(), statistics()
+     * @since 5.64
+     */
+    void setEntryTimeToLive(unsigned seconds);
+
+    /**
+     * Hints about how the memory holding the cache will be used, which allow
+     * the system to manage that memory more efficiently.
+     * @see setMemoryHints()
+     * @since 5.64
+     */
+    enum MemoryHint {
+        NoMemoryHints = 0,
+        /**
+         * Map all of the cache into memory up front, instead of one page at
+         * a time when first accessed. Use this for caches that are accessed
+         * all over right after being opened.
+         */
+        PrefaultMemory = 0x1,
+        /**
+         * Use huge pages for the data held in the cache where supported,
+         * which makes random accesses to large caches cheaper. Typically
+         * this only has an effect if the cache is stored on a tmpfs or
+         * cannot be shared.
+         */
+        TransparentHugePages = 0x2
+    };
+    Q_DECLARE_FLAGS(MemoryHints, MemoryHint)
+
+    /**
+     * @return The memory hints set for this object.
+     * @see setMemoryHints()
+     * @since 5.64
+     */
+    MemoryHints memoryHints() const;
+
+    /**
+     * Passes @p hints about how the memory holding the cache will be used on
+     * to the system. The hints are only advisory and are ignored where not
+     * supported. The default is NoMemoryHints.
+     *
+     * Unlike most settings, memory hints only apply to this object, and are
+     * kept if the cache has to be mapped into memory again.
+     *
+     * @see memoryHints()
+     * @since 5.64
+     */
+    void setMemoryHints(MemoryHints hints);
+
+    /**
+     * @return true if find() and findMany() verify the checksum of the
+     *         entries they return.
+     * @see setVerifyChecksumsOnFind()
+     * @since 5.64
+     */
+    bool verifyChecksumsOnFind() const;
+
+    /**
+     * Sets whether find() and findMany() verify the checksum of every entry
+     * they return, treating damaged entries as missing and removing them.
+     * This reads all of the data of the entry once more, so it is off by
+     * default and checkIntegrity() is the cheaper way to find damaged
+     * entries. Lookups that do not copy the data are never verified.
+     *
+     * Like memory hints, this only applies to this object.
+     *
+     * @see checkIntegrity()
+     * @since 5.64
+     */
+    void setVerifyChecksumsOnFind(bool verify);
+
     /**
      * Attempts to insert the entry @p data into the shared cache, named by
      * @p key, and returns true only if successful.
@@ -117,6 +279,115 @@ public:
      */
     bool insert(const QString &key, const QByteArray &data);
 
+    /**
+     * A key prepared for looking up entries in the cache. Each lookup by a
+     * QString key converts it to UTF-8 and hashes it first; a Key does that
+     * once when it is created, so reusing a Key for many lookups avoids
+     * repeating this work.
+     *
+     * Keys are implicitly shared, so copying them is cheap.
+     *
+     * @see insert(), insertAsync(), find(), findMany(), findView(), contains()
+     * @since 5.64
+     */
+    class KCOREADDONS_EXPORT Key
+    {
+    public:
+        /**
+         * Creates an empty key.
+         */
+        Key();
+
+        /**
+         * Creates a key for entries named by @p key.
+         */
+        explicit Key(const QString &key);
+
+        /**
+         * Copy constructor.
+         */
+        Key(const Key &other);
+
+        /**
+         * Assignment operator.
+         */
+        Key &operator=(const Key &other);
+
+        ~Key();
+
+        /**
+         * @return The name of the entries this key is used for.
+         */
+        QString toString() const;
+
+    private:
+        friend class KSharedDataCache;
+
+        class Private;
+        QSharedDataPointer<Private> d;
+    };
+
+    /**
+     * Same as insert(const QString &, const QByteArray &), but using a
+     * prepared @p key.
+     * @since 5.64
+     */
+    bool insert(const Key &key, const QByteArray &data);
+
+    /**
+     * Inserts every entry of @p entries into the shared cache, as if by
+     * calling insert() for each of them, and returns true only if all of them
+     * were inserted.
+     *
+     * This is considerably cheaper than separate calls to insert() when
+     * adding many entries, since the cache is only locked once and room for
+     * the whole batch is made at once.
+     *
+     * @param entries The data to insert, named by their keys.
+     * @see findMany()
+     * @since 5.64
+     */
+    bool insertMany(const QHash<QString, QByteArray> &entries);
+
+    /**
+     * Queues the entry @p data, named by @p key, to be inserted into the
+     * shared cache by a worker thread, and returns immediately. Unlike
+     * insert(), this never waits for other processes using the cache or for
+     * room to be made in the cache.
+     *
+     * Queued entries are inserted in batches, as if by insertMany(). Until
+     * then they are already returned by find() and the other lookup
+     * functions of this object, but are not visible to other processes.
+     * A later call to insert() or clear() takes precedence over any queued
+     * entries it affects.
+     *
+     * To limit memory usage, at most a quarter of the size of the cache can
+     * be queued at a time. If the entry does not fit into the queue false is
+     * returned, in which case it is up to the caller to retry later, call
+     * flush() or fall back to insert().
+     *
+     * @return true if the entry was queued, false otherwise.
+     * @see flush()
+     * @since 5.64
+     */
+    bool insertAsync(const QString &key, const QByteArray &data);
+
+    /**
+     * Same as insertAsync(const QString &, const QByteArray &), but using a
+     * prepared @p key.
+     * @since 5.64
+     */
+    bool insertAsync(const Key &key, const QByteArray &data);
+
+    /**
+     * Waits until all entries queued by insertAsync() have been inserted into
+     * the shared cache. This also happens when this object is destroyed.
+     *
+     * @see insertAsync()
+     * @since 5.64
+     */
+    void flush();
+
     /**
      * Returns the data in the cache named by @p key (even if it's some other
      * process's data named with the same key!), stored in @p destination. If there is
@@ -126,6 +397,10 @@ public:
      * If you simply want to verify whether an entry is present in the cache then
      * see contains().
      *
+     * Lookups normally proceed without waiting on the lock shared by all
+     * processes using the cache, and only fall back to locking the cache if
+     * another process is modifying it at the same time.
+     *
      * @param key The key to find in the cache.
      * @param destination Is set to the value of @p key in the cache if @p key is
      *                    present, left unchanged otherwise.
@@ -135,11 +410,217 @@ public:
      */
     bool find(const QString &key, QByteArray *destination) const;
 
+    /**
+     * Same as find(const QString &, QByteArray *), but using a prepared
+     * @p key.
+     * @since 5.64
+     */
+    bool find(const Key &key, QByteArray *destination) const;
+
+    /**
+     * Looks up all of @p keys in the cache at once, which is cheaper than
+     * calling find() for each of them.
+     *
+     * @param keys The keys to find in the cache.
+     * @return The data of every key that was present in the cache, named by
+     *         its key. Keys that were not present are not included.
+     * @see insertMany()
+     * @since 5.64
+     */
+    QHash<QString, QByteArray> findMany(const QStringList &keys) const;
+
+    /**
+     * Same as findMany(const QStringList &), but using prepared @p keys.
+     * @since 5.64
+     */
+    QHash<QString, QByteArray> findMany(const QList<Key> &keys) const;
+
+    /**
+     * Like find(), but instead of copying the data out of the cache,
+     * @p destination is set to a read-only view referring directly to the
+     * shared memory holding the entry (see QByteArray::fromRawData()). This
+     * avoids any allocation or copy for large entries.
+     *
+     * The view is only valid for as long as the cache generation does not
+     * change, since any process may remove or move the entry afterwards.
+     * Compare the value stored in @p generation against generation() after
+     * using the data and discard the result (falling back to find()) if they
+     * differ. The memory referred to by the view remains mapped for the
+     * lifetime of this KSharedDataCache object, so reading from a stale view
+     * returns wrong data but is never a crash.
+     *
+     * Do not modify the data or use the view after this object is destroyed.
+     *
+     * If the entry is stored compressed (see setCompressionThreshold()),
+     * @p destination is set to an uncompressed copy of the data instead,
+     * which remains valid regardless of the generation.
+     *
+     * @param key The key to find in the cache.
+     * @param destination Is set to a view of the value of @p key in the
+     *                    cache if @p key is present, left unchanged otherwise.
+     * @param generation If not null, set to the generation of the cache in
+     *                   which the view was created.
+     * @return true if @p key was present in the cache, false otherwise.
+     * @see generation()
+     * @since 5.64
+     */
+    bool findView(const QString &key, QByteArray *destination, unsigned *generation = nullptr) const;
+
+    /**
+     * Same as findView(const QString &, QByteArray *, unsigned *), but using
+     * a prepared @p key.
+     * @since 5.64
+     */
+    bool findView(const Key &key, QByteArray *destination, unsigned *generation = nullptr) const;
+
+    /**
+     * @return The current generation of the cache, as seen by this object.
+     *         The generation changes whenever data previously returned by
+     *         findView() may have been removed, moved or overwritten.
+     *         Values are only comparable with other values returned by the
+     *         same KSharedDataCache object.
+     * @see findView()
+     * @since 5.64
+     */
+    unsigned generation() const;
+
+    /**
+     * Starts inserting an entry of @p size bytes named by @p key, whose data
+     * is then written to the returned device in as many pieces as convenient.
+     * The data is copied straight into the cache, so that large entries need
+     * not be held in memory as a whole.
+     *
+     * The entry is added once all of the data has been written, replacing
+     * any existing entry with the same key; until then, it can not be found.
+     * If the entry can not be completed, e.g. because it was evicted to make
+     * room for other entries in the meantime, writing to the device fails.
+     * If the device is closed or deleted before all of the data has been
+     * written, nothing is inserted.
+     *
+     * Data inserted this way is never compressed. The device must be deleted
+     * before this object.
+     *
+     * @param key The key to insert the data under.
+     * @param size The size of the data, in bytes.
+     * @return A write-only device which the caller takes ownership of, or
+     *         nullptr if there is no room for the entry.
+     * @see findStreamed()
+     * @since 5.64
+     */
+    QIODevice *insertStreamed(const QString &key, unsigned size);
+
+    /**
+     * Returns a device reading the data named by @p key straight from the
+     * cache, so that large entries need not be held in memory as a whole.
+     *
+     * Reading from the device fails once the entry is removed from the cache
+     * or replaced, so data read before then is always from the same entry.
+     * The checksum of the data is never verified. Data
+     * which is stored compressed (see setCompressionThreshold()) is
+     * uncompressed as a whole instead. The device must be deleted before
+     * this object.
+     *
+     * @param key The key to find in the cache.
+     * @return A read-only device which the caller takes ownership of, or
+     *         nullptr if @p key was not present in the cache.
+     * @see insertStreamed()
+     * @since 5.64
+     */
+    QIODevice *findStreamed(const QString &key) const;
+
     /**
      * Removes all entries from the cache.
      */
     void clear();
 
+    /**
+     * Writes the entries of the cache to the file @p fileName, so that they
+     * can be loaded into the cache again with loadSnapshot(), e.g. to avoid
+     * starting with an empty cache after a reboot.
+     *
+     * The entries most worth keeping according to the eviction policy are
+     * written first. If @p maxSize is not 0, only as many entries as fit into
+     * @p maxSize bytes are written. The file is replaced atomically.
+     *
+     * @param fileName The name of the file to write.
+     * @param maxSize The maximum amount of data to write, in bytes, or 0 to
+     *                write all entries.
+     * @return true if the snapshot was written, false otherwise.
+     * @see loadSnapshot()
+     * @since 5.64
+     */
+    bool saveSnapshot(const QString &fileName, unsigned maxSize = 0) const;
+
+    /**
+     * Inserts the entries of a snapshot written by saveSnapshot() into the
+     * cache. Entries already present in the cache are kept as they are, as
+     * they are assumed to be newer than the snapshot. If the snapshot holds
+     * more data than fits into the cache, the entries least worth keeping
+     * are left out.
+     *
+     * Every entry of the snapshot is checksummed, and damaged entries are
+     * left out. A snapshot with a damaged header is ignored as a whole.
+     *
+     * @param fileName The name of the snapshot file.
+     * @return true if all entries that were loaded were inserted into the
+     *         cache, false otherwise.
+     * @see saveSnapshot()
+     * @since 5.64
+     */
+    bool loadSnapshot(const QString &fileName);
+
+    /**
+     * Removes all entries whose key starts with @p prefix from the cache. This
+     * allows to use a common prefix for related keys and to invalidate them
+     * all at once without clearing the whole cache, e.g. when several kinds
+     * of data share one cache.
+     *
+     * @param prefix The start of the keys to remove.
+     * @return The number of entries removed from the cache.
+     * @see clear()
+     * @since 5.64
+     */
+    int removeByPrefix(const QString &prefix);
+
+    /**
+     * Verifies the checksums of up to @p maxEntries entries, continuing after
+     * the last entry checked by the previous call in any process, or of all
+     * entries if @p maxEntries is 0. Entries whose data was damaged, e.g. by a
+     * process that crashed while writing to the cache, are removed while the
+     * rest of the cache stays intact. Checking a limited number of entries at
+     * a time allows to check the whole cache over time without holding the
+     * lock for long.
+     *
+     * find() and findMany() can also verify the checksum of every entry they
+     * return, see setVerifyChecksumsOnFind().
+     *
+     * @param maxEntries The maximum number of entries to check.
+     * @return The number of damaged entries removed, or -1 if the cache was
+     *         damaged beyond repair and had to be cleared.
+     * @see Statistics::corruptions
+     * @since 5.64
+     */
+    int checkIntegrity(unsigned maxEntries = 0);
+
+    /**
+     * Changes the size of the cache to @p newCacheSize bytes without throwing
+     * away its contents. The entries are copied over to a new cache of the
+     * desired size, starting with those the eviction policy would keep the
+     * longest. If the new cache is too small to hold all entries the
+     * remaining ones are dropped.
+     *
+     * Other processes using the cache switch over to the resized cache the
+     * next time they access it. The size is still subject to the same minimum
+     * as the size passed to the constructor.
+     *
+     * @param newCacheSize The new usable size of the cache, in bytes.
+     * @return true if the cache was resized, false otherwise (in which case
+     *         the cache is unchanged).
+     * @see totalSize()
+     * @since 5.64
+     */
+    bool resize(unsigned newCacheSize);
+
     /**
      * Removes the underlying file from the cache. Note that this is *all* that this
      * function does. The shared memory segment is still attached and will still contain
@@ -159,6 +640,12 @@ public:
      */
     bool contains(const QString &key) const;
 
+    /**
+     * Same as contains(const QString &), but using a prepared @p key.
+     * @since 5.64
+     */
+    bool contains(const Key &key) const;
+
     /**
      * Returns the usable cache size in bytes. The actual amount of memory
      * used will be slightly larger than this to account for required
@@ -174,6 +661,106 @@ public:
      */
     unsigned freeSize() const;
 
+    /**
+     * Statistics about the index used to look up entries in the cache.
+     * @see indexStatistics()
+     * @since 5.64
+     */
+    struct IndexStatistics {
+        /// The number of entries in the cache.
+        unsigned entryCount = 0;
+        /// The number of entries the index can hold before entries are
+        /// evicted to make room, even if there is still free space.
+        unsigned capacity = 0;
+        /// The number of entries that were not stored at their preferred
+        /// position in the index due to hash collisions, since the cache was
+        /// created or last cleared.
+        unsigned collisions = 0;
+        /// The largest distance of any entry from its preferred position.
+        unsigned longestProbe = 0;
+        /// The average distance of the entries from their preferred position.
+        double averageProbe = 0.0;
+    };
+
+    /**
+     * Returns statistics about the index used to look up entries in the
+     * cache, which indicate how efficient lookups are. Note that the entries
+     * in the index have to be traversed to gather them.
+     *
+     * @see IndexStatistics
+     * @since 5.64
+     */
+    IndexStatistics indexStatistics() const;
+
+    /**
+     * Usage statistics of a shared cache.
+     * @see statistics()
+     * @since 5.64
+     */
+    struct Statistics {
+        /// The number of lookups which found the entry looked for.
+        quint64 hits = 0;
+        /// The number of lookups which did not find the entry looked for.
+        quint64 misses = 0;
+        /// The number of entries inserted.
+        quint64 inserts = 0;
+        /// The number of entries removed to make room for other entries.
+        quint64 evictions = 0;
+        /// The number of entries removed because they expired.
+        /// @see setEntryTimeToLive()
+        quint64 expirations = 0;
+        /// The number of entries removed because their data was damaged.
+        /// @see checkIntegrity()
+        quint64 corruptions = 0;
+        /// The number of times the cache was defragmented.
+        quint64 defragmentations = 0;
+        /// The number of times the cache was locked.
+        quint64 lockCount = 0;
+        /// The number of times waiting for the lock timed out.
+        quint64 lockTimeouts = 0;
+        /// The number of times a process died while holding the lock, after
+        /// which the cache was checked for damage. Only counted where the
+        /// system supports robust process-shared mutexes.
+        quint64 ownerDeaths = 0;
+        /// The total time the cache was kept locked, in nanoseconds.
+        quint64 lockHoldTime = 0;
+        /// The total size of the data that compression was attempted on, in
+        /// bytes.
+        quint64 compressionInput = 0;
+        /// The total size of that data as stored in the cache, in bytes.
+        /// Together with compressionInput this gives the achieved
+        /// compression ratio.
+        quint64 compressionOutput = 0;
+    };
+
+    /**
+     * Returns usage statistics of the cache, accumulated by all processes
+     * using it since the cache was created or resetStatistics() was called.
+     * They are not reset by clear().
+     *
+     * A high number of evictions compared to inserts indicates the cache is
+     * too small for the data it holds, while a high lock hold time or any
+     * lock timeouts indicate there is a lot of contention for it.
+     *
+     * Lookups through find(), findMany() and findView() are counted as hits
+     * or misses, while contains() is not counted. Each process adds up its
+     * lookups locally and only adds them to the shared statistics whenever it
+     * locks the cache anyway, so lookups of other processes may show up late.
+     *
+     * @see resetStatistics()
+     * @since 5.64
+     */
+    Statistics statistics() const;
+
+    /**
+     * Resets all usage statistics of the cache to 0, for all processes using
+     * it.
+     *
+     * @see statistics()
+     * @since 5.64
+     */
+    void resetStatistics();
+
     /**
      * @return The shared timestamp of the cache. The interpretation of the
      *         timestamp returned is up to the application. KSharedDataCache
@@ -223,4 +810,6 @@ private:
     Private *d;
 };
 
+Q_DECLARE_OPERATORS_FOR_FLAGS(KSharedDataCache::MemoryHints)
+
 #endif
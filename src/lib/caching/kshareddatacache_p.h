@@ -20,7 +20,7 @@
 #ifndef KSHAREDDATACACHE_P_H
 #define KSHAREDDATACACHE_P_H
 
-#include <config-caching.h> // HAVE_SYS_MMAN_H
+#include <config-caching.h> // HAVE_SYS_MMAN_H, HAVE_PTHREAD_MUTEX_CONSISTENT
 
 #include <QDebug>
 #include <QSharedPointer>
@@ -51,6 +51,12 @@
 #define KSDC_THREAD_PROCESS_SHARED_SUPPORTED 1
 #endif
 
+// Robust mutexes are released by the system if their owner dies, which
+// requires pthread_mutex_consistent() to make them usable again.
+#if defined(KSDC_THREAD_PROCESS_SHARED_SUPPORTED) && defined(KSDC_TIMEOUTS_SUPPORTED) && HAVE_PTHREAD_MUTEX_CONSISTENT
+#define KSDC_ROBUST_MUTEX_SUPPORTED 1
+#endif
+
 #if defined(_POSIX_SEMAPHORES) && ((_POSIX_SEMAPHORES == 0) || (_POSIX_SEMAPHORES >= 200112L))
 #include <semaphore.h>
 #define KSDC_SEMAPHORES_SUPPORTED 1
@@ -111,6 +117,13 @@ public:
         return false;
     }
 
+    // Called by processes which use a lock initialized by another process.
+    // Return value and @p processSharingSupported as for initialize().
+    virtual bool attach(bool &processSharingSupported)
+    {
+        return initialize(processSharingSupported);
+    }
+
     virtual bool lock()
     {
         return false;
@@ -119,6 +132,14 @@ public:
     virtual void unlock()
     {
     }
+
+    // Returns true if the last successful call to lock() took over the lock
+    // from a process which died while holding it. Whatever that process was
+    // doing to the data guarded by the lock is left unfinished.
+    virtual bool previousOwnerDied() const
+    {
+        return false;
+    }
 };
 
 /**
@@ -260,6 +281,112 @@ public:
 };
 #endif
 
+#ifdef KSDC_ROBUST_MUTEX_SUPPORTED
+/**
+ * A process-shared pthread mutex which is made robust, so that the system
+ * releases it if the process holding it dies instead of leaving all other
+ * processes to wait for the timeout. On Linux this is a futex, which costs
+ * no system call unless there is contention. As the lock is usually held
+ * only briefly, a contended lock is retried a few times before going to
+ * sleep on it.
+ */
+class robustMutexLock : public pthreadLock
+{
+public:
+    robustMutexLock(pthread_mutex_t &mutex)
+        : pthreadLock(mutex)
+        , m_ownerDied(false)
+    {
+    }
+
+    bool initialize(bool &processSharingSupported) override
+    {
+        pthread_mutexattr_t mutexAttr;
+        processSharingSupported = false;
+
+        // Without process-sharing robustness is pointless, leave the
+        // fallback to other lock types to findBestSharedLock().
+        if (::sysconf(_SC_THREAD_PROCESS_SHARED) < 200112L || pthread_mutexattr_init(&mutexAttr) != 0) {
+            return false;
+        }
+
+        if (pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED) == 0 &&
+                pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST) == 0 &&
+                pthread_mutex_init(&m_mutex, &mutexAttr) == 0) {
+            processSharingSupported = true;
+        }
+        pthread_mutexattr_destroy(&mutexAttr);
+
+        return processSharingSupported;
+    }
+
+    bool attach(bool &processSharingSupported) override
+    {
+        // Initializing the mutex again would break it for any process
+        // holding it, and lose track of an owner which died.
+        processSharingSupported = true;
+        return true;
+    }
+
+    bool lock() override
+    {
+        int result = pthread_mutex_trylock(&m_mutex);
+        for (int i = 0; i < 100 && result == EBUSY; ++i) {
+            spinPause();
+            result = pthread_mutex_trylock(&m_mutex);
+        }
+
+        if (result == EBUSY) {
+            // Same timeout as pthreadTimedLock.
+            struct timespec timeout;
+            timeout.tv_sec = 10 + ::time(nullptr);
+            timeout.tv_nsec = 0;
+
+            result = pthread_mutex_timedlock(&m_mutex, &timeout);
+        }
+
+        bool ownerDied = false;
+        if (result == EOWNERDEAD) {
+            // We hold the lock now, but it stays unusable for everyone once
+            // we release it unless it is marked as consistent again.
+            ownerDied = true;
+            result = pthread_mutex_consistent(&m_mutex);
+            if (result != 0) {
+                // Still held, so release it and leave it to the caller to
+                // treat the cache as corrupted.
+                pthread_mutex_unlock(&m_mutex);
+                return false;
+            }
+        }
+
+        // Only written with the lock held, so other threads sharing this
+        // object cannot change it under its owner.
+        if (result == 0) {
+            m_ownerDied = ownerDied;
+        }
+
+        return result == 0;
+    }
+
+    bool previousOwnerDied() const override
+    {
+        return m_ownerDied;
+    }
+
+private:
+    static inline void spinPause()
+    {
+#if defined(Q_PROCESSOR_X86) && defined(Q_CC_GNU)
+        __builtin_ia32_pause();
+#elif defined(_POSIX_PRIORITY_SCHEDULING)
+        sched_yield();
+#endif
+    }
+
+    bool m_ownerDied;
+};
+#endif
+
 #ifdef KSDC_SEMAPHORES_SUPPORTED
 class semaphoreLock : public KSDCLock
 {
@@ -335,7 +462,8 @@ enum SharedLockId {
     LOCKTYPE_INVALID   = 0,
     LOCKTYPE_MUTEX     = 1,  // pthread_mutex
     LOCKTYPE_SEMAPHORE = 2,  // sem_t
-    LOCKTYPE_SPINLOCK  = 3   // atomic int in shared memory
+    LOCKTYPE_SPINLOCK  = 3,  // atomic int in shared memory
+    LOCKTYPE_ROBUST_MUTEX = 4 // robust pthread_mutex
 };
 
 // This type is a union of all possible lock types, with a SharedLockId used
@@ -380,6 +508,20 @@ static SharedLockId findBestSharedLock()
 
     // Now that we've queried timeouts, try actually creating real locks and
     // seeing if there's issues with that.
+#ifdef KSDC_ROBUST_MUTEX_SUPPORTED
+    // A robust mutex is preferred above all, as it survives the death of a
+    // process holding it.
+    if (timeoutsSupported) {
+        pthread_mutex_t tempMutex;
+        bool robustProcessShared = false;
+        robustMutexLock tempLock(tempMutex);
+        if (tempLock.initialize(robustProcessShared) && robustProcessShared) {
+            pthread_mutex_destroy(&tempMutex);
+            return LOCKTYPE_ROBUST_MUTEX;
+        }
+    }
+#endif
+
 #ifdef KSDC_THREAD_PROCESS_SHARED_SUPPORTED
     {
         pthread_mutex_t tempMutex;
@@ -442,6 +584,13 @@ static KSDCLock *createLockFromId(SharedLockId id, SharedLock &lock)
         break;
 #endif
 
+#ifdef KSDC_ROBUST_MUTEX_SUPPORTED
+    case LOCKTYPE_ROBUST_MUTEX:
+        return new robustMutexLock(lock.mutex);
+
+        break;
+#endif
+
 #ifdef KSDC_SEMAPHORES_SUPPORTED
     case LOCKTYPE_SEMAPHORE:
 #ifdef KSDC_TIMEOUTS_SUPPORTED
@@ -502,4 +651,25 @@ static bool ensureFileAllocated(int fd, size_t fileSize)
 #endif
 }
 
+// Passes @p advice for the memory range [start, start+length) on to madvise().
+// The range is shrunk to whole pages as needed.
+static bool adviseMemory(void *start, size_t length, int advice)
+{
+#if HAVE_SYS_MMAN_H
+    const quintptr pageSize = static_cast<quintptr>(::sysconf(_SC_PAGESIZE));
+    const quintptr begin = (reinterpret_cast<quintptr>(start) + pageSize - 1) & ~(pageSize - 1);
+    const quintptr end = reinterpret_cast<quintptr>(start) + length;
+    if (end <= begin) {
+        return false;
+    }
+
+    return ::madvise(reinterpret_cast<void *>(begin), end - begin, advice) == 0;
+#else
+    Q_UNUSED(start);
+    Q_UNUSED(length);
+    Q_UNUSED(advice);
+    return false;
+#endif
+}
+
 #endif /* KSHAREDDATACACHE_P_H */
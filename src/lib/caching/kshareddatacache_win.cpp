@@ -26,12 +26,21 @@
 
 #include <QString>
 #include <QByteArray>
+#include <QBuffer>
 #include <QCache>
+#include <QHash>
+#include <QList>
+#include <QStringList>
 
 class Q_DECL_HIDDEN KSharedDataCache::Private
 {
 public:
     KSharedDataCache::EvictionPolicy evictionPolicy;
+    unsigned defragmentationBudget = 0;
+    unsigned compressionThreshold = 0;
+    unsigned entryTimeToLive = 0;
+    KSharedDataCache::MemoryHints memoryHints = KSharedDataCache::NoMemoryHints;
+    bool verifyChecksumsOnFind = false;
     QCache<QString, QByteArray> cache;
 };
 
@@ -61,11 +70,114 @@ void KSharedDataCache::setEvictionPolicy(KSharedDataCache::EvictionPolicy newPol
     d->evictionPolicy = newPolicy;
 }
 
+unsigned KSharedDataCache::defragmentationBudget() const
+{
+    return d->defragmentationBudget;
+}
+
+void KSharedDataCache::setDefragmentationBudget(unsigned budget)
+{
+    d->defragmentationBudget = budget;
+}
+
+class Q_DECL_HIDDEN KSharedDataCache::Key::Private : public QSharedData
+{
+public:
+    // QCache does the hashing here.
+    QString key;
+};
+
+KSharedDataCache::Key::Key()
+    : d(new Private)
+{
+}
+
+KSharedDataCache::Key::Key(const QString &key)
+    : d(new Private)
+{
+    d->key = key;
+}
+
+KSharedDataCache::Key::Key(const Key &other)
+    : d(other.d)
+{
+}
+
+KSharedDataCache::Key &KSharedDataCache::Key::operator=(const Key &other)
+{
+    d = other.d;
+    return *this;
+}
+
+KSharedDataCache::Key::~Key()
+{
+}
+
+QString KSharedDataCache::Key::toString() const
+{
+    return d->key;
+}
+
 bool KSharedDataCache::insert(const QString &key, const QByteArray &data)
 {
     return d->cache.insert(key, new QByteArray(data));
 }
 
+bool KSharedDataCache::insert(const Key &key, const QByteArray &data)
+{
+    return insert(key.d->key, data);
+}
+
+bool KSharedDataCache::insertMany(const QHash<QString, QByteArray> &entries)
+{
+    bool allInserted = true;
+    for (auto it = entries.constBegin(); it != entries.constEnd(); ++it) {
+        if (!insert(it.key(), it.value())) {
+            allInserted = false;
+        }
+    }
+
+    return allInserted;
+}
+
+QHash<QString, QByteArray> KSharedDataCache::findMany(const QStringList &keys) const
+{
+    QHash<QString, QByteArray> results;
+    for (const QString &key : keys) {
+        QByteArray *value = d->cache.object(key);
+        if (value) {
+            results.insert(key, *value);
+        }
+    }
+
+    return results;
+}
+
+QHash<QString, QByteArray> KSharedDataCache::findMany(const QList<Key> &keys) const
+{
+    QStringList keyStrings;
+    keyStrings.reserve(keys.size());
+    for (const Key &key : keys) {
+        keyStrings.append(key.d->key);
+    }
+
+    return findMany(keyStrings);
+}
+
+bool KSharedDataCache::insertAsync(const QString &key, const QByteArray &data)
+{
+    return insert(key, data);
+}
+
+bool KSharedDataCache::insertAsync(const Key &key, const QByteArray &data)
+{
+    return insert(key, data);
+}
+
+void KSharedDataCache::flush()
+{
+}
+
 bool KSharedDataCache::find(const QString &key, QByteArray *destination) const
 {
     QByteArray *value = d->cache.object(key);
@@ -80,11 +192,131 @@ bool KSharedDataCache::find(const QString &key, QByteArray *destination) const
     }
 }
 
+bool KSharedDataCache::find(const Key &key, QByteArray *destination) const
+{
+    return find(key.d->key, destination);
+}
+
+bool KSharedDataCache::findView(const QString &key, QByteArray *destination, unsigned *generation) const
+{
+    // Nothing is shared here, so there is no data to view in place.
+    if (generation) {
+        *generation = 0;
+    }
+
+    return find(key, destination);
+}
+
+bool KSharedDataCache::findView(const Key &key, QByteArray *destination, unsigned *generation) const
+{
+    return findView(key.d->key, destination, generation);
+}
+
+unsigned KSharedDataCache::generation() const
+{
+    return 0;
+}
+
+// Collects the streamed data and inserts it once complete, since there is
+// no shared memory to write it to.
+class KSDCStreamWriter : public QBuffer
+{
+public:
+    KSDCStreamWriter(KSharedDataCache *cache, const QString &key, unsigned size)
+        : m_cache(cache)
+        , m_key(key)
+        , m_size(size)
+    {
+        open(QIODevice::WriteOnly);
+    }
+
+protected:
+    qint64 writeData(const char *data, qint64 length) override
+    {
+        if (length > m_size - size()) {
+            return -1;
+        }
+
+        const qint64 written = QBuffer::writeData(data, length);
+        if (written == length && size() == m_size && !m_cache->insert(m_key, buffer())) {
+            return -1;
+        }
+
+        return written;
+    }
+
+private:
+    KSharedDataCache *m_cache;
+    const QString m_key;
+    const qint64 m_size;
+};
+
+QIODevice *KSharedDataCache::insertStreamed(const QString &key, unsigned size)
+{
+    if (size == 0 && !insert(key, QByteArray())) {
+        return nullptr;
+    }
+
+    return new KSDCStreamWriter(this, key, size);
+}
+
+QIODevice *KSharedDataCache::findStreamed(const QString &key) const
+{
+    QByteArray data;
+    if (!find(key, &data)) {
+        return nullptr;
+    }
+
+    QBuffer *buffer = new QBuffer;
+    buffer->setData(data);
+    buffer->open(QIODevice::ReadOnly);
+    return buffer;
+}
+
 void KSharedDataCache::clear()
 {
     d->cache.clear();
 }
 
+bool KSharedDataCache::saveSnapshot(const QString &fileName, unsigned maxSize) const
+{
+    // Not supported without shared memory.
+    Q_UNUSED(fileName);
+    Q_UNUSED(maxSize);
+    return false;
+}
+
+bool KSharedDataCache::loadSnapshot(const QString &fileName)
+{
+    Q_UNUSED(fileName);
+    return false;
+}
+
+int KSharedDataCache::removeByPrefix(const QString &prefix)
+{
+    int removed = 0;
+    const QList<QString> keys = d->cache.keys();
+    for (const QString &key : keys) {
+        if (key.startsWith(prefix) && d->cache.remove(key)) {
+            ++removed;
+        }
+    }
+
+    return removed;
+}
+
+int KSharedDataCache::checkIntegrity(unsigned maxEntries)
+{
+    Q_UNUSED(maxEntries);
+    return 0;
+}
+
+bool KSharedDataCache::resize(unsigned newCacheSize)
+{
+    d->cache.setMaxCost(static_cast<int>(newCacheSize));
+    return true;
+}
+
 void KSharedDataCache::deleteCache(const QString &cacheName)
 {
     Q_UNUSED(cacheName);
@@ -95,6 +327,11 @@ bool KSharedDataCache::contains(const QString &key) const
     return d->cache.contains(key);
 }
 
+bool KSharedDataCache::contains(const Key &key) const
+{
+    return contains(key.d->key);
+}
+
 unsigned KSharedDataCache::totalSize() const
 {
     return static_cast<unsigned>(d->cache.maxCost());
@@ -109,6 +346,65 @@ unsigned KSharedDataCache::freeSize() const
     }
 }
 
+unsigned KSharedDataCache::compressionThreshold() const
+{
+    return d->compressionThreshold;
+}
+
+void KSharedDataCache::setCompressionThreshold(unsigned threshold)
+{
+    d->compressionThreshold = threshold;
+}
+
+unsigned KSharedDataCache::entryTimeToLive() const
+{
+    return d->entryTimeToLive;
+}
+
+void KSharedDataCache::setEntryTimeToLive(unsigned seconds)
+{
+    // Entries do not expire here, the setting is only remembered.
+    d->entryTimeToLive = seconds;
+}
+
+KSharedDataCache::MemoryHints KSharedDataCache::memoryHints() const
+{
+    return d->memoryHints;
+}
+
+void KSharedDataCache::setMemoryHints(MemoryHints hints)
+{
+    d->memoryHints = hints;
+}
+
+bool KSharedDataCache::verifyChecksumsOnFind() const
+{
+    return d->verifyChecksumsOnFind;
+}
+
+void KSharedDataCache::setVerifyChecksumsOnFind(bool verify)
+{
+    // There are no checksums here, the setting is only remembered.
+    d->verifyChecksumsOnFind = verify;
+}
+
+KSharedDataCache::IndexStatistics KSharedDataCache::indexStatistics() const
+{
+    IndexStatistics result;
+    result.entryCount = static_cast<unsigned>(d->cache.count());
+    result.capacity = static_cast<unsigned>(d->cache.maxCost());
+    return result;
+}
+
+KSharedDataCache::Statistics KSharedDataCache::statistics() const
+{
+    return Statistics();
+}
+
+void KSharedDataCache::resetStatistics()
+{
+}
+
 unsigned KSharedDataCache::timestamp() const
 {
     return 0;
@@ -52,11 +52,13 @@
 #include <errno.h>
 #include <QLoggingCategory>
 #include <QDir>
+#include <QDirIterator>
 #include <QFile>
 #include <QSocketNotifier>
 #include <QTimer>
 #include <QThread>
 #include <QThreadStorage>
+#include <QVector>
 #include <QCoreApplication>
 
 #include <qplatformdefs.h> // QT_LSTAT, QT_STAT, QT_STATBUF
@@ -64,6 +66,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef Q_OS_LINUX
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #if HAVE_SYS_INOTIFY_H
 #include <unistd.h>
 #include <fcntl.h>
@@ -79,11 +88,27 @@
 
 // debug
 #include <sys/ioctl.h>
+#include <limits.h>
+#include <poll.h>
 
 #include <sys/utsname.h>
 
 #endif // HAVE_SYS_INOTIFY_H
 
+#if HAVE_SYS_FANOTIFY_H
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+
+// Events are passed on to the inotify event handling as they are
+static_assert(FAN_MODIFY == IN_MODIFY && FAN_ATTRIB == IN_ATTRIB && FAN_MOVED_FROM == IN_MOVED_FROM &&
+              FAN_MOVED_TO == IN_MOVED_TO && FAN_CREATE == IN_CREATE && FAN_DELETE == IN_DELETE &&
+              FAN_DELETE_SELF == IN_DELETE_SELF && FAN_ONDIR == IN_ISDIR,
+              "fanotify and inotify events differ");
+
+static const quint64 s_fanotifyMask = FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF | FAN_MOVE | FAN_MOVE_SELF |
+                                      FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR;
+#endif // HAVE_SYS_FANOTIFY_H
+
 Q_DECLARE_LOGGING_CATEGORY(KDIRWATCH)
 // logging category for this framework, default: log stuff >= warning
 Q_LOGGING_CATEGORY(KDIRWATCH, "kf5.kcoreaddons.kdirwatch", QtWarningMsg)
@@ -109,6 +134,8 @@ static KDirWatch::Method methodFromString(const QByteArray &method)
         return KDirWatch::Stat;
     } else if (method == "QFSWatch") {
         return KDirWatch::QFSWatch;
+    } else if (method == "FANotify") {
+        return KDirWatch::FANotify;
     } else {
 #if defined(HAVE_SYS_INOTIFY_H)
         // inotify supports delete+recreate+modify, which QFSWatch doesn't support
@@ -130,15 +157,50 @@ static const char *methodToString(KDirWatch::Method method)
         return "Stat";
     case KDirWatch::QFSWatch:
         return "QFSWatch";
+    case KDirWatch::FANotify:
+        return "FANotify";
     }
     // not reached
     return nullptr;
 }
 
+#if HAVE_SYS_FANOTIFY_H
+// Returns the key identifying a directory in fanotify events: the id of the
+// filesystem and the file handle of the directory on it.
+static QByteArray fanotifyHandleKey(const __kernel_fsid_t *fsid, const struct file_handle *handle)
+{
+    QByteArray key(reinterpret_cast<const char *>(fsid), sizeof(*fsid));
+    key.append(reinterpret_cast<const char *>(&handle->handle_type), sizeof(handle->handle_type));
+    key.append(reinterpret_cast<const char *>(handle->f_handle), handle->handle_bytes);
+    return key;
+}
+
+// Returns the fanotify key of the directory <path>, or an empty key if it can't be determined.
+static QByteArray fanotifyHandleKey(const QByteArray &path)
+{
+    struct statfs fs;
+    if (statfs(path.constData(), &fs) != 0) {
+        return QByteArray();
+    }
+
+    alignas(struct file_handle) char handleBuffer[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    struct file_handle *handle = reinterpret_cast<struct file_handle *>(handleBuffer);
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mountId;
+    if (name_to_handle_at(AT_FDCWD, path.constData(), handle, &mountId, AT_SYMLINK_FOLLOW) != 0) {
+        return QByteArray();
+    }
+
+    static_assert(sizeof(fs.f_fsid) == sizeof(__kernel_fsid_t), "statfs and fanotify filesystem ids differ");
+    return fanotifyHandleKey(reinterpret_cast<const __kernel_fsid_t *>(&fs.f_fsid), handle);
+}
+#endif
+
 static const char s_envNfsPoll[] = "KDIRWATCH_NFSPOLLINTERVAL";
 static const char s_envPoll[] = "KDIRWATCH_POLLINTERVAL";
 static const char s_envMethod[] = "KDIRWATCH_METHOD";
 static const char s_envNfsMethod[] = "KDIRWATCH_NFSMETHOD";
+static const char s_envINotifyThread[] = "KDIRWATCH_INOTIFY_THREAD";
 
 //
 // Class KDirWatchPrivate (singleton)
@@ -166,6 +228,13 @@ static const char s_envNfsMethod[] = "KDIRWATCH_NFSMETHOD";
  *   introduced. You're now able to watch arbitrary inode's
  *   for changes, and even get notification when they're
  *   unmounted.
+ * - FANOTIFY: Since LINUX 5.9, fanotify reports changes to
+ *   directory entries of a whole filesystem with a single mark.
+ *   Events are matched to entries by the file handle of the
+ *   directory they happened in, so any number of directories
+ *   can be watched without using up inotify watches. Marking
+ *   filesystems requires CAP_SYS_ADMIN, so it is only used
+ *   when preferred explicitly.
  */
 
 KDirWatchPrivate::KDirWatchPrivate()
@@ -177,6 +246,12 @@ KDirWatchPrivate::KDirWatchPrivate()
       rescan_timer(),
 #if HAVE_SYS_INOTIFY_H
       mSn(nullptr),
+      m_inotifyReader(nullptr),
+#endif
+#if HAVE_SYS_FANOTIFY_H
+      mFanSn(nullptr),
+      supports_fanotify(false),
+      m_fanotify_fd(-1),
 #endif
       _isStopped(false)
 {
@@ -224,9 +299,38 @@ KDirWatchPrivate::KDirWatchPrivate()
         availableMethods << "INotify";
         (void)fcntl(m_inotify_fd, F_SETFD, FD_CLOEXEC);
 
-        mSn = new QSocketNotifier(m_inotify_fd, QSocketNotifier::Read, this);
-        connect(mSn, SIGNAL(activated(int)),
-                this, SLOT(inotifyEventReceived()));
+        if (qEnvironmentVariableIntValue(s_envINotifyThread) > 0) {
+            startINotifyReader();
+        } else {
+            mSn = new QSocketNotifier(m_inotify_fd, QSocketNotifier::Read, this);
+            connect(mSn, SIGNAL(activated(int)),
+                    this, SLOT(inotifyEventReceived()));
+        }
+    }
+#endif
+#if HAVE_SYS_FANOTIFY_H
+    if (m_preferredMethod == KDirWatch::FANotify || m_nfsPreferredMethod == KDirWatch::FANotify) {
+        m_fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+                                      O_RDONLY | O_LARGEFILE);
+
+        // Unprivileged processes may be able to use fanotify, but not to mark
+        // whole filesystems. Flushing all filesystem marks finds out without
+        // marking anything.
+        if (m_fanotify_fd >= 0 &&
+                fanotify_mark(m_fanotify_fd, FAN_MARK_FLUSH | FAN_MARK_FILESYSTEM, 0, AT_FDCWD, nullptr) == 0) {
+            supports_fanotify = true;
+            availableMethods << "FANotify";
+
+            mFanSn = new QSocketNotifier(m_fanotify_fd, QSocketNotifier::Read, this);
+            connect(mFanSn, SIGNAL(activated(int)),
+                    this, SLOT(fanotifyEventReceived()));
+        } else {
+            qCDebug(KDIRWATCH) << "Can't use fanotify:" << strerror(errno);
+            if (m_fanotify_fd >= 0) {
+                QT_CLOSE(m_fanotify_fd);
+                m_fanotify_fd = -1;
+            }
+        }
     }
 #endif
 #if HAVE_QFILESYSTEMWATCHER
@@ -244,6 +348,15 @@ KDirWatchPrivate::~KDirWatchPrivate()
 {
     timer.stop();
 
+    for (const QSharedPointer<RecursiveWalk> &walk : qAsConst(m_recursiveWalks)) {
+        walk->cancelled.store(1);
+        if (walk->thread) {
+            walk->thread->wait();
+            delete walk->thread;
+            walk->thread = nullptr;
+        }
+    }
+
 #if HAVE_FAM
     if (use_fam && sn) {
         FAMClose(&fc);
@@ -251,9 +364,15 @@ KDirWatchPrivate::~KDirWatchPrivate()
 #endif
 #if HAVE_SYS_INOTIFY_H
     if (supports_inotify) {
+        stopINotifyReader();
         QT_CLOSE(m_inotify_fd);
     }
 #endif
+#if HAVE_SYS_FANOTIFY_H
+    if (supports_fanotify) {
+        QT_CLOSE(m_fanotify_fd);
+    }
+#endif
 #if HAVE_QFILESYSTEMWATCHER
     delete fsWatcher;
 #endif
@@ -309,132 +428,338 @@ void KDirWatchPrivate::inotifyEventReceived()
                 continue;
             }
 
-            // Is set to true if the new event is a directory, false otherwise. This prevents a stat call in clientsForFileOrDir
-            const bool isDir = (event->mask & (IN_ISDIR));
-
             Entry *e = m_inotify_wd_to_entry.value(event->wd);
-            if (!e) {
+            if (e) {
+                processINotifyEvent(e, event->mask, path);
+            }
+        }
+        if (bytesAvailable > 0) {
+            // copy partial event to beginning of buffer
+            memmove(buf, &buf[offsetCurrent], bytesAvailable);
+            offsetStartRead = bytesAvailable;
+        }
+    }
+#endif
+}
+
+#if HAVE_SYS_INOTIFY_H
+void KDirWatchPrivate::startINotifyReader()
+{
+    // The reader thread is woken up through this pipe to exit
+    if (pipe(m_inotifyReaderWakeup) != 0) {
+        qCWarning(KCOREADDONS_DEBUG) << "Can't read inotify events in a thread:" << strerror(errno);
+        mSn = new QSocketNotifier(m_inotify_fd, QSocketNotifier::Read, this);
+        connect(mSn, SIGNAL(activated(int)),
+                this, SLOT(inotifyEventReceived()));
+        return;
+    }
+    (void)fcntl(m_inotifyReaderWakeup[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(m_inotifyReaderWakeup[1], F_SETFD, FD_CLOEXEC);
+
+    m_inotifyReader = QThread::create([this]() { readINotifyEvents(); });
+    m_inotifyReader->setObjectName(QStringLiteral("KDirWatch inotify reader"));
+    m_inotifyReader->start();
+    qCDebug(KDIRWATCH) << "Reading inotify events in a separate thread";
+}
+
+void KDirWatchPrivate::stopINotifyReader()
+{
+    if (!m_inotifyReader) {
+        return;
+    }
+
+    const char wakeup = 0;
+    while (write(m_inotifyReaderWakeup[1], &wakeup, 1) < 0 && errno == EINTR) {
+    }
+    m_inotifyReader->wait();
+    delete m_inotifyReader;
+    m_inotifyReader = nullptr;
+
+    QT_CLOSE(m_inotifyReaderWakeup[0]);
+    QT_CLOSE(m_inotifyReaderWakeup[1]);
+}
+
+/* Runs in m_inotifyReader: reads all of the pending inotify events at once,
+ * drops those inotifyEventReceived() would ignore and those repeating the
+ * event before, e.g. when a file is written to in small chunks, and queues
+ * the rest for inotifyEventsQueued().
+ */
+void KDirWatchPrivate::readINotifyEvents()
+{
+    // Always big enough for the largest event
+    QByteArray buf(sizeof(struct inotify_event) + NAME_MAX + 1, Qt::Uninitialized);
+    QVector<INotifyEvent> events;
+
+    struct pollfd fds[2];
+    fds[0].fd = m_inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_inotifyReaderWakeup[0];
+    fds[1].events = POLLIN;
+
+    forever {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
                 continue;
             }
-            const bool wasDirty = e->dirty;
-            e->dirty = true;
+            qCWarning(KCOREADDONS_DEBUG) << "Waiting for inotify events failed:" << strerror(errno);
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
 
-            const QString tpath = e->path + QLatin1Char('/') + path;
+        int pending = 0;
+        ioctl(m_inotify_fd, FIONREAD, &pending);
+        if (pending > buf.size()) {
+            buf.resize(pending);
+        }
 
-            if (s_verboseDebug) {
-                qCDebug(KDIRWATCH).nospace() << "got event 0x" << qPrintable(QString::number(event->mask, 16)) << " for " << e->path;
+        const int bytesRead = read(m_inotify_fd, buf.data(), buf.size());
+        if (bytesRead < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
             }
+            qCWarning(KCOREADDONS_DEBUG) << "Reading inotify events failed:" << strerror(errno);
+            return;
+        }
 
-            if (event->mask & IN_DELETE_SELF) {
-                if (s_verboseDebug) {
-                    qCDebug(KDIRWATCH) << "-->got deleteself signal for" << e->path;
-                }
-                e->m_status = NonExistent;
-                m_inotify_wd_to_entry.remove(e->wd);
-                e->wd = -1;
-                e->m_ctime = invalid_ctime;
-                emitEvent(e, Deleted, e->path);
-                // If the parent dir was already watched, tell it something changed
-                Entry *parentEntry = entry(e->parentDirectory());
-                if (parentEntry) {
-                    parentEntry->dirty = true;
-                }
-                // Add entry to parent dir to notice if the entry gets recreated
-                addEntry(nullptr, e->parentDirectory(), e, true /*isDir*/);
+        // read() only ever returns complete events
+        for (int offset = 0; offset + int(sizeof(struct inotify_event)) <= bytesRead;) {
+            const struct inotify_event *const event = reinterpret_cast<const inotify_event *>(buf.constData() + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+
+            // strip trailing null chars, see inotify_event documentation
+            int len = event->len;
+            while (len > 1 && !event->name[len - 1]) {
+                --len;
             }
-            if (event->mask & IN_IGNORED) {
-                // Causes bug #207361 with kernels 2.6.31 and 2.6.32!
-                //e->wd = -1;
+            if (len && isNoisyFile(event->name)) {
+                continue;
             }
-            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
-                Entry *sub_entry = e->findSubEntry(tpath);
 
-                if (s_verboseDebug) {
-                    qCDebug(KDIRWATCH) << "-->got CREATE signal for" << (tpath) << "sub_entry=" << sub_entry;
-                    qCDebug(KDIRWATCH) << *e;
-                }
+            const QString name = len ? QFile::decodeName(QByteArray(event->name, len)) : QString();
+            if (!events.isEmpty() && events.last().wd == event->wd &&
+                    events.last().mask == event->mask && events.last().name == name) {
+                continue;
+            }
+            events.append({event->wd, event->mask, name});
+        }
 
-                // The code below is very similar to the one in checkFAMEvent...
-                if (sub_entry) {
-                    // We were waiting for this new file/dir to be created
-                    sub_entry->dirty = true;
-                    rescan_timer.start(0); // process this asap, to start watching that dir
-                } else if (e->isDir && !e->m_clients.empty()) {
-                    const QList<const Client *> clients = e->inotifyClientsForFileOrDir(isDir);
-                    // See discussion in addEntry for why we don't addEntry for individual
-                    // files in WatchFiles mode with inotify.
-                    if (isDir) {
-                        for (const Client *client : clients) {
-                            addEntry(client->instance, tpath, nullptr, isDir,
-                                        isDir ? client->m_watchModes : KDirWatch::WatchDirOnly);
-                        }
-                    }
-                    if (!clients.isEmpty()) {
-                        emitEvent(e, Created, tpath);
-                        qCDebug(KDIRWATCH).nospace() << clients.count() << " instance(s) monitoring the new "
-                                            << (isDir ? "dir " : "file ") << tpath;
-                    }
-                    e->m_pendingFileChanges.append(e->path);
-                    if (!rescan_timer.isActive()) {
-                        rescan_timer.start(m_PollInterval);    // singleshot
-                    }
-                }
+        if (events.isEmpty()) {
+            continue;
+        }
+
+        bool wasEmpty;
+        {
+            QMutexLocker locker(&m_inotifyQueueMutex);
+            wasEmpty = m_inotifyQueue.isEmpty();
+            if (wasEmpty) {
+                m_inotifyQueue.swap(events);
+            } else {
+                m_inotifyQueue += events;
             }
-            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
-                if (s_verboseDebug) {
-                    qCDebug(KDIRWATCH) << "-->got DELETE signal for" << tpath;
-                }
-                if ((e->isDir) && (!e->m_clients.empty())) {
-                    // A file in this directory has been removed.  It wasn't an explicitly
-                    // watched file as it would have its own watch descriptor, so
-                    // no addEntry/ removeEntry bookkeeping should be required.  Emit
-                    // the event immediately if any clients are interested.
-                    KDirWatch::WatchModes flag = isDir ? KDirWatch::WatchSubDirs : KDirWatch::WatchFiles;
-                    int counter = 0;
-                    for (const Client &client : e->m_clients) {
-                        if (client.m_watchModes & flag) {
-                            counter++;
-                        }
-                    }
-                    if (counter != 0) {
-                        emitEvent(e, Deleted, tpath);
-                    }
+        }
+        events.clear();
+
+        // Events queued before are still waiting to be handled
+        if (wasEmpty) {
+            QMetaObject::invokeMethod(this, [this]() { inotifyEventsQueued(); }, Qt::QueuedConnection);
+        }
+    }
+}
+
+// Handles the events queued by readINotifyEvents()
+void KDirWatchPrivate::inotifyEventsQueued()
+{
+    QVector<INotifyEvent> events;
+    {
+        QMutexLocker locker(&m_inotifyQueueMutex);
+        events.swap(m_inotifyQueue);
+    }
+
+    for (const INotifyEvent &event : qAsConst(events)) {
+        Entry *e = m_inotify_wd_to_entry.value(event.wd);
+        if (e) {
+            processINotifyEvent(e, event.mask, event.name);
+        }
+    }
+}
+
+// Handles an inotify event for the file or directory watched by <e>, or for
+// the file or directory named <path> in the watched directory. fanotify
+// events end up here as well.
+void KDirWatchPrivate::processINotifyEvent(Entry *e, quint32 mask, const QString &path)
+{
+    // Is set to true if the new event is a directory, false otherwise. This prevents a stat call in clientsForFileOrDir
+    const bool isDir = (mask & (IN_ISDIR));
+
+    const bool wasDirty = e->dirty;
+    e->dirty = true;
+
+    const QString tpath = e->path + QLatin1Char('/') + path;
+
+    if (s_verboseDebug) {
+        qCDebug(KDIRWATCH).nospace() << "got event 0x" << qPrintable(QString::number(mask, 16)) << " for " << e->path;
+    }
+
+    if (mask & IN_DELETE_SELF) {
+        if (s_verboseDebug) {
+            qCDebug(KDIRWATCH) << "-->got deleteself signal for" << e->path;
+        }
+        e->m_status = NonExistent;
+        m_inotify_wd_to_entry.remove(e->wd);
+        e->wd = -1;
+#if HAVE_SYS_FANOTIFY_H
+        removeFANotifyHandle(e);
+#endif
+        e->m_ctime = invalid_ctime;
+        emitEvent(e, Deleted, e->path);
+        // If the parent dir was already watched, tell it something changed
+        Entry *parentEntry = entry(e->parentDirectory());
+        if (parentEntry) {
+            parentEntry->dirty = true;
+        }
+        // Add entry to parent dir to notice if the entry gets recreated
+        addEntry(nullptr, e->parentDirectory(), e, true /*isDir*/);
+    }
+    if (mask & IN_IGNORED) {
+        // Causes bug #207361 with kernels 2.6.31 and 2.6.32!
+        //e->wd = -1;
+    }
+    if (mask & (IN_CREATE | IN_MOVED_TO)) {
+        Entry *sub_entry = e->findSubEntry(tpath);
+
+        if (s_verboseDebug) {
+            qCDebug(KDIRWATCH) << "-->got CREATE signal for" << (tpath) << "sub_entry=" << sub_entry;
+            qCDebug(KDIRWATCH) << *e;
+        }
+
+        // The code below is very similar to the one in checkFAMEvent...
+        if (sub_entry) {
+            // We were waiting for this new file/dir to be created
+            sub_entry->dirty = true;
+            rescan_timer.start(0); // process this asap, to start watching that dir
+        } else if (e->isDir && !e->m_clients.empty()) {
+            const QList<const Client *> clients = e->inotifyClientsForFileOrDir(isDir);
+            // See discussion in addEntry for why we don't addEntry for individual
+            // files in WatchFiles mode with inotify.
+            if (isDir) {
+                for (const Client *client : clients) {
+                    addEntry(client->instance, tpath, nullptr, isDir,
+                                isDir ? client->m_watchModes : KDirWatch::WatchDirOnly);
                 }
             }
-            if (event->mask & (IN_MODIFY | IN_ATTRIB)) {
-                if ((e->isDir) && (!e->m_clients.empty())) {
-                    if (s_verboseDebug) {
-                        qCDebug(KDIRWATCH) << "-->got MODIFY signal for" << (tpath);
-                    }
-                    // A file in this directory has been changed.  No
-                    // addEntry/ removeEntry bookkeeping should be required.
-                    // Add the path to the list of pending file changes if
-                    // there are any interested clients.
-                    //QT_STATBUF stat_buf;
-                    //QByteArray tpath = QFile::encodeName(e->path+'/'+path);
-                    //QT_STAT(tpath, &stat_buf);
-                    //bool isDir = S_ISDIR(stat_buf.st_mode);
-
-                    // The API doc is somewhat vague as to whether we should emit
-                    // dirty() for implicitly watched files when WatchFiles has
-                    // not been specified - we'll assume they are always interested,
-                    // regardless.
-                    // Don't worry about duplicates for the time
-                    // being; this is handled in slotRescan.
-                    e->m_pendingFileChanges.append(tpath);
-                    // Avoid stat'ing the directory if only an entry inside it changed.
-                    e->dirty = (wasDirty || (path.isEmpty() && (event->mask & IN_ATTRIB)));
-                }
+            if (!clients.isEmpty()) {
+                emitEvent(e, Created, tpath);
+                qCDebug(KDIRWATCH).nospace() << clients.count() << " instance(s) monitoring the new "
+                                    << (isDir ? "dir " : "file ") << tpath;
             }
-
+            e->m_pendingFileChanges.append(e->path);
             if (!rescan_timer.isActive()) {
                 rescan_timer.start(m_PollInterval);    // singleshot
             }
         }
-        if (bytesAvailable > 0) {
-            // copy partial event to beginning of buffer
-            memmove(buf, &buf[offsetCurrent], bytesAvailable);
-            offsetStartRead = bytesAvailable;
+    }
+    if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (s_verboseDebug) {
+            qCDebug(KDIRWATCH) << "-->got DELETE signal for" << tpath;
+        }
+        if ((e->isDir) && (!e->m_clients.empty())) {
+            // A file in this directory has been removed.  It wasn't an explicitly
+            // watched file as it would have its own watch descriptor, so
+            // no addEntry/ removeEntry bookkeeping should be required.  Emit
+            // the event immediately if any clients are interested.
+            KDirWatch::WatchModes flag = isDir ? KDirWatch::WatchSubDirs : KDirWatch::WatchFiles;
+            int counter = 0;
+            for (const Client &client : e->m_clients) {
+                if (client.m_watchModes & flag) {
+                    counter++;
+                }
+            }
+            if (counter != 0) {
+                emitEvent(e, Deleted, tpath);
+            }
+        }
+    }
+    if (mask & (IN_MODIFY | IN_ATTRIB)) {
+        if ((e->isDir) && (!e->m_clients.empty())) {
+            if (s_verboseDebug) {
+                qCDebug(KDIRWATCH) << "-->got MODIFY signal for" << (tpath);
+            }
+            // A file in this directory has been changed.  No
+            // addEntry/ removeEntry bookkeeping should be required.
+            // Add the path to the list of pending file changes if
+            // there are any interested clients.
+            //QT_STATBUF stat_buf;
+            //QByteArray tpath = QFile::encodeName(e->path+'/'+path);
+            //QT_STAT(tpath, &stat_buf);
+            //bool isDir = S_ISDIR(stat_buf.st_mode);
+
+            // The API doc is somewhat vague as to whether we should emit
+            // dirty() for implicitly watched files when WatchFiles has
+            // not been specified - we'll assume they are always interested,
+            // regardless.
+            // Don't worry about duplicates for the time
+            // being; this is handled in slotRescan.
+            e->m_pendingFileChanges.append(tpath);
+            // Avoid stat'ing the directory if only an entry inside it changed.
+            e->dirty = (wasDirty || (path.isEmpty() && (mask & IN_ATTRIB)));
+        }
+    }
+
+    if (!rescan_timer.isActive()) {
+        rescan_timer.start(m_PollInterval);    // singleshot
+    }
+}
+#endif
+
+void KDirWatchPrivate::fanotifyEventReceived()
+{
+#if HAVE_SYS_FANOTIFY_H
+    if (!supports_fanotify) {
+        return;
+    }
+
+    alignas(struct fanotify_event_metadata) char buf[8192];
+    ssize_t bytesAvailable;
+    // fanotify only ever returns whole events
+    while ((bytesAvailable = read(m_fanotify_fd, buf, sizeof(buf))) > 0) {
+        struct fanotify_event_metadata *event = reinterpret_cast<fanotify_event_metadata *>(buf);
+        for (; FAN_EVENT_OK(event, bytesAvailable); event = FAN_EVENT_NEXT(event, bytesAvailable)) {
+            if (event->vers != FANOTIFY_METADATA_VERSION) {
+                qCWarning(KCOREADDONS_DEBUG) << "fanotify event version mismatch, got" << event->vers;
+                return;
+            }
+
+            if (event->mask & FAN_Q_OVERFLOW) {
+                qCDebug(KDIRWATCH) << "fanotify queue overflowed, rescanning everything";
+                rescan_all = true;
+                rescan_timer.start(0);
+                continue;
+            }
+
+            // The directory the event happened in is identified by a file
+            // handle followed by the name of the file or directory, or "."
+            // if it happened to the directory itself.
+            const char *info = reinterpret_cast<const char *>(event) + event->metadata_len;
+            const char *const end = reinterpret_cast<const char *>(event) + event->event_len;
+            while (info + sizeof(struct fanotify_event_info_header) <= end) {
+                const auto *header = reinterpret_cast<const fanotify_event_info_header *>(info);
+                if (header->len == 0 || info + header->len > end) {
+                    break;
+                }
+
+                if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || header->info_type == FAN_EVENT_INFO_TYPE_DFID) {
+                    const auto *fid = reinterpret_cast<const fanotify_event_info_fid *>(info);
+                    const auto *handle = reinterpret_cast<const struct file_handle *>(fid->handle);
+                    const char *name = header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME
+                                       ? reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes)
+                                       : ".";
+                    processFANotifyEvent(event->mask, fanotifyHandleKey(&fid->fsid, handle), name);
+                }
+
+                info += header->len;
+            }
         }
     }
 #endif
@@ -555,6 +880,7 @@ QDebug operator<<(QDebug debug, const KDirWatchPrivate::Entry &entry)
     debug << ", using " << ((entry.m_mode == KDirWatchPrivate::FAMMode) ? "FAM" :
                             (entry.m_mode == KDirWatchPrivate::INotifyMode) ? "INotify" :
                             (entry.m_mode == KDirWatchPrivate::QFSWatchMode) ? "QFSWatch" :
+                            (entry.m_mode == KDirWatchPrivate::FANotifyMode) ? "FANotify" :
                             (entry.m_mode == KDirWatchPrivate::StatMode) ? "Stat" : "Unknown Method");
 #if HAVE_SYS_INOTIFY_H
     if (entry.m_mode == KDirWatchPrivate::INotifyMode) {
@@ -729,6 +1055,121 @@ bool KDirWatchPrivate::useINotify(Entry *e)
     return false;
 }
 #endif
+#if HAVE_SYS_FANOTIFY_H
+// setup fanotify notification, returns false if not possible
+bool KDirWatchPrivate::useFANotify(Entry *e)
+{
+    // the inotify bookkeeping must not mistake this entry for one of its own
+    e->wd = -1;
+    e->dirty = false;
+
+    if (!supports_fanotify) {
+        return false;
+    }
+
+    e->m_mode = FANotifyMode;
+
+    if (e->m_status == NonExistent) {
+        addEntry(nullptr, e->parentDirectory(), e, true);
+        return true;
+    }
+
+    // Events for a file are reported for the directory it is in, like
+    // those for the files in a watched directory.
+    const QByteArray path = QFile::encodeName(e->isDir ? e->path : e->parentDirectory());
+    const QByteArray handle = fanotifyHandleKey(path);
+    if (handle.isEmpty()) {
+        qCDebug(KDIRWATCH) << "fanotify can't identify" << e->path << ":" << strerror(errno);
+        return false;
+    }
+
+    const QByteArray fsid = handle.left(sizeof(__kernel_fsid_t));
+    FANotifyMark &mark = m_fanotify_marks[fsid];
+    if (mark.entries == 0) {
+        if (fanotify_mark(m_fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, s_fanotifyMask,
+                          AT_FDCWD, path.constData()) != 0) {
+            qCDebug(KDIRWATCH) << "fanotify failed for monitoring" << e->path << ":" << strerror(errno);
+            m_fanotify_marks.remove(fsid);
+            return false;
+        }
+        mark.path = path;
+        qCDebug(KDIRWATCH) << "fanotify now monitoring the filesystem of" << e->path;
+    }
+    ++mark.entries;
+
+    e->m_fanotifyHandle = handle;
+    m_fanotify_handle_to_entry.insert(handle, e);
+    if (s_verboseDebug) {
+        qCDebug(KDIRWATCH) << "fanotify successfully used for monitoring" << e->path;
+    }
+    return true;
+}
+
+void KDirWatchPrivate::removeFANotifyHandle(Entry *e)
+{
+    if (e->m_fanotifyHandle.isEmpty()) {
+        return;
+    }
+
+    m_fanotify_handle_to_entry.remove(e->m_fanotifyHandle, e);
+    const QByteArray fsid = e->m_fanotifyHandle.left(sizeof(__kernel_fsid_t));
+    e->m_fanotifyHandle.clear();
+
+    auto it = m_fanotify_marks.find(fsid);
+    if (it != m_fanotify_marks.end() && --it->entries == 0) {
+        // If the path is gone by now, the mark stays until the next one on
+        // the same filesystem replaces it; events for it are ignored anyway.
+        (void) fanotify_mark(m_fanotify_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, s_fanotifyMask,
+                             AT_FDCWD, it->path.constData());
+        qCDebug(KDIRWATCH) << "fanotify stopped monitoring the filesystem of" << QFile::decodeName(it->path);
+        m_fanotify_marks.erase(it);
+    }
+}
+
+// Passes an event for the file or directory <name> in the directory
+// identified by <handle> on to the entries concerned by it, if any.
+void KDirWatchPrivate::processFANotifyEvent(quint64 mask, const QByteArray &handle, const char *name)
+{
+    auto it = m_fanotify_handle_to_entry.constFind(handle);
+    if (it == m_fanotify_handle_to_entry.constEnd()) {
+        return;
+    }
+
+    const bool isSelf = (qstrcmp(name, ".") == 0);
+    if (!isSelf && isNoisyFile(name)) {
+        return;
+    }
+
+    const QString path = isSelf ? QString() : QFile::decodeName(name);
+
+    // Handling an event may add or remove entries
+    QList<Entry *> entries;
+    for (; it != m_fanotify_handle_to_entry.constEnd() && it.key() == handle; ++it) {
+        entries.append(it.value());
+    }
+
+    for (Entry *e : qAsConst(entries)) {
+        if (e->m_fanotifyHandle != handle) {
+            continue;
+        }
+
+        if (e->isDir) {
+            processINotifyEvent(e, mask, path);
+        } else if (!isSelf && path == e->path.midRef(e->path.lastIndexOf(QLatin1Char('/')) + 1)) {
+            // Make this look like an event for a file watched with inotify
+            quint32 fileMask = mask & (IN_MODIFY | IN_ATTRIB);
+            if (mask & (FAN_DELETE | FAN_MOVED_FROM)) {
+                fileMask |= IN_DELETE_SELF;
+            }
+            if (mask & (FAN_CREATE | FAN_MOVED_TO)) {
+                // replaced, which scanEntry notices
+                fileMask |= IN_ATTRIB;
+            }
+            processINotifyEvent(e, fileMask, QString());
+        }
+    }
+}
+#endif
 #if HAVE_QFILESYSTEMWATCHER
 bool KDirWatchPrivate::useQFSWatch(Entry *e)
 {
@@ -781,7 +1222,8 @@ bool KDirWatchPrivate::useStat(Entry *e)
  * this entry needs another entry to watch itself (when notExistent).
  */
 void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path,
-                                Entry *sub_entry, bool isDir, KDirWatch::WatchModes watchModes)
+                                Entry *sub_entry, bool isDir, KDirWatch::WatchModes watchModes,
+                                const WalkedEntry *walked)
 {
     QString path(_path);
     if (path.startsWith(QLatin1String(":/"))) {
@@ -823,8 +1265,12 @@ void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path,
 
     // we have a new path to watch
 
+    // Entries found by addDirRecursive() have been stat'ed already
     QT_STATBUF stat_buf;
-    bool exists = (QT_STAT(QFile::encodeName(path).constData(), &stat_buf) == 0);
+    bool exists = walked || (QT_STAT(QFile::encodeName(path).constData(), &stat_buf) == 0);
+    if (walked) {
+        stat_buf = walked->stat;
+    }
 
     EntryMap::iterator newIt = m_mapEntries.insert(path, Entry());
     // the insert does a copy, so we have to use <e> now
@@ -895,7 +1341,8 @@ void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path,
         return;
     }
 
-    if (exists && e->isDir && (watchModes != KDirWatch::WatchDirOnly)) {
+    // addDirRecursive() adds the contents of walked directories itself
+    if (exists && e->isDir && (watchModes != KDirWatch::WatchDirOnly) && !walked) {
         QFlags<QDir::Filter> filters = QDir::NoDotAndDotDot;
 
         if ((watchModes & KDirWatch::WatchSubDirs) &&
@@ -908,7 +1355,8 @@ void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path,
         }
 
 #if HAVE_SYS_INOTIFY_H
-        if (e->m_mode == INotifyMode || (e->m_mode == UnknownMode && m_preferredMethod == KDirWatch::INotify)) {
+        if (e->m_mode == INotifyMode || e->m_mode == FANotifyMode ||
+                (e->m_mode == UnknownMode && (m_preferredMethod == KDirWatch::INotify || m_preferredMethod == KDirWatch::FANotify))) {
             //qCDebug(KDIRWATCH) << "Ignoring WatchFiles directive - this is implicit with inotify";
             // Placing a watch on individual files is redundant with inotify
             // (inotify gives us WatchFiles functionality "for free") and indeed
@@ -933,6 +1381,314 @@ void KDirWatchPrivate::addEntry(KDirWatch *instance, const QString &_path,
     addWatch(e);
 }
 
+struct KDirWatchPrivate::WalkedEntry {
+    QString path;
+    QT_STATBUF stat;
+};
+
+struct KDirWatchPrivate::RecursiveWalk {
+    KDirWatch *instance = nullptr;
+    QString path;
+    KDirWatch::WatchModes watchModes;
+    // whether files need entries of their own
+    bool withFiles = false;
+    // directories changed since then are listed again once watched
+    time_t startTime = 0;
+    QAtomicInt cancelled;
+    // lists the tree, then checks it for changes, deleted once done
+    QThread *thread = nullptr;
+    QVector<WalkedEntry> entries;
+    int added = 0;
+    // set once the directories changed since being listed are known
+    bool checked = false;
+    QStringList changedDirs;
+};
+
+#ifdef Q_OS_LINUX
+// fstatat(), without mixing up the plain and the large file stat structures
+static bool statAt(int dirFd, const char *name, QT_STATBUF *stat_buf)
+{
+    const int fd = openat(dirFd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    const bool ok = (QT_FSTAT(fd, stat_buf) == 0);
+    QT_CLOSE(fd);
+    return ok;
+}
+
+// Lists the directory tree below <dirFd> with getdents64(), only stat'ing
+// what gets an entry. A directory is read completely before descending
+// into its subdirectories, so all levels share <buffer>.
+static void walkDirectoryTree(int dirFd, const QByteArray &path, KDirWatchPrivate::RecursiveWalk *walk, QByteArray *buffer)
+{
+    QVector<QByteArray> subDirs;
+    long bytesRead;
+    while ((bytesRead = syscall(SYS_getdents64, dirFd, buffer->data(), buffer->size())) > 0) {
+        for (long offset = 0; offset < bytesRead;) {
+            const struct dirent64 *dirent = reinterpret_cast<const struct dirent64 *>(buffer->constData() + offset);
+            offset += dirent->d_reclen;
+
+            const char *name = dirent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            // Not every filesystem reports the type of its entries
+            QT_STATBUF stat_buf;
+            bool isDir = (dirent->d_type == DT_DIR);
+            bool statDone = false;
+            if (dirent->d_type == DT_UNKNOWN) {
+                if (!statAt(dirFd, name, &stat_buf)) {
+                    continue;
+                }
+                isDir = (stat_buf.st_mode & QT_STAT_MASK) == QT_STAT_DIR;
+                statDone = true;
+            }
+
+            if (isDir) {
+                subDirs.append(QByteArray(name));
+            } else if (walk->withFiles && (statDone || statAt(dirFd, name, &stat_buf))) {
+                walk->entries.append({QFile::decodeName(path + '/' + name), stat_buf});
+            }
+        }
+    }
+
+    for (const QByteArray &name : qAsConst(subDirs)) {
+        if (walk->cancelled.load()) {
+            return;
+        }
+
+        const int fd = openat(dirFd, name.constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+
+        QT_STATBUF stat_buf;
+        if (QT_FSTAT(fd, &stat_buf) == 0) {
+            const QByteArray subPath = path + '/' + name;
+            walk->entries.append({QFile::decodeName(subPath), stat_buf});
+            walkDirectoryTree(fd, subPath, walk, buffer);
+        }
+        QT_CLOSE(fd);
+    }
+}
+#endif
+
+// Lists the files and directories below walk->path, runs in walk->thread.
+static void walkDirectoryTree(KDirWatchPrivate::RecursiveWalk *walk)
+{
+#ifdef Q_OS_LINUX
+    const QByteArray path = QFile::encodeName(walk->path);
+    const int fd = QT_OPEN(path.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    QByteArray buffer(64 * 1024, Qt::Uninitialized);
+    walkDirectoryTree(fd, path == "/" ? QByteArray() : path, walk, &buffer);
+    QT_CLOSE(fd);
+#else
+    QDir::Filters filters = QDir::Dirs | QDir::NoDotAndDotDot | QDir::Hidden | QDir::System;
+    if (walk->withFiles) {
+        filters |= QDir::Files;
+    }
+
+    QDirIterator it(walk->path, filters, QDirIterator::Subdirectories);
+    while (it.hasNext() && !walk->cancelled.load()) {
+        const QString path = it.next();
+        QT_STATBUF stat_buf;
+        if (QT_LSTAT(QFile::encodeName(path).constData(), &stat_buf) == 0) {
+            walk->entries.append({path, stat_buf});
+        }
+    }
+#endif
+}
+
+// Finds the directories changed since walkDirectoryTree() stat'ed them,
+// runs in walk->thread once all of them are watched.
+static void findChangedDirs(KDirWatchPrivate::RecursiveWalk *walk)
+{
+    for (const KDirWatchPrivate::WalkedEntry &walked : qAsConst(walk->entries)) {
+        if (walk->cancelled.load()) {
+            return;
+        }
+        if ((walked.stat.st_mode & QT_STAT_MASK) != QT_STAT_DIR) {
+            continue;
+        }
+
+        // Timestamps may only be precise to the second, so directories
+        // changed around the time of the walk are listed again as well.
+        QT_STATBUF stat_buf;
+        if (QT_STAT(QFile::encodeName(walked.path).constData(), &stat_buf) == 0 &&
+                (stat_buf.st_mtime != walked.stat.st_mtime || stat_buf.st_ctime != walked.stat.st_ctime ||
+                 qMax(stat_buf.st_mtime, stat_buf.st_ctime) >= walk->startTime - 1)) {
+            walk->changedDirs.append(walked.path);
+        }
+    }
+    walk->checked = true;
+}
+
+static bool isWatchedBy(const KDirWatchPrivate::Entry *e, const KDirWatch *instance)
+{
+    for (const KDirWatchPrivate::Client &client : e->m_clients) {
+        if (client.instance == instance) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Watches the directory <_path> right away, and lists the tree below it in
+ * a separate thread. The entries found are then added by addWalkedEntries().
+ */
+void KDirWatchPrivate::addEntryRecursive(KDirWatch *instance, const QString &_path,
+                                         KDirWatch::WatchModes watchModes)
+{
+    watchModes |= KDirWatch::WatchSubDirs;
+
+    QString path(_path);
+    if (path.length() > 1 && path.endsWith(QLatin1Char('/'))) {
+        path.chop(1);
+    }
+
+    WalkedEntry root;
+    root.path = path;
+    if (QDir::isRelativePath(path) ||
+            QT_STAT(QFile::encodeName(path).constData(), &root.stat) != 0 ||
+            (root.stat.st_mode & QT_STAT_MASK) != QT_STAT_DIR) {
+        addEntry(instance, path, nullptr, true, watchModes);
+        return;
+    }
+
+    // Watching the directory before listing it makes sure that nothing
+    // created in it meanwhile is missed.
+    addEntry(instance, path, nullptr, true, watchModes, &root);
+    Entry *e = entry(path);
+    if (!e || e->m_mode == UnknownMode) {
+        return;
+    }
+
+    QSharedPointer<RecursiveWalk> walk(new RecursiveWalk);
+    walk->instance = instance;
+    walk->path = path;
+    walk->watchModes = watchModes;
+    // See addEntry() for why inotify and fanotify don't need entries for files
+    walk->withFiles = (watchModes & KDirWatch::WatchFiles) && e->m_mode != INotifyMode && e->m_mode != FANotifyMode;
+    walk->startTime = time(nullptr);
+    walk->thread = QThread::create([this, walk]() {
+        walkDirectoryTree(walk.data());
+        QMetaObject::invokeMethod(this, [this, walk]() { recursiveWalkFinished(walk); }, Qt::QueuedConnection);
+    });
+    m_recursiveWalks.append(walk);
+    walk->thread->start();
+
+    if (s_verboseDebug) {
+        qCDebug(KDIRWATCH) << "Listing" << path << "to watch it recursively";
+    }
+}
+
+void KDirWatchPrivate::recursiveWalkFinished(const QSharedPointer<RecursiveWalk> &walk)
+{
+    walk->thread->wait();
+    delete walk->thread;
+    walk->thread = nullptr;
+
+    if (walk->cancelled.load()) {
+        m_recursiveWalks.removeOne(walk);
+        return;
+    }
+
+    if (walk->checked) {
+        listChangedDirs(walk);
+        return;
+    }
+
+    qCDebug(KDIRWATCH) << "Found" << walk->entries.size() << "entries to watch below" << walk->path;
+    addWalkedEntries(walk);
+}
+
+/* Adds the entries found by a recursive walk, a limited number at a time to
+ * keep the event loop running. Once all are watched, the directories are
+ * checked for changes since they were listed in a separate thread again.
+ */
+void KDirWatchPrivate::addWalkedEntries(const QSharedPointer<RecursiveWalk> &walk)
+{
+    if (walk->cancelled.load()) {
+        return;
+    }
+
+    const int batchEnd = qMin(walk->added + 1000, walk->entries.size());
+    for (; walk->added < batchEnd; ++walk->added) {
+        const WalkedEntry &walked = walk->entries.at(walk->added);
+        const bool isDir = (walked.stat.st_mode & QT_STAT_MASK) == QT_STAT_DIR;
+        addEntry(walk->instance, walked.path, nullptr, isDir,
+                 isDir ? walk->watchModes : KDirWatch::WatchDirOnly, &walked);
+    }
+
+    if (walk->added < walk->entries.size()) {
+        QTimer::singleShot(0, this, [this, walk]() { addWalkedEntries(walk); });
+        return;
+    }
+
+    walk->thread = QThread::create([this, walk]() {
+        findChangedDirs(walk.data());
+        QMetaObject::invokeMethod(this, [this, walk]() { recursiveWalkFinished(walk); }, Qt::QueuedConnection);
+    });
+    walk->thread->start();
+}
+
+/* Lists the directories changed after the walk listed them again, to add
+ * anything created before they were watched.
+ */
+void KDirWatchPrivate::listChangedDirs(const QSharedPointer<RecursiveWalk> &walk)
+{
+    QDir::Filters filters = QDir::Dirs | QDir::NoDotAndDotDot | QDir::Hidden | QDir::System;
+    if (walk->withFiles) {
+        filters |= QDir::Files;
+    }
+    for (const QString &dir : qAsConst(walk->changedDirs)) {
+        const QFileInfoList contents = QDir(dir).entryInfoList(filters);
+        for (const QFileInfo &fileInfo : contents) {
+            const Entry *e = entry(fileInfo.absoluteFilePath());
+            if (e && isWatchedBy(e, walk->instance)) {
+                continue;
+            }
+            // treat symlinks as files--don't follow them.
+            const bool isDir = fileInfo.isDir() && !fileInfo.isSymLink();
+            addEntry(walk->instance, fileInfo.absoluteFilePath(), nullptr, isDir,
+                     isDir ? walk->watchModes : KDirWatch::WatchDirOnly);
+        }
+    }
+
+    qCDebug(KDIRWATCH) << "Now watching" << walk->path << "recursively, listed"
+                       << walk->changedDirs.size() << "changed directories again";
+    m_recursiveWalks.removeOne(walk);
+}
+
+// Stops adding the directory trees <path>, or all, for <instance>
+void KDirWatchPrivate::cancelRecursiveWalks(KDirWatch *instance, const QString &_path)
+{
+    QString path(_path);
+    if (path.length() > 1 && path.endsWith(QLatin1Char('/'))) {
+        path.chop(1);
+    }
+
+    auto it = m_recursiveWalks.begin();
+    while (it != m_recursiveWalks.end()) {
+        const QSharedPointer<RecursiveWalk> &walk = *it;
+        if (walk->instance == instance && (path.isEmpty() || walk->path == path)) {
+            walk->cancelled.store(1);
+            // Walks still listing are removed once their thread is done
+            if (!walk->thread) {
+                it = m_recursiveWalks.erase(it);
+                continue;
+            }
+        }
+        ++it;
+    }
+}
+
 void KDirWatchPrivate::addWatch(Entry *e)
 {
     // If the watch is on a network filesystem use the nfsPreferredMethod as the
@@ -959,6 +1715,9 @@ void KDirWatchPrivate::addWatch(Entry *e)
 #if HAVE_SYS_INOTIFY_H
     case KDirWatch::INotify: entryAdded = useINotify(e); break;
 #endif
+#if HAVE_SYS_FANOTIFY_H
+    case KDirWatch::FANotify: entryAdded = useFANotify(e); break;
+#endif
 #if HAVE_QFILESYSTEMWATCHER
     case KDirWatch::QFSWatch: entryAdded = useQFSWatch(e); break;
 #endif
@@ -1005,6 +1764,11 @@ void KDirWatchPrivate::removeWatch(Entry *e)
         }
     }
 #endif
+#if HAVE_SYS_FANOTIFY_H
+    if (e->m_mode == FANotifyMode) {
+        removeFANotifyHandle(e);
+    }
+#endif
 #if HAVE_QFILESYSTEMWATCHER
     if (e->m_mode == QFSWatchMode && fsWatcher) {
         if (s_verboseDebug) {
@@ -1074,9 +1838,12 @@ void KDirWatchPrivate::removeEntry(KDirWatch *instance,
                            << " for " << (sub_entry ? sub_entry->path : QString())
                            << " [" << (instance ? instance->objectName() : QString()) << "]";
     }
-    QString p = e->path; // take a copy, QMap::remove takes a reference and deletes, since e points into the map
+    QString p = e->path; // take a copy, QHash::remove takes a reference and deletes, since e points into the map
 #if HAVE_SYS_INOTIFY_H
     m_inotify_wd_to_entry.remove(e->wd);
+#endif
+#if HAVE_SYS_FANOTIFY_H
+    removeFANotifyHandle(e);
 #endif
     m_mapEntries.remove(p); // <e> not valid any more
 }
@@ -1088,6 +1855,9 @@ void KDirWatchPrivate::removeEntries(KDirWatch *instance)
 {
     int minfreq = 3600000;
 
+    cancelRecursiveWalks(instance);
+    m_eventBatches.remove(instance);
+
     QStringList pathList;
     // put all entries where instance is a client in list
     EntryMap::Iterator it = m_mapEntries.begin();
@@ -1223,9 +1993,12 @@ void KDirWatchPrivate::startScan(KDirWatch *instance,
         resetList(instance, skippedToo);
     }
 
-    EntryMap::Iterator it = m_mapEntries.begin();
-    for (; it != m_mapEntries.end(); ++it) {
-        restartEntryScan(instance, &(*it), notify);
+    // restartEntryScan() can remove other entries
+    const QStringList paths = m_mapEntries.keys();
+    for (const QString &path : paths) {
+        if (Entry *e = entry(path)) {
+            restartEntryScan(instance, e, notify);
+        }
     }
 
     // timer should still be running when in polling mode
@@ -1255,7 +2028,7 @@ int KDirWatchPrivate::scanEntry(Entry *e)
         return NoChange;
     }
 
-    if (e->m_mode == FAMMode || e->m_mode == INotifyMode) {
+    if (e->m_mode == FAMMode || e->m_mode == INotifyMode || e->m_mode == FANotifyMode) {
         // we know nothing has changed, no need to stat
         if (!e->dirty) {
             return NoChange;
@@ -1399,6 +2172,14 @@ void KDirWatchPrivate::emitEvent(Entry *e, int event, const QString &fileName)
             continue;
         }
 
+        if (!m_eventBatches.isEmpty()) {
+            auto batch = m_eventBatches.find(c.instance);
+            if (batch != m_eventBatches.end() && batch->delay >= 0) {
+                addBatchedEvent(c.instance, *batch, path, event);
+                continue;
+            }
+        }
+
         // Emit the signals delayed, to avoid unexpected re-entrance from the slots (#220153)
 
         if (event & Deleted) {
@@ -1416,6 +2197,77 @@ void KDirWatchPrivate::emitEvent(Entry *e, int event, const QString &fileName)
     }
 }
 
+void KDirWatchPrivate::setBatchDelay(KDirWatch *instance, int msec)
+{
+    if (msec >= 0) {
+        m_eventBatches[instance].delay = msec;
+        return;
+    }
+
+    // Changes collected already are still delivered
+    auto batch = m_eventBatches.find(instance);
+    if (batch != m_eventBatches.end()) {
+        batch->delay = msec;
+        if (!batch->scheduled) {
+            m_eventBatches.erase(batch);
+        }
+    }
+}
+
+/* Merges <event> into the changes to <path> in <batch>. Like in emitEvent(),
+ * a deletion in <event> happened before a creation or change.
+ */
+void KDirWatchPrivate::addBatchedEvent(KDirWatch *instance, EventBatch &batch, const QString &path, int event)
+{
+    const bool exists = (event & (Created | Changed)) || !(event & Deleted);
+
+    auto it = batch.indexes.constFind(path);
+    if (it == batch.indexes.constEnd()) {
+        const bool existedBefore = (event & Deleted) || !(event & Created);
+        batch.indexes.insert(path, batch.changes.size());
+        batch.changes.append({path, existedBefore, exists});
+    } else {
+        batch.changes[*it].exists = exists;
+    }
+
+    if (!batch.scheduled) {
+        batch.scheduled = true;
+        // Delivered delayed like the single signals, and not at all once <instance> is gone
+        QTimer::singleShot(batch.delay, instance, [this, instance]() { emitBatchedEvents(instance); });
+    }
+}
+
+void KDirWatchPrivate::emitBatchedEvents(KDirWatch *instance)
+{
+    auto batch = m_eventBatches.find(instance);
+    if (batch == m_eventBatches.end()) {
+        return;
+    }
+
+    QVector<KDirWatch::Change> changes;
+    changes.reserve(batch->changes.size());
+    for (const BatchedChange &change : qAsConst(batch->changes)) {
+        if (change.existedBefore) {
+            changes.append({change.path, change.exists ? KDirWatch::Dirty : KDirWatch::Deleted});
+        } else if (change.exists) {
+            changes.append({change.path, KDirWatch::Created});
+        }
+        // created and deleted again: nothing to report
+    }
+
+    batch->changes.clear();
+    batch->indexes.clear();
+    batch->scheduled = false;
+    if (batch->delay < 0) {
+        m_eventBatches.erase(batch);
+    }
+
+    if (!changes.isEmpty()) {
+        qCDebug(KDIRWATCH) << instance->objectName() << "emitting" << changes.size() << "batched changes";
+        emit instance->changesBatched(changes);
+    }
+}
+
 // Remove entries which were marked to be removed
 void KDirWatchPrivate::slotRemoveDelayed()
 {
@@ -1465,7 +2317,7 @@ void KDirWatchPrivate::slotRescan()
         // propagate dirty flag to dependent entries (e.g. file watches)
         it = m_mapEntries.begin();
         for (; it != m_mapEntries.end(); ++it)
-            if (((*it).m_mode == INotifyMode || (*it).m_mode == QFSWatchMode) && (*it).dirty) {
+            if (((*it).m_mode == INotifyMode || (*it).m_mode == FANotifyMode || (*it).m_mode == QFSWatchMode) && (*it).dirty) {
                 (*it).propagate_dirty();
             }
     }
@@ -1474,10 +2326,15 @@ void KDirWatchPrivate::slotRescan()
     QList<Entry *> cList;
 #endif
 
-    it = m_mapEntries.begin();
-    for (; it != m_mapEntries.end(); ++it) {
+    // Entries are only removed once we're done, but some get added below
+    QVector<Entry *> entries;
+    entries.reserve(m_mapEntries.size());
+    for (it = m_mapEntries.begin(); it != m_mapEntries.end(); ++it) {
+        entries.append(&(*it));
+    }
+
+    for (Entry *entry : qAsConst(entries)) {
         // we don't check invalid entries (i.e. remove delayed)
-        Entry *entry = &(*it);
         if (!entry->isValid()) {
             continue;
         }
@@ -1490,6 +2347,7 @@ void KDirWatchPrivate::slotRescan()
         switch (entry->m_mode) {
 #if HAVE_SYS_INOTIFY_H
         case INotifyMode:
+        case FANotifyMode:
             if (ev == Deleted) {
                 if (s_verboseDebug) {
                     qCDebug(KDIRWATCH) << "scanEntry says" << entry->path << "was deleted";
@@ -1499,7 +2357,11 @@ void KDirWatchPrivate::slotRescan()
                 if (s_verboseDebug) {
                     qCDebug(KDIRWATCH) << "scanEntry says" << entry->path << "was created. wd=" << entry->wd;
                 }
-                if (entry->wd < 0) {
+                bool watched = entry->wd >= 0;
+#if HAVE_SYS_FANOTIFY_H
+                watched = watched || !entry->m_fanotifyHandle.isEmpty();
+#endif
+                if (!watched) {
                     cList.append(entry);
                     addWatch(entry);
                 }
@@ -1590,12 +2452,16 @@ void KDirWatchPrivate::famEventReceived()
             delete sn; sn = nullptr;
 
             // Replace all FAMMode entries with INotify/Stat
+            // (addWatch() can add entries, so don't iterate the map itself)
+            QVector<Entry *> famEntries;
             EntryMap::Iterator it = m_mapEntries.begin();
             for (; it != m_mapEntries.end(); ++it)
                 if ((*it).m_mode == FAMMode && !(*it).m_clients.empty()) {
-                    Entry *e = &(*it);
-                    addWatch(e);
+                    famEntries.append(&(*it));
                 }
+            for (Entry *e : qAsConst(famEntries)) {
+                addWatch(e);
+            }
         } else {
             checkFAMEvent(&fe);
         }
@@ -1863,6 +2729,8 @@ KDirWatch::KDirWatch(QObject *parent)
     if (counter == 1) { // very first KDirWatch instance
         // Must delete QFileSystemWatcher before qApp is gone - bug 261541
         qAddPostRoutine(postRoutine_KDirWatch);
+        // For queued connections to changesBatched() and QSignalSpy
+        qRegisterMetaType<QVector<KDirWatch::Change>>();
     }
 }
 
@@ -1880,6 +2748,13 @@ void KDirWatch::addDir(const QString &_path, WatchModes watchModes)
     }
 }
 
+void KDirWatch::addDirRecursive(const QString &_path, WatchModes watchModes)
+{
+    if (d) {
+        d->addEntryRecursive(this, _path, watchModes);
+    }
+}
+
 void KDirWatch::addFile(const QString &_path)
 {
     if (!d) {
@@ -1903,6 +2778,7 @@ QDateTime KDirWatch::ctime(const QString &_path) const
 void KDirWatch::removeDir(const QString &_path)
 {
     if (d) {
+        d->cancelRecursiveWalks(this, _path);
         d->removeEntry(this, _path, nullptr);
     }
 }
@@ -1991,6 +2867,18 @@ void KDirWatch::statistics()
     dwp_self.localData()->statistics();
 }
 
+void KDirWatch::setBatchDelay(int msec)
+{
+    if (d) {
+        d->setBatchDelay(this, msec);
+    }
+}
+
+int KDirWatch::batchDelay() const
+{
+    return d ? d->m_eventBatches.value(const_cast<KDirWatch *>(this)).delay : -1;
+}
+
 void KDirWatch::setCreated(const QString &_file)
 {
     qCDebug(KDIRWATCH) << objectName() << "emitting created" << _file;
@@ -2025,6 +2913,12 @@ KDirWatch::Method KDirWatch::internalMethod() const
         }
         break;
 #endif
+#if HAVE_SYS_FANOTIFY_H
+    case KDirWatch::FANotify: if (d->supports_fanotify) {
+            return KDirWatch::FANotify;
+        }
+        break;
+#endif
 #if HAVE_QFILESYSTEMWATCHER
     case KDirWatch::QFSWatch: return KDirWatch::QFSWatch;
 #endif
@@ -21,6 +21,7 @@
 #include <QDateTime>
 #include <QObject>
 #include <QString>
+#include <QVector>
 
 #include <kcoreaddons_export.h>
 
@@ -53,12 +54,15 @@ class KDirWatchPrivate;
  *
  * The implementation uses the INOTIFY functionality on LINUX.
  * Otherwise the FAM service is used, when available.
+ * On request, FANOTIFY is used on LINUX instead, which watches whole
+ * filesystems at once and thus scales to any number of watched directories,
+ * but requires the CAP_SYS_ADMIN capability; without it, INOTIFY is used.
  * As a last resort, a regular polling for change of modification times
  * is done; the polling interval is a global config option:
  * DirWatch/PollInterval and DirWatch/NFSPollInterval for NFS mounted
  * directories.
  * The choice of implementation can be adjusted by the user, with the key
- * [DirWatch] PreferredMethod={Fam|Stat|QFSWatch|inotify}
+ * [DirWatch] PreferredMethod={Fam|Stat|QFSWatch|inotify|FANotify}
  *
  * @see self()
  * @author Sven Radej (in 1998)
@@ -79,6 +83,26 @@ public:
     };
     Q_DECLARE_FLAGS(WatchModes, WatchMode)
 
+    /**
+     * The kinds of changes delivered by changesBatched().
+     * @since 5.64
+     */
+    enum ChangeType {
+        Dirty,   ///< The file or directory was changed, see dirty()
+        Created, ///< The file or directory was created, see created()
+        Deleted  ///< The file or directory was deleted, see deleted()
+    };
+    Q_ENUM(ChangeType)
+
+    /**
+     * A change delivered by changesBatched().
+     * @since 5.64
+     */
+    struct Change {
+        QString path;
+        ChangeType type;
+    };
+
     /**
      * Constructor.
      *
@@ -116,6 +140,28 @@ public:
      */
     void addDir(const QString &path, WatchModes watchModes = WatchDirOnly);
 
+    /**
+     * Adds a directory and all of the directories below it to be watched.
+     *
+     * Unlike addDir() with WatchSubDirs, which lists and adds directories
+     * one after the other, this lists the whole directory tree in a
+     * separate thread and then adds the directories found in bulk, without
+     * blocking the event loop for long. Directories created while the tree
+     * is being listed are watched as well. Symlinks are not followed.
+     *
+     * The directory itself is watched right away, the directories below it
+     * only once they have been listed; contains() returns true for each of
+     * them from then on. If @p path does not exist, this behaves like
+     * addDir().
+     *
+     * @param path the path of the directory tree to watch
+     * @param watchModes watch modes, WatchSubDirs is implied
+     *
+     * @sa addDir()
+     * @since 5.64
+     */
+    void addDirRecursive(const QString &path, WatchModes watchModes = WatchSubDirs);
+
     /**
      * Adds a file to be watched.
      * If it's a symlink to a directory, it watches the symlink itself.
@@ -222,7 +268,11 @@ public:
      */
     static void statistics(); // TODO implement a QDebug operator for KDirWatch instead.
 
-    enum Method { FAM, INotify, Stat, QFSWatch };
+    /**
+     * The methods used to watch for changes.
+     * FANotify is available since 5.64.
+     */
+    enum Method { FAM, INotify, Stat, QFSWatch, FANotify };
     /**
      * Returns the preferred internal method to
      * watch for changes.
@@ -249,6 +299,36 @@ public:
      */
     static bool exists();
 
+    /**
+     * Delivers changes in batches instead of one signal per change.
+     *
+     * Once enabled, the changes to the watched files and directories are
+     * collected for @p msec milliseconds after the first one, and then
+     * delivered together by changesBatched(); dirty(), created() and
+     * deleted() aren't emitted anymore for this instance. With 0, the
+     * changes noticed at the same time are delivered together.
+     *
+     * Several changes to the same path within a batch are merged into one,
+     * which tells how the path changed over the whole batch: created and
+     * then changed is Created, changed and then deleted is Deleted, deleted
+     * and then created again is Dirty, and created and then deleted again
+     * is dropped.
+     *
+     * @param msec the time to collect changes for, or a negative value
+     * to disable batching, which is the default
+     * @see changesBatched()
+     * @since 5.64
+     */
+    void setBatchDelay(int msec);
+
+    /**
+     * Returns the time changes are collected for before being delivered
+     * by changesBatched(), or a negative value if batching is disabled.
+     * @see setBatchDelay()
+     * @since 5.64
+     */
+    int batchDelay() const;
+
 public Q_SLOTS:
 
     /**
@@ -301,11 +381,20 @@ Q_SIGNALS:
      */
     void deleted(const QString &path);
 
+    /**
+     * Emitted instead of dirty(), created() and deleted() when batching
+     * is enabled with setBatchDelay().
+     * @param changes the changes of this batch, in the order they were noticed
+     * @since 5.64
+     */
+    void changesBatched(const QVector<KDirWatch::Change> &changes);
+
 private:
     KDirWatchPrivate *d;
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(KDirWatch::WatchModes)
+Q_DECLARE_METATYPE(KDirWatch::Change)
 
 #endif
 
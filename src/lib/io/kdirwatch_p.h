@@ -36,13 +36,17 @@
 #define HAVE_QFILESYSTEMWATCHER 0
 #endif
 
+#include <QHash>
 #include <QList>
+#include <QMutex>
 #include <QSet>
-#include <QMap>
 #include <QObject>
+#include <QSharedPointer>
 #include <QString>
 #include <QTimer>
+#include <QVector>
 class QSocketNotifier;
+class QThread;
 
 #if HAVE_FAM
 #include <limits.h>
@@ -67,7 +71,7 @@ class KDirWatchPrivate : public QObject
 public:
 
     enum entryStatus { Normal = 0, NonExistent };
-    enum entryMode { UnknownMode = 0, StatMode, INotifyMode, FAMMode, QFSWatchMode };
+    enum entryMode { UnknownMode = 0, StatMode, INotifyMode, FAMMode, QFSWatchMode, FANotifyMode };
     enum { NoChange = 0, Changed = 1, Created = 2, Deleted = 4 };
 
     struct Client {
@@ -155,9 +159,41 @@ public:
         // This will be unused if the Entry is not a directory.
         QList<QString> m_pendingFileChanges;
 #endif
+
+#if HAVE_SYS_FANOTIFY_H
+        // Identifies the directory whose fanotify events concern this entry:
+        // the directory itself, or the parent directory of a file.
+        QByteArray m_fanotifyHandle;
+#endif
     };
 
-    typedef QMap<QString, Entry> EntryMap;
+    // Entries are looked up by path for every event, which a hash does
+    // in constant time. QHash doesn't move its nodes when growing, so
+    // pointers to entries stay valid until they are removed; iterators
+    // don't, so the map mustn't be changed while iterating over it.
+    typedef QHash<QString, Entry> EntryMap;
+
+    // A directory tree being added by KDirWatch::addDirRecursive(), and
+    // the files and directories found in it.
+    struct WalkedEntry;
+    struct RecursiveWalk;
+
+    // The changes to a path since the last batch was delivered
+    struct BatchedChange {
+        QString path;
+        bool existedBefore;
+        bool exists;
+    };
+
+    // Changes collected for a KDirWatch with KDirWatch::setBatchDelay()
+    struct EventBatch {
+        // negative when batching got disabled before delivering these
+        int delay = -1;
+        bool scheduled = false;
+        QVector<BatchedChange> changes;
+        // index of the change to each path in <changes>
+        QHash<QString, int> indexes;
+    };
 
     KDirWatchPrivate();
     ~KDirWatchPrivate();
@@ -165,7 +201,13 @@ public:
     void resetList(KDirWatch *instance, bool skippedToo);
     void useFreq(Entry *e, int newFreq);
     void addEntry(KDirWatch *instance, const QString &_path, Entry *sub_entry,
-                  bool isDir, KDirWatch::WatchModes watchModes = KDirWatch::WatchDirOnly);
+                  bool isDir, KDirWatch::WatchModes watchModes = KDirWatch::WatchDirOnly,
+                  const WalkedEntry *walked = nullptr);
+    void addEntryRecursive(KDirWatch *instance, const QString &path, KDirWatch::WatchModes watchModes);
+    void recursiveWalkFinished(const QSharedPointer<RecursiveWalk> &walk);
+    void addWalkedEntries(const QSharedPointer<RecursiveWalk> &walk);
+    void listChangedDirs(const QSharedPointer<RecursiveWalk> &walk);
+    void cancelRecursiveWalks(KDirWatch *instance, const QString &path = QString());
     void removeEntry(KDirWatch *instance, const QString &path, Entry *sub_entry);
     void removeEntry(KDirWatch *instance, Entry *e, Entry *sub_entry);
     bool stopEntryScan(KDirWatch *instance, Entry *e);
@@ -181,6 +223,9 @@ public:
     Entry *entry(const QString &_path);
     int scanEntry(Entry *e);
     void emitEvent(Entry *e, int event, const QString &fileName = QString());
+    void setBatchDelay(KDirWatch *instance, int msec);
+    void addBatchedEvent(KDirWatch *instance, EventBatch &batch, const QString &path, int event);
+    void emitBatchedEvents(KDirWatch *instance);
 
     static bool isNoisyFile(const char *filename);
 
@@ -190,6 +235,7 @@ public Q_SLOTS:
     void inotifyEventReceived(); // for inotify
     void slotRemoveDelayed();
     void fswEventReceived(const QString &path);  // for QFileSystemWatcher
+    void fanotifyEventReceived(); // for fanotify
 
 public:
     QTimer timer;
@@ -208,6 +254,10 @@ public:
     bool rescan_all;
     QTimer rescan_timer;
 
+    QList<QSharedPointer<RecursiveWalk> > m_recursiveWalks;
+
+    QHash<KDirWatch *, EventBatch> m_eventBatches;
+
 #if HAVE_FAM
     QSocketNotifier *sn;
     FAMConnection fc;
@@ -224,6 +274,42 @@ public:
     QHash<int, Entry *> m_inotify_wd_to_entry;
 
     bool useINotify(Entry *e);
+    void processINotifyEvent(Entry *e, quint32 mask, const QString &path);
+
+    // With KDIRWATCH_INOTIFY_THREAD set, inotify events are read and
+    // decoded by m_inotifyReader, which queues them for this thread.
+    struct INotifyEvent {
+        int wd;
+        quint32 mask;
+        QString name;
+    };
+    QThread *m_inotifyReader;
+    int m_inotifyReaderWakeup[2];
+    QMutex m_inotifyQueueMutex;
+    QVector<INotifyEvent> m_inotifyQueue;
+
+    void startINotifyReader();
+    void stopINotifyReader();
+    void readINotifyEvents();
+    void inotifyEventsQueued();
+#endif
+#if HAVE_SYS_FANOTIFY_H
+    // There is one fanotify mark per watched filesystem, shared by
+    // all of the entries on it.
+    struct FANotifyMark {
+        QByteArray path;
+        int entries = 0;
+    };
+
+    QSocketNotifier *mFanSn;
+    bool supports_fanotify;
+    int m_fanotify_fd;
+    QHash<QByteArray, FANotifyMark> m_fanotify_marks; // by filesystem id
+    QMultiHash<QByteArray, Entry *> m_fanotify_handle_to_entry;
+
+    bool useFANotify(Entry *e);
+    void removeFANotifyHandle(Entry *e);
+    void processFANotifyEvent(quint64 mask, const QByteArray &handle, const char *name);
 #endif
 #if HAVE_QFILESYSTEMWATCHER
     QFileSystemWatcher *fsWatcher;
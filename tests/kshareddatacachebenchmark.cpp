@@ -0,0 +1,340 @@
+/*
+ * This file is part of the KDE project.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+// Measures the performance of KSharedDataCache with several processes using
+// the same cache at once. The main process creates and fills the cache, then
+// runs the requested number of copies of itself as workers which look up and
+// insert random entries, and finally reports the latency percentiles of all
+// operations of all workers together with the statistics of the cache.
+//
+// Run with --help for the available options.
+
+#include <kshareddatacache.h>
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QProcess>
+#include <QVector>
+
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+
+static const char cacheName[] = "kshareddatacachebenchmark";
+
+struct Options {
+    int processes = 4;
+    int operations = 100000;
+    unsigned cacheSize = 64; // in MiB
+    int keyCount = 20000;
+    int minValueSize = 512;
+    int maxValueSize = 16384;
+    int writePercent = 10;
+    int fillPercent = 90;
+    bool zipf = false;
+    KSharedDataCache::EvictionPolicy policy = KSharedDataCache::NoEvictionPreference;
+    unsigned defragmentationBudget = 0;
+    unsigned compressionThreshold = 0;
+    KSharedDataCache::MemoryHints hints = KSharedDataCache::NoMemoryHints;
+};
+
+// Latencies of one kind of operation, in nanoseconds.
+typedef QVector<quint32> Samples;
+
+static QString keyName(int key)
+{
+    return QStringLiteral("benchmark-key-%1").arg(key);
+}
+
+static QByteArray valueFor(int key, std::mt19937 &generator, const Options &options)
+{
+    std::uniform_int_distribution<int> sizes(options.minValueSize, options.maxValueSize);
+    return QByteArray(sizes(generator), static_cast<char>('a' + key % 26));
+}
+
+// Picks keys either uniformly or following a Zipf distribution, where a few
+// keys are used much more often than all others, like icons in a desktop
+// session.
+class KeyPicker
+{
+public:
+    KeyPicker(const Options &options)
+        : m_keyCount(options.keyCount)
+        , m_zipf(options.zipf)
+    {
+        if (m_zipf) {
+            m_cumulative.reserve(m_keyCount);
+            double sum = 0;
+            for (int i = 1; i <= m_keyCount; ++i) {
+                sum += 1.0 / i;
+                m_cumulative.append(sum);
+            }
+        }
+    }
+
+    int operator()(std::mt19937 &generator) const
+    {
+        if (!m_zipf) {
+            return std::uniform_int_distribution<int>(0, m_keyCount - 1)(generator);
+        }
+
+        const double point = std::uniform_real_distribution<double>(0, m_cumulative.last())(generator);
+        const auto it = std::lower_bound(m_cumulative.constBegin(), m_cumulative.constEnd(), point);
+        return qMin(static_cast<int>(it - m_cumulative.constBegin()), m_keyCount - 1);
+    }
+
+private:
+    int m_keyCount;
+    bool m_zipf;
+    QVector<double> m_cumulative;
+};
+
+static int runWorker(const Options &options, int index)
+{
+    // Opening the cache is measured as well, as that is where the memory
+    // hints take effect.
+    QElapsedTimer openTimer;
+    openTimer.start();
+    KSharedDataCache cache(QLatin1String(cacheName), options.cacheSize * 1024 * 1024);
+    cache.setMemoryHints(options.hints);
+    const qint64 openTime = openTimer.nsecsElapsed();
+
+    std::mt19937 generator(index + 1);
+    std::uniform_int_distribution<int> percent(0, 99);
+    const KeyPicker pickKey(options);
+
+    Samples findSamples;
+    Samples insertSamples;
+    findSamples.reserve(options.operations);
+    insertSamples.reserve(options.operations * options.writePercent / 100 + 1);
+
+    QByteArray result;
+    QElapsedTimer operationTimer;
+    QElapsedTimer totalTimer;
+    totalTimer.start();
+
+    for (int i = 0; i < options.operations; ++i) {
+        const int key = pickKey(generator);
+
+        if (percent(generator) < options.writePercent) {
+            const QByteArray value = valueFor(key, generator, options);
+            operationTimer.start();
+            cache.insert(keyName(key), value);
+            insertSamples.append(operationTimer.nsecsElapsed());
+        } else {
+            const QString name = keyName(key);
+            operationTimer.start();
+            cache.find(name, &result);
+            findSamples.append(operationTimer.nsecsElapsed());
+        }
+    }
+
+    const qint64 elapsed = totalTimer.nsecsElapsed();
+
+    // Hand the raw samples to the main process, which merges them with those
+    // of the other workers.
+    QFile output;
+    if (!output.open(stdout, QIODevice::WriteOnly)) {
+        return 1;
+    }
+
+    QDataStream stream(&output);
+    stream << elapsed << openTime << findSamples << insertSamples;
+    return 0;
+}
+
+static void fillCache(KSharedDataCache &cache, const Options &options)
+{
+    std::mt19937 generator(0);
+    const unsigned targetFree = cache.totalSize() / 100 * (100 - options.fillPercent);
+
+    for (int key = 0; key < options.keyCount && cache.freeSize() > targetFree; ++key) {
+        cache.insert(keyName(key), valueFor(key, generator, options));
+    }
+}
+
+static void printSamples(const char *name, Samples samples, qint64 elapsed)
+{
+    if (samples.isEmpty()) {
+        printf("%-8s no operations\n", name);
+        return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](double p) {
+        const int index = qMin(static_cast<int>(samples.size() * p / 100), samples.size() - 1);
+        return samples.at(index) / 1000.0;
+    };
+
+    printf("%-8s %9d ops %10.0f ops/s   p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n",
+           name, samples.size(), elapsed > 0 ? samples.size() * 1e9 / elapsed : 0.0,
+           percentile(50), percentile(90), percentile(99), percentile(99.9), samples.last() / 1000.0);
+}
+
+static int runBenchmark(const Options &options, const QStringList &arguments)
+{
+    KSharedDataCache::deleteCache(QLatin1String(cacheName));
+    KSharedDataCache cache(QLatin1String(cacheName), options.cacheSize * 1024 * 1024);
+    cache.setEvictionPolicy(options.policy);
+    cache.setDefragmentationBudget(options.defragmentationBudget);
+    cache.setCompressionThreshold(options.compressionThreshold);
+
+    QElapsedTimer timer;
+    timer.start();
+    fillCache(cache, options);
+    printf("filled %u of %u KiB in %.1f ms\n", (cache.totalSize() - cache.freeSize()) / 1024,
+           cache.totalSize() / 1024, timer.nsecsElapsed() / 1e6);
+    cache.resetStatistics();
+
+    QVector<QProcess *> workers;
+    for (int i = 0; i < options.processes; ++i) {
+        QProcess *worker = new QProcess;
+        worker->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        worker->start(QCoreApplication::applicationFilePath(),
+                      QStringList(arguments) << QStringLiteral("--worker") << QString::number(i));
+        workers.append(worker);
+    }
+
+    Samples findSamples;
+    Samples insertSamples;
+    qint64 elapsed = 0;
+    qint64 openTime = 0;
+    bool failed = false;
+
+    for (QProcess *worker : qAsConst(workers)) {
+        if (!worker->waitForFinished(-1) || worker->exitCode() != 0) {
+            fprintf(stderr, "worker failed: %s\n", qPrintable(worker->errorString()));
+            failed = true;
+        } else {
+            QByteArray output = worker->readAllStandardOutput();
+            QDataStream stream(&output, QIODevice::ReadOnly);
+            qint64 workerElapsed;
+            qint64 workerOpenTime;
+            Samples workerFindSamples;
+            Samples workerInsertSamples;
+            stream >> workerElapsed >> workerOpenTime >> workerFindSamples >> workerInsertSamples;
+
+            elapsed = qMax(elapsed, workerElapsed);
+            openTime += workerOpenTime;
+            findSamples += workerFindSamples;
+            insertSamples += workerInsertSamples;
+        }
+
+        delete worker;
+    }
+
+    if (failed) {
+        return 1;
+    }
+
+    printf("cache opened in %.1f us on average\n", openTime / 1000.0 / options.processes);
+    printSamples("find", findSamples, elapsed);
+    printSamples("insert", insertSamples, elapsed);
+
+    const KSharedDataCache::Statistics statistics = cache.statistics();
+    const quint64 lookups = statistics.hits + statistics.misses;
+    printf("hit rate %.1f %%, %llu evictions, %llu defragmentations\n",
+           lookups > 0 ? 100.0 * statistics.hits / lookups : 0.0,
+           static_cast<unsigned long long>(statistics.evictions),
+           static_cast<unsigned long long>(statistics.defragmentations));
+    printf("lock acquired %llu times, held %.1f us on average, %llu timeouts\n",
+           static_cast<unsigned long long>(statistics.lockCount),
+           statistics.lockCount > 0 ? statistics.lockHoldTime / 1000.0 / statistics.lockCount : 0.0,
+           static_cast<unsigned long long>(statistics.lockTimeouts));
+
+    KSharedDataCache::deleteCache(QLatin1String(cacheName));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Benchmarks KSharedDataCache used by several processes at once."));
+    parser.addHelpOption();
+
+    const QCommandLineOption processesOption(QStringLiteral("processes"), QStringLiteral("Number of worker processes."), QStringLiteral("count"), QStringLiteral("4"));
+    const QCommandLineOption operationsOption(QStringLiteral("operations"), QStringLiteral("Number of operations per worker."), QStringLiteral("count"), QStringLiteral("100000"));
+    const QCommandLineOption cacheSizeOption(QStringLiteral("cache-size"), QStringLiteral("Size of the cache in MiB."), QStringLiteral("size"), QStringLiteral("64"));
+    const QCommandLineOption keysOption(QStringLiteral("keys"), QStringLiteral("Number of distinct keys."), QStringLiteral("count"), QStringLiteral("20000"));
+    const QCommandLineOption minSizeOption(QStringLiteral("min-value-size"), QStringLiteral("Minimum size of values in bytes."), QStringLiteral("size"), QStringLiteral("512"));
+    const QCommandLineOption maxSizeOption(QStringLiteral("max-value-size"), QStringLiteral("Maximum size of values in bytes."), QStringLiteral("size"), QStringLiteral("16384"));
+    const QCommandLineOption writesOption(QStringLiteral("writes"), QStringLiteral("Percentage of operations which insert an entry."), QStringLiteral("percent"), QStringLiteral("10"));
+    const QCommandLineOption fillOption(QStringLiteral("fill"), QStringLiteral("Percentage of the cache filled before starting the workers."), QStringLiteral("percent"), QStringLiteral("90"));
+    const QCommandLineOption zipfOption(QStringLiteral("zipf"), QStringLiteral("Use some keys much more often than others, instead of all keys equally often."));
+    const QCommandLineOption policyOption(QStringLiteral("policy"), QStringLiteral("Eviction policy: lru, lfu, oldest or scan-resistant."), QStringLiteral("policy"));
+    const QCommandLineOption budgetOption(QStringLiteral("defragmentation-budget"), QStringLiteral("Maximum number of bytes to move per defragmentation."), QStringLiteral("bytes"), QStringLiteral("0"));
+    const QCommandLineOption compressionOption(QStringLiteral("compression-threshold"), QStringLiteral("Minimum size of values to compress, 0 to disable compression."), QStringLiteral("bytes"), QStringLiteral("0"));
+    const QCommandLineOption hintsOption(QStringLiteral("hints"), QStringLiteral("Memory hints for the workers: none, prefault, hugepages or both."), QStringLiteral("hints"), QStringLiteral("none"));
+    QCommandLineOption workerOption(QStringLiteral("worker"), QStringLiteral("Internal: run as worker with the given index."), QStringLiteral("index"));
+    workerOption.setFlags(QCommandLineOption::HiddenFromHelp);
+
+    parser.addOptions({processesOption, operationsOption, cacheSizeOption, keysOption, minSizeOption,
+                       maxSizeOption, writesOption, fillOption, zipfOption, policyOption, budgetOption,
+                       compressionOption, hintsOption, workerOption});
+    parser.process(app);
+
+    Options options;
+    options.processes = qMax(1, parser.value(processesOption).toInt());
+    options.operations = qMax(1, parser.value(operationsOption).toInt());
+    options.cacheSize = qMax(1u, parser.value(cacheSizeOption).toUInt());
+    options.keyCount = qMax(1, parser.value(keysOption).toInt());
+    options.minValueSize = qMax(0, parser.value(minSizeOption).toInt());
+    options.maxValueSize = qMax(options.minValueSize, parser.value(maxSizeOption).toInt());
+    options.writePercent = qBound(0, parser.value(writesOption).toInt(), 100);
+    options.fillPercent = qBound(0, parser.value(fillOption).toInt(), 100);
+    options.zipf = parser.isSet(zipfOption);
+    options.defragmentationBudget = parser.value(budgetOption).toUInt();
+    options.compressionThreshold = parser.value(compressionOption).toUInt();
+
+    const QString policy = parser.value(policyOption);
+    if (policy == QLatin1String("lru")) {
+        options.policy = KSharedDataCache::EvictLeastRecentlyUsed;
+    } else if (policy == QLatin1String("lfu")) {
+        options.policy = KSharedDataCache::EvictLeastOftenUsed;
+    } else if (policy == QLatin1String("oldest")) {
+        options.policy = KSharedDataCache::EvictOldest;
+    } else if (policy == QLatin1String("scan-resistant")) {
+        options.policy = KSharedDataCache::EvictScanResistant;
+    } else if (!policy.isEmpty()) {
+        fprintf(stderr, "unknown eviction policy: %s\n", qPrintable(policy));
+        return 1;
+    }
+
+    const QString hints = parser.value(hintsOption);
+    if (hints == QLatin1String("prefault")) {
+        options.hints = KSharedDataCache::PrefaultMemory;
+    } else if (hints == QLatin1String("hugepages")) {
+        options.hints = KSharedDataCache::TransparentHugePages;
+    } else if (hints == QLatin1String("both")) {
+        options.hints = KSharedDataCache::PrefaultMemory | KSharedDataCache::TransparentHugePages;
+    } else if (hints != QLatin1String("none")) {
+        fprintf(stderr, "unknown memory hints: %s\n", qPrintable(hints));
+        return 1;
+    }
+
+    if (parser.isSet(workerOption)) {
+        return runWorker(options, parser.value(workerOption).toInt());
+    }
+
+    return runBenchmark(options, app.arguments().mid(1));
+}